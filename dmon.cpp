@@ -7,410 +7,2088 @@
  *
  * Author: Yang Yi <yyrust@gmail.com>
  */
-#include <cstddef>
-#include <string>
-#include <vector>
-#include <cstdio>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <cstring>
-#include <cerrno>
-#include <dirent.h>
-#include <sys/time.h>
-#include <rapidjson/writer.h>
-#include <rapidjson/prettywriter.h>
-#include <rapidjson/filewritestream.h>
-#include <rapidjson/filereadstream.h>
-#include <rapidjson/error/en.h>
-#include <rapidjson/document.h>
-#include <algorithm>
-
-using namespace rapidjson;
-typedef GenericDocument<UTF8<> > JDocument;
-typedef GenericValue<UTF8<> > JValue;
-
-enum FileType {
-    FILE_TYPE_UNKNOWN = 0,
-    FILE_TYPE_REGULAR = 1,
-    FILE_TYPE_DIRECTORY = 2,
-    FILE_TYPE_LINK = 3,
+#include "dmon_internal.h"
+#include <getopt.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Parses the argument of --depth, the number of levels of directories
+// kept as nodes below the root.
+bool parse_depth(const char *arg, int *depth)
+{
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < 0) {
+        LOG("invalid depth %s", arg);
+        return false;
+    }
+    *depth = std::min(value, long(FileTree::MAX_DEPTH));
+    return true;
+}
+
+int cmd_stat(int argc, char *args[])
+{
+    ScanOptions options;
+    int version = SNAPSHOT_VERSION;
+    bool binary = false;
+    JsonOptions json;
+    const char *since = NULL;
+    bool trust_mtime = false;
+    uint32_t rescan_every = 24;
+    const char *stats = NULL;
+    ScanStats scan_stats;
+    enum {
+        OPT_BACKEND = 256,
+        OPT_FULL_PATHS,
+        OPT_BINARY,
+        OPT_SINCE,
+        OPT_TRUST_DIR_MTIME,
+        OPT_RESCAN_EVERY,
+        OPT_DEPTH,
+        OPT_SUMMARY,
+        OPT_STATS,
+        OPT_COMPACT,
+        OPT_COMPRESS,
+        OPT_EXCLUDE,
+        OPT_INCLUDE,
+        OPT_BY,
+        OPT_COUNTS,
+        OPT_CHECKPOINT,
+        OPT_CHECKPOINT_EVERY,
+        OPT_RESUME,
+        OPT_SHARD,
+        OPT_MAX_OPS,
+        OPT_TARGET_LATENCY,
+        OPT_SPILL_AFTER,
+        OPT_SPILL_DIR,
+    };
+    static const struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"one-file-system", no_argument, NULL, 'x'},
+        {"count-links", no_argument, NULL, 'l'},
+        {"backend", required_argument, NULL, OPT_BACKEND},
+        {"full-paths", no_argument, NULL, OPT_FULL_PATHS},
+        {"binary", no_argument, NULL, OPT_BINARY},
+        {"since", required_argument, NULL, OPT_SINCE},
+        {"trust-dir-mtime", no_argument, NULL, OPT_TRUST_DIR_MTIME},
+        {"rescan-every", required_argument, NULL, OPT_RESCAN_EVERY},
+        {"depth", required_argument, NULL, OPT_DEPTH},
+        {"summary", no_argument, NULL, OPT_SUMMARY},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"compact", no_argument, NULL, OPT_COMPACT},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {"by", required_argument, NULL, OPT_BY},
+        {"counts", no_argument, NULL, OPT_COUNTS},
+        {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+        {"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+        {"resume", no_argument, NULL, OPT_RESUME},
+        {"shard", required_argument, NULL, OPT_SHARD},
+        {"max-ops", required_argument, NULL, OPT_MAX_OPS},
+        {"target-latency", required_argument, NULL, OPT_TARGET_LATENCY},
+        {"spill-after", required_argument, NULL, OPT_SPILL_AFTER},
+        {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+        {NULL, 0, NULL, 0},
+    };
+    if (const char *tmpdir = getenv("TMPDIR")) {
+        options.spill_.dir_ = tmpdir;
+    }
+    // args[-1] is the command name, which getopt takes as argv[0]
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "j:xl", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            options.jobs_ = strtoul(optarg, NULL, 10);
+            if (options.jobs_ == 0) {
+                options.jobs_ = std::max(1u, std::thread::hardware_concurrency());
+            }
+            break;
+        case 'x':
+            options.one_filesystem_ = true;
+            break;
+        case 'l':
+            options.count_links_ = true;
+            break;
+        case OPT_BACKEND:
+            options.backend_ = optarg;
+            break;
+        case OPT_FULL_PATHS:
+            version = 1;
+            break;
+        case OPT_BINARY:
+            binary = true;
+            break;
+        case OPT_SINCE:
+            since = optarg;
+            break;
+        case OPT_TRUST_DIR_MTIME:
+            trust_mtime = true;
+            break;
+        case OPT_RESCAN_EVERY:
+            rescan_every = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_DEPTH:
+            if (!parse_depth(optarg, &options.depth_)) {
+                return -1;
+            }
+            break;
+        case OPT_SUMMARY:
+            options.summarize_ = true;
+            break;
+        case OPT_STATS:
+            stats = optarg ? optarg : "text";
+            if (0 != strcmp("text", stats) && 0 != strcmp("json", stats)) {
+                LOG("unknown stats format %s, expect text or json", stats);
+                return -1;
+            }
+            options.stats_ = &scan_stats;
+            break;
+        case OPT_COMPACT:
+            json.compact_ = true;
+            break;
+        case OPT_COMPRESS:
+            if (!parse_compression(optarg, &json.compression_)) {
+                LOG("unknown compression %s, expect none, gzip or zstd if built with it", optarg);
+                return -1;
+            }
+            break;
+        case OPT_EXCLUDE:
+            options.excludes_.push_back(optarg);
+            break;
+        case OPT_INCLUDE:
+            options.includes_.push_back(optarg);
+            break;
+        case OPT_BY:
+            if (!Breakdown::parse_dimensions(optarg, &options.breakdown_by_)) {
+                LOG("unknown breakdown %s, expect a list of uid, gid and ext", optarg);
+                return -1;
+            }
+            break;
+        case OPT_COUNTS:
+            options.counted_ = true;
+            break;
+        case OPT_CHECKPOINT:
+            options.checkpoint_ = optarg;
+            break;
+        case OPT_CHECKPOINT_EVERY:
+            options.checkpoint_every_ = strtod(optarg, NULL);
+            if (!(options.checkpoint_every_ > 0)) {
+                LOG("invalid --checkpoint-every %s, expect seconds", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RESUME:
+            options.resume_ = true;
+            break;
+        case OPT_SHARD:
+            if (sscanf(optarg, "%u/%u", &options.shard_, &options.nshards_) != 2
+                    || options.nshards_ == 0 || options.shard_ >= options.nshards_) {
+                LOG("invalid --shard %s, expect i/N with i < N", optarg);
+                return -1;
+            }
+            break;
+        case OPT_MAX_OPS:
+            options.max_ops_ = strtod(optarg, NULL);
+            if (!(options.max_ops_ > 0)) {
+                LOG("invalid --max-ops %s, expect entries per second", optarg);
+                return -1;
+            }
+            break;
+        case OPT_TARGET_LATENCY:
+            options.target_latency_ = strtod(optarg, NULL) / 1000;
+            if (!(options.target_latency_ > 0)) {
+                LOG("invalid --target-latency %s, expect milliseconds", optarg);
+                return -1;
+            }
+            break;
+        case OPT_SPILL_AFTER:
+            options.spill_.after_ = strtoul(optarg, NULL, 10);
+            if (options.spill_.after_ == 0) {
+                LOG("invalid --spill-after %s, expect a number of entries", optarg);
+                return -1;
+            }
+            break;
+        case OPT_SPILL_DIR:
+            options.spill_.dir_ = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc != 1) {
+        LOG("expect one argument: %s", "dir");
+        return -1;
+    }
+    const char *root = args[0];
+    if (options.resume_ && options.checkpoint_.empty()) {
+        LOG("%s", "--resume needs --checkpoint=file");
+        return -1;
+    }
+    if (options.nshards_ > 1 && options.depth_ < 1) {
+        LOG("%s", "--shard needs a --depth of 1 or more");
+        return -1;
+    }
+    if (options.spill_.after_ > 0 && binary) {
+        // BinaryWriter lays out every node in memory
+        LOG("%s", "--spill-after writes JSON snapshots only");
+        return -1;
+    }
+    const char *backend_name = ScanBackend::choose(options.backend_, root);
+    ScanBackend *backend = ScanBackend::create(backend_name);
+    if (!backend) {
+        LOG("unknown backend %s, expect posix, uring or auto", backend_name);
+        return -1;
+    }
+    delete backend;
+
+    // the old snapshot says how many incremental walks were done since the
+    // last full one
+    Snapshot old_snapshot;
+    uint32_t generation = 0;
+    double start = now_sec();
+    if (since) {
+        if (!old_snapshot.load(since)) {
+            LOG("failed to load %s", since);
+            return -1;
+        }
+        scan_stats.add_phase("load", now_sec() - start);
+        start = now_sec();
+        generation = 1 + (old_snapshot.is_binary_ ? old_snapshot.binary_.generation() : old_snapshot.tree_.generation());
+        if (rescan_every > 0 && generation >= rescan_every) {
+            LOG("%u walks since the last full one, walking it all", generation);
+            since = NULL;
+            generation = 0;
+        }
+    }
+
+    if (options.target_latency_ > 0 && (options.jobs_ <= 1 || since || !options.checkpoint_.empty())) {
+        LOG("%s", "WARN: --target-latency only adapts a walk with -j, ignoring it");
+        options.target_latency_ = 0;
+    }
+    FileTree tree;
+    if (!since) {
+        if (!options.checkpoint_.empty() && options.jobs_ > 1) {
+            LOG("WARN: --checkpoint walks with one thread, ignoring -j %zu", options.jobs_);
+        }
+        scan(root, options, tree);
+    }
+    else {
+        if (options.jobs_ > 1) {
+            LOG("WARN: --since walks with one thread, ignoring -j %zu", options.jobs_);
+        }
+        if (!options.checkpoint_.empty()) {
+            LOG("WARN: --since does not checkpoint, ignoring --checkpoint %s", options.checkpoint_.c_str());
+            options.checkpoint_.clear();
+        }
+        if (options.spill_.after_ > 0) {
+            LOG("%s", "WARN: --since compares the sub files in memory, ignoring --spill-after");
+            options.spill_.after_ = 0;
+        }
+        prepare_scan(tree, root, options);
+        if (old_snapshot.is_binary_) {
+            walk_since(tree, backend_name, old_snapshot.binary_, trust_mtime, options.depth_);
+        }
+        else {
+            walk_since(tree, backend_name, FileTreeView(old_snapshot.tree_), trust_mtime, options.depth_);
+        }
+    }
+    tree.set_generation(generation);
+    scan_stats.add_phase("walk", now_sec() - start);
+
+    start = now_sec();
+    json.jobs_ = options.jobs_;
+    bool ok = !write_snapshot(tree, root, binary, version, json).empty();
+    scan_stats.add_phase("write", now_sec() - start);
+    if (ok && !options.checkpoint_.empty()) {
+        unlink(options.checkpoint_.c_str());
+    }
+    if (stats) {
+        scan_stats.report(0 == strcmp("json", stats));
+    }
+    return ok ? 0 : -1;
+}
+
+// The walk as it was before the fd-relative backends: opendir() and lstat()
+// on full paths, so the kernel resolves every component for every entry.
+// Only kept as the baseline for `dmon bench`.
+class LstatScanBackend : public ScanBackend
+{
+public:
+    virtual const char *name() const { return "lstat(path)"; }
+
+    virtual DirStream *open(int fd, const std::string &path)
+    {
+        close(fd);
+        DIR *dir = opendir(path.c_str());
+        if (!dir) {
+            return NULL;
+        }
+        return new Stream(dir, path);
+    }
+
+private:
+    class Stream : public DirStream
+    {
+    public:
+        Stream(DIR *dir, const std::string &path)
+        : DirStream(dirfd(dir))
+        , dir_(dir)
+        , path_(path)
+        {}
+
+        virtual ~Stream()
+        {
+            closedir(dir_);
+        }
+
+        virtual bool next(std::vector<DirEntry> &entries)
+        {
+            entries.clear();
+            struct dirent *ent;
+            while ((ent = readdir(dir_)) != NULL) {
+                if (0 == strcmp(".", ent->d_name) || 0 == strcmp("..", ent->d_name)) {
+                    continue;
+                }
+                DirEntry entry;
+                entry.name_ = ent->d_name;
+                entry.error_ = 0;
+                if (lstat(join_path(path_, ent->d_name).c_str(), &entry.st_) != 0) {
+                    entry.error_ = errno;
+                }
+                entries.push_back(entry);
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        DIR *dir_;
+        std::string path_;
+    };
 };
 
-const size_t BLOCK_SIZE = 512;
-const char SEP = '/';
+// Times walk() with each backend against the lstat(path) baseline on the
+// same tree.  Rounds alternate between them so that all see a warm
+// dentry/inode cache.
+int cmd_bench(int argc, char *args[])
+{
+    size_t rounds = 3;
+    optind = 1;
+    int opt;
+    while ((opt = getopt(argc + 1, args - 1, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = std::max(1ul, strtoul(optarg, NULL, 10));
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc != 1) {
+        LOG("expect one argument: %s", "dir");
+        return -1;
+    }
+    const char *root = args[0];
+    ScanBackend *backends[] = {
+        new LstatScanBackend(),
+        ScanBackend::create("posix"),
+        ScanBackend::create("uring"),
+    };
+    const size_t nwalks = sizeof(backends) / sizeof(backends[0]);
+    double elapsed[nwalks] = {0};
+    size_t nfiles[nwalks] = {0};
+    size_t sizes[nwalks] = {0};
+    size_t memory = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < nwalks; i++) {
+            FileTree tree;
+            tree.set_root(root);
+            double start = now_sec();
+            // keep every entry so they can be counted
+            tree.walk(*backends[i], FileTree::MAX_DEPTH);
+            elapsed[i] += now_sec() - start;
+            nfiles[i] = tree.size();
+            sizes[i] = tree.root().size_;
+            memory = tree.memory_usage();
+        }
+    }
+    printf("%zu entries, %zu rounds, %.1f bytes/entry\n", nfiles[0], rounds, (double)memory / nfiles[0]);
+    for (size_t i = 0; i < nwalks; i++) {
+        const char *name = backends[i]->name();
+        double seconds = elapsed[i] / rounds;
+        printf("%-12s  %.3fs  %.0f ns/entry\n", name, seconds, seconds / nfiles[i] * 1e9);
+        if (nfiles[i] != nfiles[0] || sizes[i] != sizes[0]) {
+            LOG("%s disagrees with %s on %s, was the tree modified?", name, backends[0]->name(), root);
+        }
+    }
+    for (size_t i = 0; i < nwalks; i++) {
+        delete backends[i];
+    }
+    return 0;
+}
+
+// How `dmon diff` prints a record.
+void log_diff_record(const DiffRecord &record)
+{
+    const char *path = record.path_;
+    switch (record.kind_) {
+    case DiffRecord::GREW:
+        LOG("%s\t+%s", path, r_sz(record.new_size_ - record.old_size_));
+        break;
+    case DiffRecord::ADDED:
+        LOG("%s\tnew +%s", path, r_sz(record.new_size_));
+        break;
+    case DiffRecord::REMOVED:
+        LOG("%s\tdel -%s", path, r_sz(record.old_size_));
+        break;
+    case DiffRecord::LARGEST_GREW:
+        LOG("%s\tlargest +%s", path, r_sz(record.new_size_ - record.old_size_));
+        break;
+    case DiffRecord::LARGEST_NEW:
+        LOG("%s\tlargest %s", path, r_sz(record.new_size_));
+        break;
+    case DiffRecord::ENTRIES:
+        LOG("%s\tentries %+lld", path, (long long)record.new_size_ - (long long)record.old_size_);
+        break;
+    case DiffRecord::FILES:
+        LOG("%s\tfiles %+lld", path, (long long)record.new_size_ - (long long)record.old_size_);
+        break;
+    case DiffRecord::BREAKDOWN:
+        if (record.new_size_ >= record.old_size_) {
+            LOG("%s\t+%s", path, r_sz(record.new_size_ - record.old_size_));
+        }
+        else {
+            LOG("%s\t-%s", path, r_sz(record.old_size_ - record.new_size_));
+        }
+        break;
+    }
+}
+
+int cmd_diff(int argc, char *args[])
+{
+    bool stream = false;
+    bool formatted = false;
+    DiffWriter::Format format = DiffWriter::FORMAT_TSV;
+    size_t top_n = 0;
+    TopDiffs::Rank rank = TopDiffs::RANK_BYTES;
+    size_t njobs = 1;
+    enum {
+        OPT_STREAM = 256,
+        OPT_FORMAT,
+        OPT_TOP,
+        OPT_RANK,
+    };
+    static const struct option long_options[] = {
+        {"stream", no_argument, NULL, OPT_STREAM},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"top", required_argument, NULL, OPT_TOP},
+        {"rank", required_argument, NULL, OPT_RANK},
+        {NULL, 0, NULL, 0},
+    };
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            njobs = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STREAM:
+            stream = true;
+            break;
+        case OPT_FORMAT:
+            if (!DiffWriter::parse_format(optarg, &format)) {
+                LOG("invalid format %s, expect tsv, json or ndjson", optarg);
+                return -1;
+            }
+            formatted = true;
+            break;
+        case OPT_TOP:
+            top_n = strtoul(optarg, NULL, 10);
+            if (top_n == 0) {
+                LOG("invalid --top %s, expect a positive count", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RANK:
+            if (!TopDiffs::parse_rank(optarg, &rank)) {
+                LOG("invalid --rank %s, expect bytes or files", optarg);
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc != 2) {
+        LOG("expect two argument: %s %s", "old_stat.json", "new_stat.json");
+        return -1;
+    }
+
+    Snapshot old_snapshot, new_snapshot;
+    LOG("loading %s", args[0]);
+    if (!old_snapshot.load(args[0], stream)) {
+        LOG("failed to load %s", args[0]);
+        return -1;
+    }
+    LOG("loading %s", args[1]);
+    if (!new_snapshot.load(args[1], stream)) {
+        LOG("failed to load %s", args[1]);
+        return -1;
+    }
+    LOG("comparing %s %s", args[0], args[1]);
+    DiffCallback output = log_diff_record;
+    std::unique_ptr<DiffWriter> writer;
+    if (formatted) {
+        writer.reset(new DiffWriter(stdout, format));
+        DiffWriter *w = writer.get();
+        output = [w](const DiffRecord &record) { w->write(record); };
+    }
+    bool ok;
+    if (top_n) {
+        TopDiffs top(top_n, rank);
+        ok = diff_snapshots(new_snapshot, old_snapshot, [&top](const DiffRecord &record) {
+            top.offer(record);
+        }, njobs);
+        top.report(output);
+    }
+    else {
+        ok = diff_snapshots(new_snapshot, old_snapshot, output, njobs);
+    }
+    if (writer && !writer->finish()) {
+        LOG("failed to write the report: %s", strerror(errno));
+        return -1;
+    }
+    if (!ok) {
+        LOG("failed to compare %s %s, the report is incomplete", args[0], args[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// Converts a JSON snapshot to binary and the other way round.
+int cmd_convert(int argc, char *args[])
+{
+    int version = SNAPSHOT_VERSION;
+    JsonOptions json;
+    enum {
+        OPT_FULL_PATHS = 256,
+        OPT_COMPACT,
+        OPT_COMPRESS,
+    };
+    static const struct option long_options[] = {
+        {"full-paths", no_argument, NULL, OPT_FULL_PATHS},
+        {"compact", no_argument, NULL, OPT_COMPACT},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {NULL, 0, NULL, 0},
+    };
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            json.jobs_ = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_FULL_PATHS:
+            version = 1;
+            break;
+        case OPT_COMPACT:
+            json.compact_ = true;
+            break;
+        case OPT_COMPRESS:
+            if (!parse_compression(optarg, &json.compression_)) {
+                LOG("unknown compression %s, expect none, gzip or zstd if built with it", optarg);
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc != 2) {
+        LOG("expect two argument: %s %s", "input", "output");
+        return -1;
+    }
+    Snapshot snapshot;
+    if (!snapshot.load(args[0])) {
+        LOG("failed to load %s", args[0]);
+        return -1;
+    }
+    if (snapshot.is_binary_) {
+        return write_json_file(snapshot.binary_, args[1], version, json) ? 0 : -1;
+    }
+    BinaryWriter writer(snapshot.tree_);
+    return writer.write(args[1]) ? 0 : -1;
+}
+
+int cmd_merge(int argc, char *args[])
+{
+    JsonOptions json;
+    enum {
+        OPT_COMPACT = 256,
+        OPT_COMPRESS,
+    };
+    static const struct option long_options[] = {
+        {"compact", no_argument, NULL, OPT_COMPACT},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {NULL, 0, NULL, 0},
+    };
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_COMPACT:
+            json.compact_ = true;
+            break;
+        case OPT_COMPRESS:
+            if (!parse_compression(optarg, &json.compression_)) {
+                LOG("unknown compression %s, expect none, gzip or zstd if built with it", optarg);
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc < 2) {
+        LOG("expect two argument or more: %s %s...", "output", "shard");
+        return -1;
+    }
+    std::vector<std::string> shards(args + 1, args + argc);
+    return merge_shards(shards, args[0], json) ? 0 : -1;
+}
+
+// Keeps a FileTree current from inotify events, for `dmon watch`.
+//
+// Every directory is watched, including those below the kept depth, whose
+// sizes are only rolled up into the deepest directory that is a node.  A
+// watch only remembers the path of its directory, and nodes are looked up
+// by path when events are applied, so that node ids may change under it.
+//
+// Events are collected in batches and applied once per batch:
+//
+//   - a file written in a kept directory is stat'ed again, and the change
+//     of its size is added to every directory above it;
+//   - a kept directory with files created, deleted or renamed is listed
+//     again: sub files still there keep their nodes and subtrees, new sub
+//     directories are walked and watched, and the watches of the ones gone
+//     are dropped;
+//   - any change below the kept depth walks again the subtree of the
+//     deepest node above it.
+//
+// Contrary to fanotify, inotify needs no privileges and reports renames,
+// but needs a watch per directory, see fs.inotify.max_user_watches.  An
+// event queue overflow walks the whole tree again.
+class Watcher
+{
+public:
+    Watcher(FileTree &tree, ScanBackend &backend, int depth)
+    : tree_(tree)
+    , backend_(backend)
+    , depth_(depth)
+    , fd_(-1)
+    , full_(false)
+    , warned_(false)
+    {}
+
+    ~Watcher()
+    {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    int fd() const { return fd_; }
+
+    // Walks root and watches its directories.
+    bool start(const std::string &root)
+    {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        paths_.clear();
+        wds_.clear();
+        fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0) {
+            LOG("inotify_init1() failed: %s", strerror(errno));
+            return false;
+        }
+        if (!tree_.set_root(root)) {
+            return false;
+        }
+        if (tree_.root().type_ == FILE_TYPE_DIRECTORY) {
+            scan(open_dir(AT_FDCWD, root.c_str()), root, 0, 0);
+        }
+        LOG("watching %zu directories", paths_.size());
+        return true;
+    }
+
+    // Reads the pending events and applies them.
+    void process()
+    {
+        char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+        for (;;) {
+            ssize_t len = read(fd_, buf, sizeof(buf));
+            if (len <= 0) {
+                break;
+            }
+            for (char *p = buf; p < buf + len; ) {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+                collect(*event);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        apply();
+    }
+
+private:
+    static const uint32_t MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    void collect(const struct inotify_event &event)
+    {
+        if (event.mask & IN_Q_OVERFLOW) {
+            LOG("WARN: inotify queue overflow, walking it all again%s", "");
+            full_ = true;
+            return;
+        }
+        std::unordered_map<int, std::string>::iterator it = paths_.find(event.wd);
+        if (it == paths_.end()) {
+            return;
+        }
+        const std::string &path = it->second;
+        if (event.mask & IN_IGNORED) {
+            std::map<std::string, int>::iterator wd = wds_.find(path);
+            if (wd != wds_.end() && wd->second == event.wd) {
+                wds_.erase(wd);
+            }
+            paths_.erase(it);
+            return;
+        }
+        int level;
+        bool exact;
+        NodeId id = find(path, &exact, &level);
+        if (exact && level < depth_) {
+            if (event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                relists_.insert(path);
+            }
+            else if (event.len > 0) {
+                written_.insert(join_path(path, event.name));
+            }
+        }
+        else if (level >= depth_) {
+            rescans_.insert(tree_.path(id));
+        }
+        // else a new sub directory of a kept one, which is listed again
+    }
+
+    void apply()
+    {
+        if (full_) {
+            std::string root = tree_.name_str(tree_.root());
+            full_ = false;
+            relists_.clear();
+            written_.clear();
+            rescans_.clear();
+            start(root);
+            return;
+        }
+        for (std::set<std::string>::iterator it = relists_.begin(); it != relists_.end(); ++it) {
+            int level;
+            bool exact;
+            NodeId id = find(*it, &exact, &level);
+            if (exact && level < depth_) {
+                relist(id, *it, level);
+            }
+        }
+        for (std::set<std::string>::iterator it = written_.begin(); it != written_.end(); ++it) {
+            update(*it);
+        }
+        for (std::set<std::string>::iterator it = rescans_.begin(); it != rescans_.end(); ++it) {
+            int level;
+            bool exact;
+            NodeId id = find(*it, &exact, &level);
+            if (exact) {
+                rescan(id, *it);
+            }
+        }
+        relists_.clear();
+        written_.clear();
+        rescans_.clear();
+    }
+
+    // Adds delta to the size of every directory above id.
+    void propagate(NodeId id, uint64_t delta)
+    {
+        for (NodeId parent = tree_.node(id).parent_; parent != NO_NODE; parent = tree_.node(parent).parent_) {
+            tree_.node(parent).size_ += delta;
+        }
+    }
+
+    void change_size(NodeId id, uint64_t size)
+    {
+        FileInfo &file = tree_.node(id);
+        uint64_t delta = size - file.size_;
+        file.size_ = size;
+        propagate(id, delta);
+    }
+
+    // Looks up the node of path.  If there is none, returns the deepest
+    // node above it and sets *exact to false.  *level is the depth of the
+    // node returned, the root being at 0.
+    NodeId find(const std::string &path, bool *exact, int *level) const
+    {
+        const FileInfo &root = tree_.root();
+        NodeId id = 0;
+        *level = 0;
+        *exact = false;
+        if (path.compare(0, root.name_len_, tree_.name(root), root.name_len_) != 0) {
+            return id;
+        }
+        size_t pos = root.name_len_;
+        while (pos < path.size() && path[pos] == SEP) {
+            pos++;
+        }
+        while (pos < path.size()) {
+            size_t end = path.find(SEP, pos);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            NodeId sub = find_sub(id, path.data() + pos, end - pos);
+            if (sub == NO_NODE) {
+                return id;
+            }
+            id = sub;
+            ++*level;
+            pos = end + 1;
+        }
+        *exact = true;
+        return id;
+    }
+
+    NodeId find_sub(NodeId id, const char *name, size_t len) const
+    {
+        const FileInfo &file = tree_.node(id);
+        for (uint32_t i = 0; i < file.nsubs_; i++) {
+            const FileInfo &sub = tree_.node(file.first_sub_ + i);
+            if (sub.name_len_ == len && 0 == memcmp(tree_.name(sub), name, len)) {
+                return file.first_sub_ + i;
+            }
+        }
+        return NO_NODE;
+    }
+
+    void add_watch(const std::string &path)
+    {
+        int wd = inotify_add_watch(fd_, path.c_str(), MASK);
+        if (wd < 0) {
+            if (errno != ENOENT && !warned_) {
+                LOG("WARN: cannot watch %s: %s, changes below it are missed", path.c_str(), strerror(errno));
+                warned_ = true;
+            }
+            return;
+        }
+        paths_[wd] = path;
+        wds_[path] = wd;
+    }
+
+    // Drops the watches of path and of every directory below it.
+    void forget(const std::string &path)
+    {
+        std::map<std::string, int>::iterator it = wds_.lower_bound(path);
+        while (it != wds_.end() && 0 == it->first.compare(0, path.size(), path)
+                && (it->first.size() == path.size() || it->first[path.size()] == SEP)) {
+            std::unordered_map<int, std::string>::iterator watch = paths_.find(it->second);
+            if (watch != paths_.end() && watch->second == it->first) {
+                inotify_rm_watch(fd_, it->second);
+                paths_.erase(watch);
+            }
+            wds_.erase(it++);
+        }
+    }
+
+    // Like FileTree::walk_at(), but watches every directory, and level is
+    // the depth of node id, or of the deepest node above when id is
+    // NO_NODE.
+    size_t scan(int fd, const std::string &path, NodeId id, int level, uint64_t *nentries = NULL)
+    {
+        DirListing listing;
+        DirStream *stream = list_dir(backend_, fd, path, listing, &tree_.filter());
+        bool keep = (id != NO_NODE && level < depth_);
+        if (id != NO_NODE && (!stream || !keep)) {
+            tree_.set_stamp(id, DirStamp());
+        }
+        if (!stream) {
+            return 0;
+        }
+        add_watch(path);
+        NodeId first = keep ? tree_.add_subs(id, listing) : NO_NODE;
+        bool summarize = tree_.summarize() && id != NO_NODE && !keep;
+        DirSummary summary;
+        summary.entries_ = listing.entries_.size();
+        size_t sub_size = 0;
+        for (size_t i = 0; i < listing.entries_.size(); i++) {
+            const DirListing::Entry &entry = listing.entries_[i];
+            const char *name = listing.name(entry);
+            size_t size = entry.size_;
+            if (entry.type_ == FILE_TYPE_DIRECTORY) {
+                NodeId sub_id = (first != NO_NODE) ? first + i : NO_NODE;
+                size += scan(open_dir(stream->fd(), name), join_path(path, name), sub_id,
+                        (sub_id != NO_NODE) ? level + 1 : level,
+                        (summarize || nentries) ? &summary.entries_ : NULL);
+            }
+            if (summarize) {
+                summary.offer(name, entry.name_len_, size);
+            }
+            sub_size += size;
+        }
+        delete stream;
+        if (id != NO_NODE) {
+            tree_.node(id).size_ += sub_size;
+        }
+        if (summarize) {
+            tree_.set_summary(id, summary);
+        }
+        if (nentries) {
+            *nentries += summary.entries_;
+        }
+        return sub_size;
+    }
+
+    // Lists the kept directory id again, see the class comment.
+    void relist(NodeId id, const std::string &path, int level)
+    {
+        DirListing listing;
+        DirStream *stream = list_dir(backend_, open_dir(AT_FDCWD, path.c_str()), path, listing, &tree_.filter());
+        if (!stream) {
+            return;
+        }
+        FileInfo old = tree_.node(id);
+        std::unordered_map<std::string, NodeId> old_subs;
+        uint64_t old_subs_size = 0;
+        for (uint32_t i = 0; i < old.nsubs_; i++) {
+            const FileInfo &sub = tree_.node(old.first_sub_ + i);
+            old_subs[tree_.name_str(sub)] = old.first_sub_ + i;
+            old_subs_size += sub.size_;
+        }
+
+        NodeId first = tree_.add_subs(id, listing);
+        uint64_t subs_size = 0;
+        for (size_t i = 0; i < listing.entries_.size(); i++) {
+            const DirListing::Entry &entry = listing.entries_[i];
+            const char *name = listing.name(entry);
+            NodeId sub_id = first + i;
+            FileInfo &sub = tree_.node(sub_id);
+            std::unordered_map<std::string, NodeId>::iterator it = old_subs.find(name);
+            if (it != old_subs.end() && tree_.node(it->second).type_ == entry.type_) {
+                const FileInfo &older = tree_.node(it->second);
+                if (entry.type_ == FILE_TYPE_DIRECTORY) {
+                    sub.size_ = older.size_;
+                    sub.first_sub_ = older.first_sub_;
+                    sub.nsubs_ = older.nsubs_;
+                    tree_.set_stamp(sub_id, tree_.stamp(it->second));
+                    if (tree_.summary(it->second)) {
+                        DirSummary summary = *tree_.summary(it->second);
+                        tree_.set_summary(sub_id, summary);
+                    }
+                    for (uint32_t j = 0; j < sub.nsubs_; j++) {
+                        tree_.node(sub.first_sub_ + j).parent_ = sub_id;
+                    }
+                }
+                old_subs.erase(it);
+            }
+            else if (entry.type_ == FILE_TYPE_DIRECTORY) {
+                // adds the sizes below to sub
+                scan(open_dir(stream->fd(), name), join_path(path, name), sub_id, level + 1);
+            }
+            subs_size += sub.size_;
+        }
+        delete stream;
+        for (std::unordered_map<std::string, NodeId>::iterator it = old_subs.begin(); it != old_subs.end(); ++it) {
+            if (tree_.node(it->second).type_ == FILE_TYPE_DIRECTORY) {
+                forget(join_path(path, it->first));
+            }
+        }
+        // the size of the directory itself is kept
+        change_size(id, old.size_ - old_subs_size + subs_size);
+    }
+
+    // Stats the file at path again if it is a node.
+    void update(const std::string &path)
+    {
+        size_t sep = path.rfind(SEP);
+        int level;
+        bool exact;
+        NodeId dir = find(path.substr(0, sep), &exact, &level);
+        if (!exact || level >= depth_) {
+            return;
+        }
+        NodeId id = find_sub(dir, path.data() + sep + 1, path.size() - sep - 1);
+        struct stat st;
+        if (id == NO_NODE || tree_.node(id).type_ == FILE_TYPE_DIRECTORY || lstat(path.c_str(), &st) != 0) {
+            return;
+        }
+        size_t size;
+        stat_to_type(st, &size);
+        change_size(id, size);
+    }
+
+    // Walks again the directory id, the deepest node above changes below
+    // the kept depth.
+    void rescan(NodeId id, const std::string &path)
+    {
+        struct stat st;
+        if (tree_.node(id).type_ != FILE_TYPE_DIRECTORY || lstat(path.c_str(), &st) != 0) {
+            return;
+        }
+        size_t size;
+        stat_to_type(st, &size);
+        FileInfo &file = tree_.node(id);
+        uint64_t old_size = file.size_;
+        file.size_ = size;
+        // adds the sizes below to the node, and summarizes it again
+        scan(open_dir(AT_FDCWD, path.c_str()), path, id, depth_);
+        propagate(id, tree_.node(id).size_ - old_size);
+    }
+
+    FileTree &tree_;
+    ScanBackend &backend_;
+    int depth_;
+    int fd_;
+    std::unordered_map<int, std::string> paths_;    // by watch descriptor
+    std::map<std::string, int> wds_;                // by path, sorted for forget()
+    std::set<std::string> relists_;
+    std::set<std::string> written_;
+    std::set<std::string> rescans_;
+    bool full_;
+    bool warned_;
+};
+
+volatile sig_atomic_t watch_signal = 0;
+
+void on_watch_signal(int sig)
+{
+    watch_signal = sig;
+}
+
+// Walks dir once, then keeps the tree current with a Watcher, writing a
+// snapshot every interval seconds and on SIGUSR1.  With diff, a diff
+// against the previous snapshot follows each one.
+int cmd_watch(int argc, char *args[])
+{
+    const char *backend_name = "auto";
+    int version = SNAPSHOT_VERSION;
+    bool binary = false;
+    bool diff = false;
+    double interval = 3600;
+    int depth = 5;
+    bool summarize = false;
+    bool one_filesystem = false;
+    NameFilter names;
+    JsonOptions json;
+    enum {
+        OPT_BACKEND = 256,
+        OPT_FULL_PATHS,
+        OPT_BINARY,
+        OPT_INTERVAL,
+        OPT_DIFF,
+        OPT_DEPTH,
+        OPT_SUMMARY,
+        OPT_COMPACT,
+        OPT_COMPRESS,
+        OPT_EXCLUDE,
+        OPT_INCLUDE,
+    };
+    static const struct option long_options[] = {
+        {"one-file-system", no_argument, NULL, 'x'},
+        {"backend", required_argument, NULL, OPT_BACKEND},
+        {"full-paths", no_argument, NULL, OPT_FULL_PATHS},
+        {"binary", no_argument, NULL, OPT_BINARY},
+        {"interval", required_argument, NULL, OPT_INTERVAL},
+        {"diff", no_argument, NULL, OPT_DIFF},
+        {"depth", required_argument, NULL, OPT_DEPTH},
+        {"summary", no_argument, NULL, OPT_SUMMARY},
+        {"compact", no_argument, NULL, OPT_COMPACT},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {NULL, 0, NULL, 0},
+    };
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "x", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'x':
+            one_filesystem = true;
+            break;
+        case OPT_BACKEND:
+            backend_name = optarg;
+            break;
+        case OPT_FULL_PATHS:
+            version = 1;
+            break;
+        case OPT_BINARY:
+            binary = true;
+            break;
+        case OPT_INTERVAL:
+            interval = strtod(optarg, NULL);
+            break;
+        case OPT_DIFF:
+            diff = true;
+            break;
+        case OPT_DEPTH:
+            if (!parse_depth(optarg, &depth)) {
+                return -1;
+            }
+            break;
+        case OPT_SUMMARY:
+            summarize = true;
+            break;
+        case OPT_COMPACT:
+            json.compact_ = true;
+            break;
+        case OPT_COMPRESS:
+            if (!parse_compression(optarg, &json.compression_)) {
+                LOG("unknown compression %s, expect none, gzip or zstd if built with it", optarg);
+                return -1;
+            }
+            break;
+        case OPT_EXCLUDE:
+            names.exclude(optarg);
+            break;
+        case OPT_INCLUDE:
+            names.include(optarg);
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
 
-#define LOG(FMT, ARGS...)\
-    fprintf(stderr, "%s:%d: " FMT "\n", __FILE__, __LINE__, ARGS);
+    if (argc != 1) {
+        LOG("expect one argument: %s", "dir");
+        return -1;
+    }
+    const char *root = args[0];
+    ScanBackend *backend = ScanBackend::create(ScanBackend::choose(backend_name, root));
+    if (!backend) {
+        LOG("unknown backend %s, expect posix, uring or auto", backend_name);
+        return -1;
+    }
 
-std::string join_path(const std::string &prefix, const std::string &postfix)
-{
-    bool hasSep = (!prefix.empty() && prefix[prefix.size() - 1] == SEP);
-    if (hasSep)
-        return prefix + postfix;
-    else
-        return prefix + SEP + postfix;
-}
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_watch_signal;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
 
-std::string flatten_path(const std::string &path)
-{
-    std::vector<char> buf;
-    buf.resize(path.size());
-    for (size_t i = 0; i < path.size(); i++) {
-        int c = path[i];
-        buf[i] = (c == SEP) ? '_' : c;
+    // hard links are counted once per link, as the watcher could not tell
+    // which link still counts once files come and go
+    FileTree tree;
+    tree.filter().set_one_filesystem(one_filesystem);
+    names.compile();
+    tree.filter().set_names(names);
+    tree.set_summarize(summarize);
+    Watcher watcher(tree, *backend, depth);
+    if (!watcher.start(root)) {
+        delete backend;
+        return -1;
+    }
+    std::string last_file;
+    double next_dump = now_sec() + interval;
+    int ret = 0;
+    for (;;) {
+        int timeout = -1;
+        if (interval > 0) {
+            timeout = std::max(0.0, next_dump - now_sec()) * 1000;
+        }
+        struct pollfd pfd;
+        pfd.fd = watcher.fd();
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0) {
+            watcher.process();
+        }
+        int sig = watch_signal;
+        watch_signal = 0;
+        if (sig == SIGINT || sig == SIGTERM) {
+            break;
+        }
+        bool due = (interval > 0 && now_sec() >= next_dump);
+        if (sig != SIGUSR1 && !due) {
+            continue;
+        }
+        if (due) {
+            next_dump += interval * std::max(1.0, std::ceil((now_sec() - next_dump) / interval));
+        }
+        if (tree.size() > 2 * tree.live_nodes()) {
+            tree.compact();
+        }
+        std::string file = write_snapshot(tree, root, binary, version, json);
+        if (file.empty()) {
+            ret = -1;
+            break;
+        }
+        LOG("wrote %s", file.c_str());
+        if (diff && !last_file.empty()) {
+            Snapshot older, newer;
+            if (older.load(last_file) && newer.load(file)) {
+                LOG("comparing %s %s", last_file.c_str(), file.c_str());
+                diff_snapshots(newer, older, log_diff_record);
+            }
+        }
+        last_file = file;
     }
-    return std::string(buf.data(), buf.size());
+    delete backend;
+    return ret;
 }
 
-std::string time_to_str()
-{
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    char buf[128];
-    struct tm &tm = *localtime(&tv.tv_sec);
-    snprintf(buf, 128, "%04d.%02d.%02d-%02d.%02d.%02d.%06zu",
-            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-            tm.tm_hour, tm.tm_min, tm.tm_sec,
-            (size_t)tv.tv_usec);
-    return buf;
-}
+volatile sig_atomic_t serve_signal = 0;
 
-std::string make_json_file_name(const std::string &path)
+void on_serve_signal(int sig)
 {
-    return "dirs_" + flatten_path(path) + time_to_str() + ".json";
+    serve_signal = sig;
 }
 
-std::string readable_size(size_t nbytes)
+// Finds the node of a full path, as diffs report them, or of the root if
+// path is empty.
+template <typename View>
+bool find_node(const View &view, const std::string &path, typename View::Node *node)
 {
-    const size_t nlevels = 4;
-
-    struct LevelInfo {
-        size_t size;
-        char unit;
-    } levels[nlevels] = {
-        {size_t(1024) * 1024 * 1024 * 1024, 'T'},
-        {1024 * 1024 * 1024, 'G'},
-        {1024 * 1024, 'M'},
-        {1024, 'K'},
-    };
-
-    for (size_t i = 0; i < nlevels; i++) {
-        size_t size = levels[i].size;
-        char unit = levels[i].unit;
-        if (nbytes >= size) {
-            size_t low_size = size / 1024;
-            size_t quot = nbytes / size;
-            size_t remainder = (nbytes - quot * size) / low_size;
-            char buf[64];
-            if (remainder == 0) {
-                snprintf(buf, 64, "%zu%c", quot, unit);
+    typename View::Node at = view.root();
+    std::string root(view.name(at), view.name_len(at));
+    if (path.empty() || path == root) {
+        *node = at;
+        return true;
+    }
+    if (root.empty() || path.compare(0, root.size(), root) != 0) {
+        return false;
+    }
+    size_t pos = root.size();
+    if (root[root.size() - 1] != SEP && path[pos] != SEP) {
+        return false;
+    }
+    while (pos < path.size()) {
+        if (path[pos] == SEP) {
+            pos++;
+            continue;
+        }
+        size_t end = std::min(path.find(SEP, pos), path.size());
+        size_t nsubs = view.nsubs(at);
+        typename View::Node sub = (nsubs > 0) ? view.first_sub(at) : at;
+        size_t i = 0;
+        for (; i < nsubs; i++) {
+            if (i > 0) {
+                sub = view.next_sibling(sub);
             }
-            else {
-                double fquot = quot + remainder / 1024.0;
-                snprintf(buf, 64, "%.03lf%c", fquot, unit);
+            if (view.name_len(sub) == end - pos && 0 == memcmp(view.name(sub), path.data() + pos, end - pos)) {
+                break;
             }
-            return buf;
         }
+        if (i == nsubs) {
+            return false;
+        }
+        at = sub;
+        pos = end;
     }
-    char buf[64];
-    snprintf(buf, 64, "%zu", nbytes);
-    return buf;
+    *node = at;
+    return true;
 }
 
-// non-reentrant version, for convenience
-const char *r_sz(size_t nbytes)
+// The members of node as a snapshot has them, with its full path in "path".
+template <typename View, typename Writer>
+void write_node(const View &view, const typename View::Node &node, const std::string &path, Writer &writer)
 {
-    static std::string s;
-    s = readable_size(nbytes);
-    return s.c_str();
+    DiffEntry entry;
+    entry.name_ = path.data();
+    entry.name_len_ = path.size();
+    entry.size_ = view.size(node);
+    entry.type_ = view.type(node);
+    entry.stamp_ = view.stamp(node);
+    entry.summarized_ = view.summary(node, &entry.summary_);
+    entry.counted_ = view.counts(node, &entry.counts_);
+    write_json_members(writer, entry, true, 0, false, 0, NULL, false);
 }
 
-struct FileInfo
+// Answers queries on snapshots over HTTP for `dmon serve`, one connection
+// at a time, so that a slow diff holds up the connections behind it, with a
+// JSON body unless told otherwise:
+//     GET /size?snapshot=file[&path=p]        the node at full path p, the
+//                                             root by default
+//     GET /top?snapshot=file[&path=p][&n=N]   it and its N largest sub
+//                                             files, 10 by default
+//     GET /diff?old=file&new=file[&top=N[&rank=bytes|files]][&format=json|ndjson|tsv]
+// Each file is a path relative to the served directory, which it may not
+// lead out of.  Snapshots come from a SnapshotCache, and diffs are kept by
+// the versions of both files and the query, so that one asked for again is
+// not computed again until either file changes.
+class Server
 {
-    size_t size_;
-    std::string path_;
-    std::vector<FileInfo *> sub_files_;
-    int type_;
-
-    FileInfo()
-    : size_(0)
-    , type_(FILE_TYPE_UNKNOWN)
+public:
+    static const size_t MAX_REQUEST = 8192;
+
+    // dir is the served directory, as resolved by realpath().
+    Server(const std::string &dir, size_t snapshots, size_t results, size_t njobs)
+    : dir_(dir)
+    , snapshots_(snapshots)
+    , results_(results)
+    , njobs_(njobs)
     {}
 
-    ~FileInfo()
+    // Reads one request from the connection fd, answers it and closes fd.
+    void serve(int fd)
     {
-        for (size_t i = 0; i < sub_files_.size(); i++) {
-            delete sub_files_[i];
+        // a stalled client holds up the others, but not for long
+        struct timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                close(fd);
+                return;
+            }
+            request.append(buf, n);
+        }
+        Response response;
+        handle(request, response);
+        char head[256];
+        snprintf(head, sizeof(head), "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                "Connection: close\r\n\r\n", response.status_, status_text(response.status_),
+                response.type_, response.body_.size());
+        std::string out = head + response.body_;
+        for (size_t sent = 0; sent < out.size(); ) {
+            ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
         }
+        close(fd);
     }
 
-    void set_path(const std::string &path)
+private:
+    typedef std::map<std::string, std::string> Params;
+
+    struct Response
     {
-        path_ = path;
-        struct stat st;
-        errno = 0;
-        int ret = lstat(path.c_str(), &st);
-        if (ret != 0) {
-            LOG("lstat(%s) failed: %s", path.c_str(), strerror(errno));
-            return;
-        }
-        if (S_ISDIR(st.st_mode)) {
-            type_ = FILE_TYPE_DIRECTORY;
-            size_ = st.st_blocks * BLOCK_SIZE;
-        }
-        else if (S_ISREG(st.st_mode)) {
-            type_ = FILE_TYPE_REGULAR;
-            size_ = st.st_blocks * BLOCK_SIZE;
-        }
-        else if (S_ISLNK(st.st_mode)) {
-            type_ = FILE_TYPE_LINK;
-            size_ = st.st_blocks * BLOCK_SIZE;
+        int status_;
+        const char *type_;
+        std::string body_;
+
+        Response()
+        : status_(200)
+        , type_("application/json")
+        {}
+
+        void fail(int status, const std::string &error)
+        {
+            status_ = status;
+            type_ = "application/json";
+            StringBuffer sb;
+            Writer<StringBuffer> writer(sb);
+            writer.StartObject();
+            writer.Key("error");
+            writer.String(error.data(), error.size());
+            writer.EndObject();
+            body_.assign(sb.GetString(), sb.GetSize());
+            body_ += '\n';
         }
-        else {
-            type_ = FILE_TYPE_UNKNOWN;
+    };
+
+    static const char *status_text(int status)
+    {
+        switch (status) {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        default:
+            return "Internal Server Error";
         }
     }
 
-    void walk(int depth)
+    static int hex_digit(char c)
     {
-        if (type_ != FILE_TYPE_DIRECTORY)
-            return;
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
 
-        DIR *dir;
-        struct dirent *ent;
-        if ((dir = opendir (path_.c_str())) != NULL) {
-            while ((ent = readdir (dir)) != NULL) {
-                if (0 == strcmp(".", ent->d_name) || 0 == strcmp("..", ent->d_name)) {
-                    continue;
-                }
-                std::string path = join_path(path_, ent->d_name);
-                FileInfo *sub_file = new FileInfo();
-                sub_file->set_path(path);
-                if (sub_file->type_ == FILE_TYPE_UNKNOWN) {
-                    delete sub_file;
-                    continue;
-                }
-                if (depth > 0) {
-                    sub_files_.push_back(sub_file);
-                }
-                if (sub_file->type_ == FILE_TYPE_DIRECTORY) {
-                    sub_file->walk(depth - 1);
-                }
-                size_ += sub_file->size_;
+    static std::string url_decode(const std::string &s)
+    {
+        std::string out;
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '+') {
+                out += ' ';
+            }
+            else if (s[i] == '%' && i + 2 < s.size() && hex_digit(s[i + 1]) >= 0 && hex_digit(s[i + 2]) >= 0) {
+                out += char(hex_digit(s[i + 1]) * 16 + hex_digit(s[i + 2]));
+                i += 2;
+            }
+            else {
+                out += s[i];
             }
-            closedir (dir);
-        } else {
-            LOG("could not open dir %s: %s", path_.c_str(), strerror(errno));
         }
+        return out;
     }
 
-    void diff(const FileInfo &older) const
+    static void parse_query(const std::string &query, Params &params)
     {
-        if (size_ <= older.size_) {
-            return;
+        size_t pos = 0;
+        while (pos <= query.size()) {
+            size_t end = std::min(query.find('&', pos), query.size());
+            std::string pair = query.substr(pos, end - pos);
+            size_t eq = pair.find('=');
+            if (!pair.empty()) {
+                params[url_decode(pair.substr(0, eq))] = (eq == std::string::npos) ? "" : url_decode(pair.substr(eq + 1));
+            }
+            pos = end + 1;
         }
+    }
 
-        bool both_dirs = (type_ == FILE_TYPE_DIRECTORY) && (older.type_ == FILE_TYPE_DIRECTORY);
-        if (both_dirs) {
-            size_t change_count = 0;
-            size_t last_inc = 0;
-            size_t i = 0, j = 0;
-            while (i < sub_files_.size() && j < older.sub_files_.size()) {
-                const FileInfo &lfile = *sub_files_[i];
-                const FileInfo &rfile = *older.sub_files_[j];
-                const std::string &lpath = lfile.path_;
-                const std::string &rpath = rfile.path_;
-                if (lpath == rpath) {
-                    lfile.diff(rfile);
-                    i++;
-                    j++;
-                    change_count += (lfile.size_ != rfile.size_) ? 1 : 0;
-                    if (lfile.size_ > rfile.size_) {
-                        last_inc = lfile.size_ - rfile.size_;
-                    }
-                }
-                else if (lpath < rpath) {
-                    i++;
-                    LOG("%s\tnew +%s", lpath.c_str(), r_sz(lfile.size_));
-                    if (lfile.size_ > 0) {
-                        change_count++;
-                        last_inc = lfile.size_;
-                    }
-                }
-                else {
-                    j++;
-                    LOG("%s\tdel -%s", rpath.c_str(), r_sz(rfile.size_));
-                    if (rfile.size_ > 0) {
-                        change_count++;
-                    }
-                }
+    static bool parse_count(const Params &params, const char *name, size_t *count)
+    {
+        Params::const_iterator it = params.find(name);
+        if (it == params.end()) {
+            return true;
+        }
+        char *end;
+        *count = strtoul(it->second.c_str(), &end, 10);
+        return !it->second.empty() && *end == '\0';
+    }
+
+    void handle(const std::string &request, Response &response)
+    {
+        size_t line_end = request.find("\r\n");
+        std::string line = request.substr(0, line_end);
+        size_t sp1 = line.find(' ');
+        size_t sp2 = (sp1 == std::string::npos) ? sp1 : line.find(' ', sp1 + 1);
+        if (line_end == std::string::npos || sp2 == std::string::npos) {
+            response.fail(400, "malformed request");
+            return;
+        }
+        std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        if (line.compare(0, sp1, "GET") != 0) {
+            response.fail(405, "only GET is served");
+        }
+        else {
+            size_t mark = target.find('?');
+            Params params;
+            if (mark != std::string::npos) {
+                parse_query(target.substr(mark + 1), params);
             }
-            for (; i < sub_files_.size(); i++) {
-                const FileInfo &lfile = *sub_files_[i];
-                const std::string &lpath = lfile.path_;
-                LOG("%s\tnew +%s", lpath.c_str(), r_sz(lfile.size_));
-                last_inc = lfile.size_;
+            std::string route = target.substr(0, mark);
+            if (route == "/size" || route == "/top") {
+                query_node(route == "/top", params, response);
             }
-            size_t total_inc = size_ - older.size_;
-            if (change_count == 1 && last_inc == total_inc) {
-                // the size change is caused by a sub file
+            else if (route == "/diff") {
+                query_diff(params, response);
             }
             else {
-                LOG("%s\t+%s", path_.c_str(), r_sz(total_inc));
+                response.fail(404, "unknown query " + route + ", expect /size, /top or /diff");
             }
         }
+        LOG("%s %d %zu", target.c_str(), response.status_, response.body_.size());
+    }
+
+    static std::string param(const Params &params, const char *name)
+    {
+        Params::const_iterator it = params.find(name);
+        return (it == params.end()) ? std::string() : it->second;
+    }
+
+    // Finds the file of the snapshot named by the parameter name inside
+    // dir_, failing the response unless the name is a relative path
+    // without "..", and, should the file exist, unless it is inside dir_
+    // once symbolic links are followed.
+    bool resolve(const Params &params, const char *name, std::string *file_path, Response &response) const
+    {
+        std::string relative = param(params, name);
+        if (relative.empty()) {
+            response.fail(400, std::string("missing ") + name);
+            return false;
+        }
+        bool escapes = (relative[0] == SEP);
+        for (size_t pos = 0; !escapes && pos <= relative.size(); ) {
+            size_t end = std::min(relative.find(SEP, pos), relative.size());
+            escapes = (relative.compare(pos, end - pos, "..") == 0);
+            pos = end + 1;
+        }
+        *file_path = join_path(dir_, relative);
+        char *real = escapes ? NULL : realpath(file_path->c_str(), NULL);
+        if (real) {
+            escapes = (strncmp(real, dir_.c_str(), dir_.size()) != 0 || real[dir_.size()] != SEP);
+            free(real);
+        }
+        if (escapes) {
+            response.fail(400, "invalid " + std::string(name) + ", expect a path inside the served directory");
+            return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<const Snapshot> snapshot(const std::string &file_path, const std::string &name,
+            std::string *version, Response &response)
+    {
+        std::shared_ptr<const Snapshot> found = snapshots_.get(file_path, version);
+        if (!found) {
+            response.fail(404, "cannot load " + name);
+        }
+        return found;
+    }
+
+    void query_node(bool top, const Params &params, Response &response)
+    {
+        size_t n = 10;
+        if (!parse_count(params, "n", &n)) {
+            response.fail(400, "invalid n, expect a count");
+            return;
+        }
+        std::string file_path, version;
+        if (!resolve(params, "snapshot", &file_path, response)) {
+            return;
+        }
+        std::shared_ptr<const Snapshot> found = snapshot(file_path, param(params, "snapshot"), &version, response);
+        if (!found) {
+            return;
+        }
+        std::string path = param(params, "path");
+        bool ok;
+        if (found->is_binary_) {
+            ok = write_node_query(found->binary_, path, top, n, response);
+        }
         else {
-            LOG("%s\t+%s", path_.c_str(), r_sz(size_ - older.size_));
+            ok = write_node_query(FileTreeView(found->tree_), path, top, n, response);
+        }
+        if (!ok) {
+            response.fail(404, "no " + path + " in " + param(params, "snapshot"));
         }
-        
     }
 
-    template <typename Writer>
-    void to_json(Writer &writer)
+    template <typename View>
+    bool write_node_query(const View &view, const std::string &path, bool top, size_t n, Response &response)
     {
+        typename View::Node node;
+        if (!find_node(view, path, &node)) {
+            return false;
+        }
+        std::string full_path = path.empty() ? std::string(view.name(node), view.name_len(node)) : path;
+        StringBuffer sb;
+        Writer<StringBuffer> writer(sb);
         writer.StartObject();
-        writer.Key("path");
-        writer.String(path_.c_str(), path_.size());
-        writer.Key("size");
-        writer.Uint(size_);
-        writer.Key("type");
-        writer.Uint(type_);
-        if (!sub_files_.empty()) {
-            writer.Key("subs");
+        write_node(view, node, full_path, writer);
+        if (top) {
+            std::vector<std::pair<uint64_t, typename View::Node> > subs;
+            size_t nsubs = view.nsubs(node);
+            typename View::Node sub = (nsubs > 0) ? view.first_sub(node) : node;
+            for (size_t i = 0; i < nsubs; i++) {
+                if (i > 0) {
+                    sub = view.next_sibling(sub);
+                }
+                subs.push_back(std::make_pair(view.size(sub), sub));
+            }
+            // the largest first, of ties the first in name order
+            std::vector<size_t> order(subs.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                order[i] = i;
+            }
+            size_t kept = std::min(n, order.size());
+            std::partial_sort(order.begin(), order.begin() + kept, order.end(), [&subs](size_t a, size_t b) {
+                return subs[a].first != subs[b].first ? subs[a].first > subs[b].first : a < b;
+            });
+            writer.Key("top");
             writer.StartArray();
-            for (size_t i = 0; i < sub_files_.size(); i++) {
-                sub_files_[i]->to_json(writer);
+            for (size_t i = 0; i < kept; i++) {
+                const typename View::Node &largest = subs[order[i]].second;
+                writer.StartObject();
+                writer.Key("name");
+                writer.String(view.name(largest), view.name_len(largest));
+                writer.Key("size");
+                writer.Uint64(view.size(largest));
+                writer.Key("type");
+                writer.Uint(view.type(largest));
+                writer.EndObject();
             }
             writer.EndArray();
         }
         writer.EndObject();
+        response.body_.assign(sb.GetString(), sb.GetSize());
+        response.body_ += '\n';
+        return true;
     }
 
-    bool from_json(const JValue &object)
+    void query_diff(const Params &params, Response &response)
     {
-        if (!object.IsObject()) {
-            LOG("json value is not an object, actual type id is %d", object.GetType());
-            return false;
+        size_t top_n = 0;
+        TopDiffs::Rank rank = TopDiffs::RANK_BYTES;
+        DiffWriter::Format format = DiffWriter::FORMAT_JSON;
+        Params::const_iterator it = params.find("rank");
+        if (it != params.end() && !TopDiffs::parse_rank(it->second.c_str(), &rank)) {
+            response.fail(400, "invalid rank, expect bytes or files");
+            return;
+        }
+        it = params.find("format");
+        if (it != params.end() && !DiffWriter::parse_format(it->second.c_str(), &format)) {
+            response.fail(400, "invalid format, expect tsv, json or ndjson");
+            return;
         }
-        for (JValue::ConstMemberIterator it = object.MemberBegin(); it != object.MemberEnd(); ++it) {
-            const JValue &value = it->value;
-            const char *name = it->name.GetString();
-            if (0 == strcmp("path", name)) {
-                const char *s = value.GetString();
-                size_t len = value.GetStringLength();
-                path_.assign(s, len);
+        if (!parse_count(params, "top", &top_n)) {
+            response.fail(400, "invalid top, expect a count");
+            return;
+        }
+        std::string old_name = param(params, "old"), new_name = param(params, "new");
+        std::string old_path, new_path, old_version, new_version;
+        if (!resolve(params, "old", &old_path, response) || !resolve(params, "new", &new_path, response)) {
+            return;
+        }
+        if (!SnapshotCache::version(old_path, &old_version) || !SnapshotCache::version(new_path, &new_version)) {
+            response.fail(404, "cannot load " + old_name + " or " + new_name);
+            return;
+        }
+        char query[64];
+        snprintf(query, sizeof(query), "%zu %d %d", top_n, int(rank), int(format));
+        std::string key = old_version + '\n' + new_version + '\n' + query;
+        if (format == DiffWriter::FORMAT_TSV) {
+            response.type_ = "text/tab-separated-values";
+        }
+        else if (format == DiffWriter::FORMAT_NDJSON) {
+            response.type_ = "application/x-ndjson";
+        }
+        std::string *kept = results_.find(key);
+        if (kept) {
+            response.body_ = *kept;
+            return;
+        }
+        std::shared_ptr<const Snapshot> older = snapshot(old_path, old_name, &old_version, response);
+        if (!older) {
+            return;
+        }
+        std::shared_ptr<const Snapshot> newer = snapshot(new_path, new_name, &new_version, response);
+        if (!newer) {
+            return;
+        }
+        // of what was loaded, should either file have changed since
+        key = old_version + '\n' + new_version + '\n' + query;
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *fp = open_memstream(&buf, &len);
+        if (!fp) {
+            response.fail(500, strerror(errno));
+            return;
+        }
+        bool ok;
+        {
+            DiffWriter writer(fp, format);
+            DiffCallback output = [&writer](const DiffRecord &record) { writer.write(record); };
+            if (top_n) {
+                TopDiffs top(top_n, rank);
+                ok = diff_snapshots(*newer, *older, [&top](const DiffRecord &record) {
+                    top.offer(record);
+                }, njobs_);
+                top.report(output);
             }
-            else if (0 == strcmp("size", name)) {
-                size_ = value.GetUint();
+            else {
+                ok = diff_snapshots(*newer, *older, output, njobs_);
             }
-            else if (0 == strcmp("type", name)) {
-                type_ = value.GetUint();
+            ok = writer.finish() && ok;
+        }
+        fclose(fp);
+        if (ok) {
+            response.body_.assign(buf, len);
+            results_.insert(key, response.body_);
+        }
+        else {
+            response.fail(500, "failed to compare " + old_name + " " + new_name);
+        }
+        free(buf);
+    }
+
+    std::string dir_;
+    SnapshotCache snapshots_;
+    LruCache<std::string> results_;
+    size_t njobs_;
+};
+
+// Binds a listening socket, a Unix one at socket_path if not empty, else a
+// TCP one on port of the loopback interface.  Returns -1 on failure.
+int listen_on(const std::string &socket_path, int port)
+{
+    int fd;
+    if (!socket_path.empty()) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            LOG("socket path %s is too long", socket_path.c_str());
+            return -1;
+        }
+        memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+        // a socket left behind by a server which is gone
+        struct stat st;
+        if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(socket_path.c_str());
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+            LOG("cannot bind %s: %s", socket_path.c_str(), strerror(errno));
+            if (fd >= 0) {
+                close(fd);
             }
-            else if (0 == strcmp("subs", name)) {
-                if (!value.IsArray()) {
-                    LOG("WARN: json value for 'subs' is not an array, actual type id is %d", value.GetType());
-                    continue;
-                }
-                for (JValue::ConstValueIterator it_sub = value.Begin(); it_sub != value.End(); ++it_sub) {
-                    FileInfo *sub = new FileInfo();
-                    if (!sub->from_json(*it_sub)) {
-                        delete sub;
-                    } else {
-                        sub_files_.push_back(sub);
-                    }
-                }
-                sort_subs();
+            return -1;
+        }
+    }
+    else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+            LOG("cannot bind port %d: %s", port, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
             }
+            return -1;
         }
-        return true;
     }
+    if (listen(fd, 64) != 0) {
+        LOG("cannot listen: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    bool from_json(const std::string &file_path)
-    {
-        FILE *fp = fopen(file_path.c_str(), "r");
-        if (!fp) {
-            LOG("cannot open file %s", file_path.c_str());
-            return false;
+// Serves queries on snapshots until SIGINT or SIGTERM; see Server.
+int cmd_serve(int argc, char *args[])
+{
+    size_t njobs = 1;
+    size_t snapshots = 8;
+    size_t results = 64;
+    std::string socket_path;
+    const char *dir = ".";
+    int port = 0;
+    enum {
+        OPT_SOCKET = 256,
+        OPT_PORT,
+        OPT_CACHE,
+        OPT_RESULTS,
+        OPT_DIR,
+    };
+    static const struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"socket", required_argument, NULL, OPT_SOCKET},
+        {"port", required_argument, NULL, OPT_PORT},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"results", required_argument, NULL, OPT_RESULTS},
+        {"dir", required_argument, NULL, OPT_DIR},
+        {NULL, 0, NULL, 0},
+    };
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            njobs = strtoul(optarg, NULL, 10);
+            if (njobs == 0) {
+                njobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+            break;
+        case OPT_SOCKET:
+            socket_path = optarg;
+            break;
+        case OPT_PORT:
+            port = atoi(optarg);
+            if (port <= 0 || port > 65535) {
+                LOG("invalid --port %s", optarg);
+                return -1;
+            }
+            break;
+        case OPT_CACHE:
+            snapshots = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_RESULTS:
+            results = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_DIR:
+            dir = optarg;
+            break;
+        default:
+            return -1;
         }
-        const size_t BUF_SIZE = 1024 * 256;
-        char buf[BUF_SIZE];
-        FileReadStream fs(fp, buf, BUF_SIZE);
-        JDocument doc;
-        doc.ParseStream(fs);
-        fclose(fp);
-        if (doc.HasParseError()) {
-            LOG("failed to parse json from %s, error at %zu: %s",
-                    file_path.c_str(),
-                    doc.GetErrorOffset(),
-                    GetParseError_En(doc.GetParseError())
-                    );
-            return false;
+    }
+    argc -= optind - 1;
+    args += optind - 1;
+
+    if (argc != 0 || socket_path.empty() == (port == 0)) {
+        LOG("expect one of %s", "--socket=path or --port=N");
+        return -1;
+    }
+    char *real_dir = realpath(dir, NULL);
+    struct stat st;
+    if (!real_dir || stat(real_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        LOG("invalid --dir %s", dir);
+        free(real_dir);
+        return -1;
+    }
+    // the root as "/", so that a file inside it is "/name"
+    std::string root = (0 == strcmp(real_dir, "/")) ? std::string() : std::string(real_dir);
+    free(real_dir);
+    int listen_fd = listen_on(socket_path, port);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_serve_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    if (!socket_path.empty()) {
+        LOG("serving %s on %s", root.empty() ? "/" : root.c_str(), socket_path.c_str());
+    }
+    else {
+        LOG("serving %s on 127.0.0.1:%d", root.empty() ? "/" : root.c_str(), port);
+    }
+    Server server(root, snapshots, results, njobs);
+    while (!serve_signal) {
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) <= 0) {
+            continue;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            server.serve(fd);
         }
-        return from_json(doc);
     }
+    close(listen_fd);
+    if (!socket_path.empty()) {
+        unlink(socket_path.c_str());
+    }
+    return 0;
+}
 
-    struct PathLess {
-        bool operator()(const FileInfo *lhs, const FileInfo *rhs)
-        {
-            return lhs->path_ < rhs->path_;
+// Parses a size in bytes, with an optional K, M, G or T suffix of powers
+// of 1024.
+bool parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    const char *units = "KMGT";
+    const char *unit = *end ? strchr(units, toupper(*end)) : NULL;
+    if (unit) {
+        value <<= 10 * (unit - units + 1);
+        end++;
+    }
+    if (end == arg || *end != '\0') {
+        LOG("invalid size %s", arg);
+        return false;
+    }
+    *size = value;
+    return true;
+}
+
+std::string format_time(int64_t seconds)
+{
+    time_t t = seconds;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
+
+// Adds snapshot files to the store, each dated by its mtime.
+int history_add(HistoryStore &store, int argc, char *args[])
+{
+    for (int i = 0; i < argc; i++) {
+        Snapshot snapshot;
+        struct stat st;
+        if (stat(args[i], &st) != 0 || !snapshot.load(args[i])) {
+            LOG("failed to load %s", args[i]);
+            return -1;
         }
-    };
-    void sort_subs()
-    {
-        std::sort(sub_files_.begin(), sub_files_.end(), PathLess());
+        bool ok = snapshot.is_binary_
+            ? store.append(snapshot.binary_, st.st_mtime)
+            : store.append(FileTreeView(snapshot.tree_), st.st_mtime);
+        if (!ok) {
+            return -1;
+        }
+        LOG("added %s, %zu snapshots of %zu paths", args[i], store.columns(), store.paths());
     }
-};
+    return 0;
+}
 
-int cmd_stat(int argc, char *args[])
+// Prints the size of path in each snapshot of the last days, or of all
+// of them if days is 0, with the growth since the one before and its rate
+// per day.
+int history_trend(HistoryStore &store, const char *path, int days)
 {
-    if (argc != 1) {
-        LOG("expect one argument: %s", "dir");
+    uint32_t id;
+    if (!store.find(path, &id)) {
+        LOG("%s is not in the history", path);
         return -1;
     }
-    const char *root = args[0];
-    FileInfo root_file;
-    root_file.set_path(root);
-    root_file.walk(5);
-
-    const size_t BUF_SIZE = 1024 * 256;
-    char buf[BUF_SIZE];
-    std::string output_filename = make_json_file_name(root);
-    FILE *fp = fopen(output_filename.c_str(), "wb");
-    if (!fp) {
-        LOG("cannot open file %s", "dirs.json");
+    int64_t since = days > 0 ? (int64_t)::time(NULL) - days * 86400LL : INT64_MIN;
+    bool has_first = false;
+    int64_t first_time = 0, last_time = 0;
+    uint64_t first_size = 0, last_size = 0;
+    for (size_t i = 0; i < store.columns(); i++) {
+        int64_t t = store.time(i);
+        uint64_t size = store.size(i, id);
+        if (t < since || size == HISTORY_NONE) {
+            continue;
+        }
+        if (has_first) {
+            int64_t delta = (int64_t)(size - last_size);
+            double elapsed = (t - last_time) / 86400.0;
+            printf("%s\t%llu\t%+lld\t%.0f\n", format_time(t).c_str(), (unsigned long long)size,
+                    (long long)delta, elapsed > 0 ? delta / elapsed : 0.0);
+        }
+        else {
+            printf("%s\t%llu\t\t\n", format_time(t).c_str(), (unsigned long long)size);
+            has_first = true;
+            first_time = t;
+            first_size = size;
+        }
+        last_time = t;
+        last_size = size;
+    }
+    if (has_first && last_time > first_time) {
+        double elapsed = (last_time - first_time) / 86400.0;
+        long long delta = (long long)(last_size - first_size);
+        LOG("%s grew %+lld bytes in %.1f days, %.0f bytes/day", path, delta, elapsed, delta / elapsed);
+    }
+    return 0;
+}
+
+// Prints when each path, or just the given one, first reached threshold
+// bytes.
+int history_over(HistoryStore &store, uint64_t threshold, const char *path)
+{
+    uint32_t id = 0;
+    if (path && !store.find(path, &id)) {
+        LOG("%s is not in the history", path);
         return -1;
     }
-    FileWriteStream fs(fp, buf, BUF_SIZE);
-    // Writer<FileWriteStream> writer(fs);
-    PrettyWriter<FileWriteStream> writer(fs);
-    writer.SetIndent(' ', 1);
-    root_file.to_json(writer);
-    fclose(fp);
+    size_t npaths = store.paths();
+    std::vector<bool> over(npaths, false);
+    for (size_t i = 0; i < store.columns(); i++) {
+        uint32_t begin = path ? id : 0;
+        uint32_t end = path ? id + 1 : npaths;
+        for (uint32_t j = begin; j < end; j++) {
+            uint64_t size = store.size(i, j);
+            if (!over[j] && size != HISTORY_NONE && size >= threshold) {
+                over[j] = true;
+                printf("%s\t%s\t%llu\n", format_time(store.time(i)).c_str(), store.path(j).c_str(),
+                        (unsigned long long)size);
+            }
+        }
+    }
     return 0;
 }
 
-int cmd_diff(int argc, char *args[])
+// `dmon history`: an append-only store of the sizes of many snapshots, see
+// HistoryStore.
+int cmd_history(int argc, char *args[])
 {
-    if (argc != 2) {
-        LOG("expect two argument: %s %s", "old_stat.json", "new_stat.json");
+    if (argc < 1) {
+        LOG("expect a command: %s", "add, trend or over");
         return -1;
     }
+    const char *cmd = args[0];
+    int days = 0;
+    enum {
+        OPT_DAYS = 256,
+    };
+    static const struct option long_options[] = {
+        {"days", required_argument, NULL, OPT_DAYS},
+        {NULL, 0, NULL, 0},
+    };
+    // args[0] is now the sub command, which getopt takes as argv[0]
+    argc -= 1;
+    args += 1;
+    optind = 1;
+    int opt;
+    while ((opt = getopt_long(argc + 1, args - 1, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_DAYS:
+            days = atoi(optarg);
+            break;
+        default:
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    args += optind - 1;
 
-    FileInfo old_file, new_file;
-    LOG("loading %s", args[0]);
-    if (!old_file.from_json(args[0])) {
-        LOG("failed to load %s", args[0]);
+    if (argc < 1) {
+        LOG("expect a history store after %s", cmd);
         return -1;
     }
-    LOG("loading %s", args[1]);
-    if (!new_file.from_json(args[1])) {
-        LOG("failed to load %s", args[1]);
+    HistoryStore store;
+    if (!store.open(args[0])) {
         return -1;
     }
-    LOG("comparing %s %s", args[0], args[1]);
-    new_file.diff(old_file);
-    return 0;
+    if (0 == strcmp("add", cmd)) {
+        return history_add(store, argc - 1, args + 1);
+    }
+    else if (0 == strcmp("trend", cmd)) {
+        if (argc != 2) {
+            LOG("expect two arguments: %s %s", "store", "path");
+            return -1;
+        }
+        return history_trend(store, args[1], days);
+    }
+    else if (0 == strcmp("over", cmd)) {
+        uint64_t threshold;
+        if (argc < 2 || argc > 3 || !parse_size(args[1], &threshold)) {
+            LOG("expect arguments: %s %s [%s]", "store", "size", "path");
+            return -1;
+        }
+        return history_over(store, threshold, argc == 3 ? args[2] : NULL);
+    }
+    LOG("invalid history command %s", cmd);
+    return -1;
 }
 
 int main(int argc, char *argv[])
@@ -418,9 +2096,26 @@ int main(int argc, char *argv[])
     if (argc < 2) {
         printf(
                 "Usage:\n"
-                "    %s s[tat] dir\n"
-                "    %s d[iff] old_stat.json new_stat.json\n",
-                argv[0], argv[0]
+                "    %s s[tat] [-j N] [-x] [-l] [--backend=auto|posix|uring] [--full-paths] [--binary]\n"
+                "          [--depth=N] [--summary] [--stats[=text|json]] [--compact] [--compress=gzip|zstd]\n"
+                "          [--exclude=glob]... [--include=glob]... [--by=uid,gid,ext] [--counts]\n"
+                "          [--checkpoint=file [--checkpoint-every=seconds] [--resume]] [--shard=i/N]\n"
+                "          [--max-ops=N] [--target-latency=ms] [--spill-after=N [--spill-dir=dir]]\n"
+                "          [--since=old_stat [--trust-dir-mtime] [--rescan-every=N]] dir\n"
+                "    %s d[iff] [-j N] [--stream] [--format=tsv|json|ndjson]\n"
+                "          [--top=N [--rank=bytes|files]] old_stat.json new_stat.json\n"
+                "    %s c[onvert] [-j N] [--full-paths] [--compact] [--compress=gzip|zstd] input output\n"
+                "    %s m[erge] [--compact] [--compress=gzip|zstd] output shard...\n"
+                "    %s w[atch] [-x] [--backend=auto|posix|uring] [--full-paths] [--binary]\n"
+                "          [--depth=N] [--summary] [--compact] [--compress=gzip|zstd]\n"
+                "          [--exclude=glob]... [--include=glob]... [--interval=seconds] [--diff] dir\n"
+                "    %s serve [-j N] [--cache=N] [--results=N] [--dir=dir] --socket=path|--port=N\n"
+                "          (one connection at a time: a slow diff holds up the rest)\n"
+                "    %s bench [-n rounds] dir\n"
+                "    %s history add store snapshot...\n"
+                "    %s history trend [--days=N] store path\n"
+                "    %s history over store size[K|M|G|T] [path]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]
                 );
         return 0;
     }
@@ -434,6 +2129,24 @@ int main(int argc, char *argv[])
     else if (0 == strcmp("d", cmd) || 0 == strcmp("diff", cmd)) {
         return cmd_diff(argc - 2, args);
     }
+    else if (0 == strcmp("c", cmd) || 0 == strcmp("convert", cmd)) {
+        return cmd_convert(argc - 2, args);
+    }
+    else if (0 == strcmp("m", cmd) || 0 == strcmp("merge", cmd)) {
+        return cmd_merge(argc - 2, args);
+    }
+    else if (0 == strcmp("w", cmd) || 0 == strcmp("watch", cmd)) {
+        return cmd_watch(argc - 2, args);
+    }
+    else if (0 == strcmp("serve", cmd)) {
+        return cmd_serve(argc - 2, args);
+    }
+    else if (0 == strcmp("bench", cmd)) {
+        return cmd_bench(argc - 2, args);
+    }
+    else if (0 == strcmp("h", cmd) || 0 == strcmp("history", cmd)) {
+        return cmd_history(argc - 2, args);
+    }
     else {
         LOG("invalid command %s", cmd);
         return -1;
@@ -0,0 +1,1248 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+
+// libdmon: scanning a tree into a FileTree, which may take its memory from
+// a caller's Allocator, reading and writing snapshots, and diffing them or
+// two trees in memory, with the findings passed to a DiffCallback as
+// DiffRecords.  See scan(), diff_trees() and diff_snapshots().  Failures
+// are returned; what the library has to say about them goes to the
+// LogCallback.  The rest of dmon is in dmon_internal.h, which is not part
+// of the API.
+#ifndef DMON_H
+#define DMON_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace dmon {
+
+enum FileType {
+    FILE_TYPE_UNKNOWN = 0,
+    FILE_TYPE_REGULAR = 1,
+    FILE_TYPE_DIRECTORY = 2,
+    FILE_TYPE_LINK = 3,
+};
+
+const char SEP = '/';
+
+// Where the warnings and errors of the library go, one line at a time as
+// "file:line: message", without the newline: to stderr, unless set
+// otherwise, and nowhere if set to an empty callback.  It is called from
+// the threads of a walk too, and is not locked, so set it before.
+typedef std::function<void (const char *line)> LogCallback;
+
+void set_log_callback(const LogCallback &callback);
+
+// Formats a line for the LogCallback.
+void log_message(const char *file, int line, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+std::string join_path(const std::string &prefix, const std::string &postfix);
+
+enum Compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+};
+
+
+typedef uint32_t NodeId;
+const NodeId NO_NODE = 0xffffffff;
+
+// Where a FileTree takes the memory for its nodes and names, in chunks of
+// 64 KiB or more, so that an embedding program can place a tree in its
+// own arena.  Allocators must be thread safe, as the parallel walker
+// grows one tree from several threads.
+class Allocator
+{
+public:
+    virtual ~Allocator() {}
+
+    // Returns size bytes aligned for any type, or throws std::bad_alloc.
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *p, size_t size) = 0;
+
+    // The one used by default: operator new.
+    static Allocator &standard();
+};
+
+// Append-only array whose items never move: they live in chunks of
+// 2^CHUNK_BITS items, so references stay valid while other threads append.
+// Appends must be serialized by the caller; reading items is safe at any
+// time.  Dropping the array frees one chunk at a time, not one item.
+template <typename T, unsigned CHUNK_BITS>
+class ChunkedArray
+{
+public:
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+
+    explicit ChunkedArray(Allocator &allocator = Allocator::standard())
+    : allocator_(&allocator)
+    , size_(0)
+    , nchunks_(0)
+    , capacity_(0)
+    , chunks_(NULL)
+    {}
+
+    ~ChunkedArray()
+    {
+        clear();
+    }
+
+    size_t size() const { return size_; }
+
+    // bytes allocated for the items
+    size_t memory_usage() const { return nchunks_ * CHUNK_SIZE * sizeof(T); }
+
+    T &operator[](size_t i)
+    {
+        T **chunks = chunks_.load(std::memory_order_acquire);
+        return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+    }
+
+    const T &operator[](size_t i) const
+    {
+        T **chunks = chunks_.load(std::memory_order_acquire);
+        return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+    }
+
+    // Appends n value-initialized items and returns the index of the first.
+    // If contiguous, the items are also adjacent in memory, which needs
+    // n <= CHUNK_SIZE.
+    size_t append(size_t n, bool contiguous = false)
+    {
+        if (contiguous && (size_ & (CHUNK_SIZE - 1)) + n > CHUNK_SIZE) {
+            size_ = nchunks_ * CHUNK_SIZE;
+        }
+        size_t first = size_;
+        size_ += n;
+        while (nchunks_ * CHUNK_SIZE < size_) {
+            add_chunk();
+        }
+        return first;
+    }
+
+    void clear()
+    {
+        T **chunks = chunks_.load();
+        for (size_t i = 0; i < nchunks_; i++) {
+            allocator_->deallocate(chunks[i], CHUNK_SIZE * sizeof(T));
+        }
+        delete [] chunks;
+        for (size_t i = 0; i < retired_.size(); i++) {
+            delete [] retired_[i];
+        }
+        retired_.clear();
+        chunks_ = NULL;
+        size_ = nchunks_ = capacity_ = 0;
+    }
+
+    void swap(ChunkedArray &other)
+    {
+        std::swap(allocator_, other.allocator_);
+        std::swap(size_, other.size_);
+        std::swap(nchunks_, other.nchunks_);
+        std::swap(capacity_, other.capacity_);
+        T **chunks = chunks_.load();
+        chunks_.store(other.chunks_.load());
+        other.chunks_.store(chunks);
+        retired_.swap(other.retired_);
+    }
+
+private:
+    ChunkedArray(const ChunkedArray &);
+    ChunkedArray &operator=(const ChunkedArray &);
+
+    void add_chunk()
+    {
+        T **chunks = chunks_.load();
+        if (nchunks_ == capacity_) {
+            // readers may still hold the old table, so it is only retired
+            capacity_ = std::max<size_t>(16, capacity_ * 2);
+            T **grown = new T*[capacity_];
+            std::copy(chunks, chunks + nchunks_, grown);
+            if (chunks) {
+                retired_.push_back(chunks);
+            }
+            chunks = grown;
+        }
+        // items are never destroyed, only their chunks freed
+        static_assert(std::is_trivially_destructible<T>::value, "items must be trivially destructible");
+        T *chunk = static_cast<T *>(allocator_->allocate(CHUNK_SIZE * sizeof(T)));
+        std::uninitialized_fill_n(chunk, CHUNK_SIZE, T());
+        chunks[nchunks_++] = chunk;
+        chunks_.store(chunks, std::memory_order_release);
+    }
+
+    Allocator *allocator_;
+    size_t size_;
+    size_t nchunks_;
+    size_t capacity_;
+    std::atomic<T **> chunks_;
+    std::vector<T **> retired_;
+};
+
+// A node of a FileTree.  The sub files of a node are the nodes
+// [first_sub_, first_sub_ + nsubs_), all adjacent, and name_ is the offset
+// of the NUL terminated name in the tree's name arena: the last component
+// of the path, except for the root which has the path as given to stat.
+struct FileInfo
+{
+    uint64_t size_;
+    uint64_t name_;
+    NodeId first_sub_;
+    uint32_t nsubs_;
+    NodeId parent_;
+    uint16_t name_len_;
+    uint8_t type_;
+};
+
+// What a directory looked like when its sub files were listed, so that a
+// later walk can tell whether it changed; all zero if not known.  A stamp
+// is only kept for directories whose sub files are in the tree.
+struct DirStamp
+{
+    int64_t mtime_;     // in ns
+    int64_t ctime_;
+    uint64_t ino_;
+
+    DirStamp()
+    : mtime_(0)
+    , ctime_(0)
+    , ino_(0)
+    {}
+
+    bool valid() const { return ino_ != 0; }
+
+    bool operator==(const DirStamp &other) const
+    {
+        return mtime_ == other.mtime_ && ctime_ == other.ctime_ && ino_ == other.ino_;
+    }
+};
+
+// What `stat --summary` keeps of a directory at the kept depth, whose sub
+// files are not nodes.
+struct DirSummary
+{
+    uint64_t entries_;          // entries below the directory, at any depth
+    const char *largest_;       // name of the largest sub file, or NULL
+    size_t largest_len_;
+    uint64_t largest_size_;     // its size, with everything below it
+
+    DirSummary()
+    : entries_(0)
+    , largest_(NULL)
+    , largest_len_(0)
+    , largest_size_(0)
+    {}
+
+    // Keeps name if it is the largest so far, the first by name on ties.
+    void offer(const char *name, size_t len, uint64_t size);
+};
+
+// What a tree with counts() keeps of each node besides its size, in side
+// tables so that FileInfo stays 32 bytes: the apparent size, st_size rather
+// than the blocks, of the node and everything below it, and for a
+// directory, how many files and directories are below it at any depth.
+struct NodeCounts
+{
+    uint64_t apparent_;
+    uint64_t files_;
+    uint64_t dirs_;
+
+    NodeCounts()
+    : apparent_(0)
+    , files_(0)
+    , dirs_(0)
+    {}
+
+    void add(const NodeCounts &other)
+    {
+        apparent_ += other.apparent_;
+        files_ += other.files_;
+        dirs_ += other.dirs_;
+    }
+};
+
+// Version 1 snapshots have the full path of every node in "path".  Version
+// 2 snapshots have a "version" in the root object, and only the root has a
+// "path"; other nodes have the last component of their path in "name".
+// Either may have the stamps of directories in "mtime", "ctime" and "ino",
+// the DirSummary of directories at the kept depth in "entries", "largest"
+// and "largest_size", the NodeCounts of every node in "apparent", "files"
+// and "dirs", the last two for directories only, "pending" in a Checkpoint,
+// and in the root, "sorted" if the sub files of every directory are in name
+// order (see FileTree::sorted()), the "generation" of an incremental walk
+// (see IncrementalWalker) and its "breakdown".
+const int SNAPSHOT_VERSION = 2;
+
+// Appends name to path the way join_path() does and returns the length of
+// path before, for restoring it with path.resize().
+size_t push_path(std::string &path, const char *name, size_t len);
+
+// Where and when list_dir() spills the sub files of a directory; see
+// SpilledFiles.
+struct SpillPolicy
+{
+    size_t after_;      // sub files held in a DirListing, 0 to never spill
+    std::string dir_;
+
+    SpillPolicy()
+    : after_(0)
+    , dir_("/tmp")
+    {}
+};
+
+// Bytes and entries below the root of a walk by owner and by file name
+// extension, tallied by list_dir() from the stat of each entry it admits,
+// so that they cost no I/O of their own.  The sizes are those the entries
+// add to the tree, hard links counted once included, so the uid and the
+// gid tables each add up to the size of the root but its own blocks.  Only
+// regular files have an extension: the part of the name after its last
+// dot, not a leading one, or "" if there is none or it is longer than
+// MAX_EXT.
+class Breakdown
+{
+public:
+    enum Dimension {
+        BY_UID,
+        BY_GID,
+        BY_EXT,
+        NDIMENSIONS,
+    };
+
+    static const size_t MAX_EXT = 15;
+
+    struct Usage
+    {
+        uint64_t size_;
+        uint64_t count_;
+
+        Usage()
+        : size_(0)
+        , count_(0)
+        {}
+    };
+
+    typedef std::map<std::string, Usage> Table;
+
+    // What one thread tallies, in hash maps keyed as cheaply as possible,
+    // until flush() adds it to a Breakdown; walks use it.
+    class Tally;
+
+    // Parses a comma separated list of uid, gid and ext into a mask of
+    // dimensions.
+    static bool parse_dimensions(const char *list, unsigned *dimensions);
+    static const char *dimension_name(int dimension);
+    static int find_dimension(const char *name, size_t len);
+
+    bool empty() const;
+    void clear();
+
+    const Table &table(int dimension) const { return tables_[dimension]; }
+
+    void add(int dimension, const std::string &key, const Usage &usage)
+    {
+        Usage &sum = tables_[dimension][key];
+        sum.size_ += usage.size_;
+        sum.count_ += usage.count_;
+    }
+
+    // The section of a binary snapshot: varint number of keys, then for
+    // each, varint dimension, varint length and bytes of the key, varint
+    // size and varint count.
+    void encode(std::vector<char> &buf) const;
+    // Returns false, having added nothing past the last good key, if data
+    // is not such a section.
+    bool decode(const uint8_t *p, const uint8_t *end);
+
+private:
+    Table tables_[NDIMENSIONS];
+};
+
+class ScanStats;
+class ScanThrottle;
+class ScanBackend;
+class DirStream;
+struct DirListing;
+class SpilledFiles;
+class EntryFilter;
+class Checkpoint;
+
+// See list_dir().
+typedef DirStream *(*ListDir)(ScanBackend &backend, int fd, const std::string &path, DirListing &listing,
+        EntryFilter *filter, Breakdown::Tally *tally, ScanThrottle *throttle);
+
+// A file tree in flat storage.  Nodes live in one chunked array and refer
+// to their sub files by index, and all names live in one chunked character
+// arena, so a node costs sizeof(FileInfo) (32 bytes) plus its name and a
+// NUL, and a directory 28 bytes more for its DirStamp and its id in the
+// table of them, with no per-node heap allocation; dropping the tree frees
+// a few large chunks instead of every node.  Node 0 is the root.  Full paths are
+// not stored but rebuilt from the names when needed.
+//
+// add_subs() may be called from several threads at once, as the parallel
+// walker does.
+class FileTree
+{
+public:
+    static const int MAX_DEPTH = 1 << 20;
+
+    // Nodes and names are allocated from allocator, which must outlive the
+    // tree.  The summaries of --summary, a small side table, are not.
+    explicit FileTree(Allocator &allocator = Allocator::standard());
+    ~FileTree();
+
+    Allocator &allocator() const { return allocator_; }
+
+    void clear()
+    {
+        nodes_.clear();
+        stamp_ids_.clear();
+        stamps_.clear();
+        summaries_.clear();
+        names_.clear();
+        apparent_.clear();
+        files_.clear();
+        dirs_.clear();
+        pending_.clear();
+        spilled_.clear();
+        append_nodes(1);
+        root().parent_ = NO_NODE;
+        // the root has a stamp whatever its type, at index 0
+        stamp_ids_[stamp_ids_.append(1)] = 0;
+        stamps_.append(1);
+        generation_ = 0;
+        breakdown_.clear();
+        sorted_ = true;
+    }
+
+    size_t size() const { return nodes_.size(); }
+
+    // Bytes allocated for the nodes, the stamps of the directories, the
+    // names and the counts, in whole chunks: about 43 bytes per entry of a
+    // tree of 16 files per directory and names of 7 bytes, as dmon_bench
+    // builds, once the chunks are full.
+    size_t memory_usage() const
+    {
+        return nodes_.memory_usage() + stamp_ids_.memory_usage() + stamps_.memory_usage() + names_.memory_usage()
+            + apparent_.memory_usage() + files_.memory_usage() + dirs_.memory_usage();
+    }
+
+    FileInfo &node(NodeId id) { return nodes_[id]; }
+    const FileInfo &node(NodeId id) const { return nodes_[id]; }
+
+    FileInfo &root() { return nodes_[0]; }
+    const FileInfo &root() const { return nodes_[0]; }
+
+    const char *name(const FileInfo &file) const { return &names_[file.name_]; }
+
+    std::string name_str(const FileInfo &file) const { return std::string(name(file), file.name_len_); }
+
+    // All zero for a file, or a directory never stamped.
+    const DirStamp &stamp(NodeId id) const
+    {
+        static const DirStamp none;
+        size_t at = find_stamp(id);
+        return (at < stamp_ids_.size() && stamp_ids_[at] == id) ? stamps_[at] : none;
+    }
+
+    // Ignored for a file.  Safe while other threads add_subs().
+    void set_stamp(NodeId id, const DirStamp &stamp)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        put_stamp(id, stamp);
+    }
+
+    // Number of incremental walks since the last full one.
+    uint32_t generation() const { return generation_; }
+    void set_generation(uint32_t generation) { generation_ = generation; }
+
+    // Whether walks keep a DirSummary of the directories at the kept depth.
+    // Not reset by clear().
+    bool summarize() const { return summarize_; }
+    void set_summarize(bool summarize) { summarize_ = summarize; }
+
+    // What walks leave out or count once; see EntryFilter.  Configured
+    // before set_root(), which starts it anew.
+    EntryFilter &filter() { return *filter_; }
+
+    // The dimensions walks tally into breakdown(), a mask of
+    // 1 << Breakdown::Dimension.  Not reset by clear(), unlike the
+    // breakdown itself.
+    unsigned breakdown_by() const { return breakdown_by_; }
+    void set_breakdown_by(unsigned dimensions) { breakdown_by_ = dimensions; }
+
+    Breakdown &breakdown() { return breakdown_; }
+    const Breakdown &breakdown() const { return breakdown_; }
+
+    // Whether the tree keeps the NodeCounts of its nodes.  Not reset by
+    // clear().
+    bool counted() const { return counted_; }
+
+    void set_counted(bool counted)
+    {
+        counted_ = counted;
+        size_t n = counted ? nodes_.size() : 0;
+        if (apparent_.size() < n) {
+            apparent_.append(n - apparent_.size());
+            files_.append(n - files_.size());
+            dirs_.append(n - dirs_.size());
+        }
+    }
+
+    // Walks save themselves to checkpoint, if not NULL, as they go.  Not
+    // reset by clear().
+    void set_checkpoint(Checkpoint *checkpoint) { checkpoint_ = checkpoint; }
+
+    // Walks are timed into stats, if not NULL, with backends created with
+    // it.  Not reset by clear().
+    void set_stats(ScanStats *stats) { stats_ = stats; }
+    ScanStats *stats() const { return stats_; }
+
+    // Holds the walks of this tree back, once configured.
+    ScanThrottle &throttle() { return *throttle_; }
+
+    // Whether directory id was not yet walked to the end when the tree was
+    // saved to a Checkpoint, or loaded from one.  Only kept while there is
+    // a checkpoint.
+    bool pending(NodeId id) const { return pending_.count(id) > 0; }
+    size_t npending() const { return pending_.size(); }
+
+    // Walks spill the sub files of huge directories to disk under policy;
+    // see SpilledFiles.  Not reset by clear().
+    void set_spill(const SpillPolicy &policy) { spill_ = policy; }
+    const SpillPolicy &spill() const { return spill_; }
+
+    // The sub files of directory id which were spilled, or NULL.  They are
+    // not nodes, but are counted in its size and counts, and written with
+    // its other sub files by write_json().  Diffs of the tree itself do not
+    // see them.
+    const SpilledFiles *spilled(NodeId id) const
+    {
+        if (spilled_.empty()) {
+            return NULL;
+        }
+        std::unordered_map<NodeId, std::shared_ptr<SpilledFiles> >::const_iterator it = spilled_.find(id);
+        return (it != spilled_.end()) ? it->second.get() : NULL;
+    }
+
+    // Takes files, which may be NULL.
+    void set_spilled(NodeId id, SpilledFiles *files);
+
+    // Whether the sub files of every directory are in name order, as
+    // walks and from_json() leave them: only add_subs() of a listing out
+    // of order, which list_dir() never returns, clears it.
+    bool sorted() const { return sorted_; }
+
+    // All zero if the tree is not counted().
+    NodeCounts counts(NodeId id) const
+    {
+        NodeCounts counts;
+        if (counted_) {
+            counts.apparent_ = apparent_[id];
+            counts.files_ = files_[id];
+            counts.dirs_ = dirs_[id];
+        }
+        return counts;
+    }
+
+    void set_counts(NodeId id, const NodeCounts &counts)
+    {
+        if (counted_) {
+            apparent_[id] = counts.apparent_;
+            files_[id] = counts.files_;
+            dirs_[id] = counts.dirs_;
+        }
+    }
+
+    // Flushes the tally of a walking thread to breakdown().
+    void add_breakdown(Breakdown::Tally &tally);
+
+    // Returns the summary of node id, or NULL if it has none.  Not safe
+    // during a walk.
+    const DirSummary *summary(NodeId id) const
+    {
+        std::unordered_map<NodeId, DirSummary>::const_iterator it = summaries_.find(id);
+        return (it != summaries_.end()) ? &it->second : NULL;
+    }
+
+    // Copies summary, and the name in it, to node id.
+    void set_summary(NodeId id, const DirSummary &summary)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        DirSummary &stored = summaries_[id];
+        stored = summary;
+        if (summary.largest_) {
+            stored.largest_ = copy_name(summary.largest_, summary.largest_len_);
+        }
+    }
+
+    // Rebuilds the full path of node id from the names of its ancestors.
+    std::string path(NodeId id) const
+    {
+        std::vector<NodeId> ids;
+        for (; id != NO_NODE; id = node(id).parent_) {
+            ids.push_back(id);
+        }
+        std::string path;
+        for (size_t i = ids.size(); i > 0; i--) {
+            const FileInfo &file = node(ids[i - 1]);
+            push_path(path, name(file), file.name_len_);
+        }
+        return path;
+    }
+
+    // Makes path, as given, the root.  Returns false if it cannot be
+    // stat'ed.
+    bool set_root(const std::string &path);
+
+    // Adds the entries of listing as the sub files of node id.  Returns
+    // the id of the first one.
+    NodeId add_subs(NodeId id, const DirListing &listing);
+
+    // The WalkFeature bits a walk of the tree set up as it is needs.
+    unsigned walk_features() const;
+
+    // Picks the list_dir_for() walk_features() for the walks to come, once
+    // the tree is set up; walk(), resume() and walk_parallel() do.
+    void specialize();
+    ListDir lister() const { return lister_; }
+
+    void walk(ScanBackend &backend, int depth);
+
+    // Finishes the walk a Checkpoint was saved from, the tree having been
+    // loaded from it by from_json() with the options of that walk.  The
+    // directories not pending() are kept as they are; the pending ones with
+    // sub files are gone through again for their pending sub directories,
+    // and the others walked anew.  The hard links met before the checkpoint
+    // are no longer known to the filter(), and count again if met again.
+    void resume(ScanBackend &backend, int depth);
+
+    // Same result as walk(), but sub directories are read by njobs
+    // threads, each with its own backend.  See ParallelWalker.
+    void walk_parallel(const char *backend_name, int depth, size_t njobs);
+
+    // Walks the directory open as fd into node id, keeping the fds of the
+    // directories above open so that each sub directory is opened relative
+    // to its parent.  Sub files are only added if depth > 0; with id ==
+    // NO_NODE, nothing is added and only the size is computed.  A node with
+    // depth <= 0 gets a DirSummary if summarize(), and the sub files which
+    // are nodes their NodeCounts if counted().  Returns the total size of
+    // the sub files, and adds the counts of what is below to *below and the
+    // entries themselves to tally if not NULL.
+    size_t walk_at(ScanBackend &backend, int fd, const std::string &path, NodeId id, int depth,
+            NodeCounts *below = NULL, Breakdown::Tally *tally = NULL);
+
+    // Same as walk_at(), for a pending directory of a loaded checkpoint:
+    // one with sub files, whose size is still its own, has its pending sub
+    // directories resumed in turn, the others walked.
+    size_t resume_at(ScanBackend &backend, int fd, const std::string &path, NodeId id, int depth,
+            NodeCounts *below, Breakdown::Tally *tally);
+
+    // Loads a JSON snapshot with a SAX reader, building the tree as the
+    // tokens arrive instead of parsing the whole document first, so that
+    // the peak memory is about the size of the tree.  See JsonHandler.
+    bool from_json(const std::string &file_path);
+
+    // Number of nodes reachable from the root.  Sub files replaced by
+    // calling add_subs() again on their directory are not, until compact()
+    // drops them.
+    size_t live_nodes() const
+    {
+        size_t count = 1;
+        std::vector<NodeId> stack(1, 0);
+        while (!stack.empty()) {
+            const FileInfo &file = node(stack.back());
+            stack.pop_back();
+            count += file.nsubs_;
+            for (uint32_t i = 0; i < file.nsubs_; i++) {
+                if (node(file.first_sub_ + i).nsubs_ > 0) {
+                    stack.push_back(file.first_sub_ + i);
+                }
+            }
+        }
+        return count;
+    }
+
+    // Copies the reachable nodes and their names to new storage, in
+    // breadth-first order, and drops the old one.  Node ids change.
+    void compact()
+    {
+        FileTree copy(allocator_);
+        copy.root() = root();
+        copy.set_name(copy.root(), name(root()), root().name_len_);
+        copy.set_stamp(0, stamp(0));
+        copy.set_counted(counted_);
+        copy.set_counts(0, counts(0));
+        if (summary(0)) {
+            copy.set_summary(0, *summary(0));
+        }
+        copy.generation_ = generation_;
+        std::deque<std::pair<NodeId, NodeId> > queue;
+        queue.push_back(std::make_pair(NodeId(0), NodeId(0)));
+        while (!queue.empty()) {
+            NodeId id = queue.front().first;
+            NodeId copy_id = queue.front().second;
+            queue.pop_front();
+            const FileInfo &file = node(id);
+            if (file.nsubs_ == 0) {
+                continue;
+            }
+            NodeId first = copy.append_nodes(file.nsubs_);
+            copy.node(copy_id).first_sub_ = first;
+            for (uint32_t i = 0; i < file.nsubs_; i++) {
+                const FileInfo &sub = node(file.first_sub_ + i);
+                FileInfo &copy_sub = copy.node(first + i);
+                copy_sub = sub;
+                copy_sub.parent_ = copy_id;
+                copy.set_name(copy_sub, name(sub), sub.name_len_);
+                copy.set_stamp(first + i, stamp(file.first_sub_ + i));
+                copy.set_counts(first + i, counts(file.first_sub_ + i));
+                const DirSummary *summary = this->summary(file.first_sub_ + i);
+                if (summary) {
+                    copy.set_summary(first + i, *summary);
+                }
+                if (spilled(file.first_sub_ + i)) {
+                    copy.spilled_[first + i] = spilled_[file.first_sub_ + i];
+                }
+                queue.push_back(std::make_pair(file.first_sub_ + i, first + i));
+            }
+        }
+        nodes_.swap(copy.nodes_);
+        stamp_ids_.swap(copy.stamp_ids_);
+        stamps_.swap(copy.stamps_);
+        summaries_.swap(copy.summaries_);
+        spilled_.swap(copy.spilled_);
+        names_.swap(copy.names_);
+        apparent_.swap(copy.apparent_);
+        files_.swap(copy.files_);
+        dirs_.swap(copy.dirs_);
+    }
+
+    static int compare_names(const char *lhs, size_t lhs_len, const char *rhs, size_t rhs_len)
+    {
+        int cmp = memcmp(lhs, rhs, std::min(lhs_len, rhs_len));
+        if (cmp != 0)
+            return cmp;
+        return (lhs_len < rhs_len) ? -1 : (lhs_len > rhs_len) ? 1 : 0;
+    }
+
+private:
+    FileTree(const FileTree &);
+    FileTree &operator=(const FileTree &);
+
+    // Stores a NUL terminated copy of name in the name arena.
+    const char *copy_name(const char *name, size_t len)
+    {
+        char *buf = &names_[names_.append(len + 1, true)];
+        memcpy(buf, name, len);
+        return buf;
+    }
+
+    // The index of the first stamp of an id not below id.
+    size_t find_stamp(NodeId id) const
+    {
+        size_t lo = 0, hi = stamp_ids_.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (stamp_ids_[mid] < id) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Under mutex_, or before other threads see the tree.  A directory gets
+    // its entry in the table the first time it is stamped, even with an
+    // empty stamp, which every way of adding nodes does in id order.  A
+    // stamp for a directory older than the newest one in the table would
+    // need an insert; it is dropped, which only costs a later walk a rescan.
+    void put_stamp(NodeId id, const DirStamp &stamp)
+    {
+        size_t at = find_stamp(id);
+        if (at < stamp_ids_.size() && stamp_ids_[at] == id) {
+            stamps_[at] = stamp;
+        }
+        else if (at == stamp_ids_.size() && nodes_[id].type_ == FILE_TYPE_DIRECTORY) {
+            stamp_ids_[stamp_ids_.append(1)] = id;
+            stamps_[stamps_.append(1)] = stamp;
+        }
+    }
+
+    // Appends n zeroed nodes.  Returns the id of the first.
+    NodeId append_nodes(size_t n)
+    {
+        if (counted_) {
+            apparent_.append(n);
+            files_.append(n);
+            dirs_.append(n);
+        }
+        return nodes_.append(n);
+    }
+
+    char *alloc_name(FileInfo &file, size_t len)
+    {
+        if (len > 0xffff) {
+            log_message(__FILE__, __LINE__, "WARN: name of %zu bytes truncated", len);
+            len = 0xffff;
+        }
+        file.name_ = names_.append(len + 1, true);
+        file.name_len_ = len;
+        return &names_[file.name_];
+    }
+
+    void set_name(FileInfo &file, const char *name, size_t len)
+    {
+        char *buf = alloc_name(file, len);
+        memcpy(buf, name, file.name_len_);
+    }
+
+    // see from_json()
+    struct JsonSub;
+    struct NameLess;
+    struct JsonHandler;
+
+    Allocator &allocator_;
+    ChunkedArray<FileInfo, 16> nodes_;
+    ChunkedArray<NodeId, 16> stamp_ids_;  // of the directories, increasing
+    ChunkedArray<DirStamp, 16> stamps_;   // theirs, by index in stamp_ids_
+    std::unordered_map<NodeId, DirSummary> summaries_;
+    ChunkedArray<char, 20> names_;
+    uint32_t generation_;
+    bool summarize_;
+    std::unique_ptr<EntryFilter> filter_;
+    unsigned breakdown_by_;
+    Breakdown breakdown_;
+    bool counted_;
+    // NodeCounts by node id, only appended to while counted_
+    ChunkedArray<uint64_t, 16> apparent_;
+    ChunkedArray<uint64_t, 16> files_;
+    ChunkedArray<uint64_t, 16> dirs_;
+    Checkpoint *checkpoint_;
+    std::unordered_set<NodeId> pending_;    // see pending()
+    bool sorted_;
+    SpillPolicy spill_;
+    std::unordered_map<NodeId, std::shared_ptr<SpilledFiles> > spilled_;
+    ScanStats *stats_;
+    std::unique_ptr<ScanThrottle> throttle_;
+    ListDir lister_;        // see specialize()
+    std::mutex mutex_;
+};
+
+// Decodes a varint at p, not reading past end.  Returns NULL if it is cut
+// short.
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *value);
+
+// Binary snapshot layout, in native byte order:
+//
+//     BinaryHeader
+//     string table: nstrings_ NUL terminated names, each stored once
+//     string offsets: nstrings_ uint64_t, relative to strings_, 8-aligned
+//     nodes, in preorder:
+//         varint   index of the name in the string table
+//         varint   size
+//         uint8_t  type
+//         varint   mtime, ctime and ino of the DirStamp, for directories
+//                  only, from version 2 on
+//         varint   entries of the DirSummary plus one, or 0 if there is
+//                  none, for directories only, from version 3 on; if not
+//                  0, followed by the index of the largest name plus one
+//                  (0 if none) and varint largest size
+//         varint   apparent size, then for directories only, files and dirs
+//                  of the NodeCounts: from version 4 on, with BINARY_COUNTS
+//                  in flags_
+//         varint   number of sub files
+//         varint   bytes taken by the sub files, which follow right away,
+//                  so that a reader can skip to the next sibling
+//     with BINARY_BREAKDOWN in flags_, the Breakdown up to file_size_, see
+//     Breakdown::encode(); readers which do not know it stop at the nodes
+//
+// Sub files are always sorted by name, so a reader can diff a mapped
+// snapshot in place.  Trees without counts are written as version 3, still
+// readable by the readers of then.
+const char BINARY_MAGIC[8] = {'D', 'M', 'O', 'N', 'S', 'N', 'A', 'P'};
+const uint32_t BINARY_VERSION = 4;
+const uint32_t BINARY_SORTED = 1;
+const uint32_t BINARY_BREAKDOWN = 2;
+const uint32_t BINARY_COUNTS = 4;
+
+// Version 1 headers end at generation_, and strings_ always follows the
+// header.
+struct BinaryHeader
+{
+    char magic_[8];
+    uint32_t version_;
+    uint32_t flags_;
+    uint64_t nnodes_;
+    uint64_t nstrings_;
+    uint64_t strings_;
+    uint64_t offsets_;
+    uint64_t nodes_;
+    uint64_t file_size_;
+    uint32_t generation_;
+    uint32_t reserved_;
+};
+
+bool is_binary_snapshot(const std::string &file_path);
+
+// A mapped binary snapshot, read in place: open() checks that the nodes
+// nest within the file, without keeping anything of them, and they are
+// decoded again as they are visited.
+class BinarySnapshot
+{
+public:
+    struct Node
+    {
+        const uint8_t *subs_;   // where the first sub file starts
+        uint64_t name_;
+        uint64_t size_;
+        uint64_t nsubs_;
+        uint64_t subs_size_;
+        int type_;
+        DirStamp stamp_;
+        uint64_t entries_;      // plus one, 0 if there is no summary
+        uint64_t largest_;      // index plus one, 0 if none
+        uint64_t largest_size_;
+        NodeCounts counts_;
+    };
+
+    BinarySnapshot()
+    : data_(NULL)
+    , size_(0)
+    {}
+
+    ~BinarySnapshot();
+
+    bool open(const std::string &file_path);
+
+    size_t node_count() const { return header_.nnodes_; }
+
+    Node root() const { return decode(data_ + header_.nodes_); }
+
+    const char *name(const Node &node) const { return string_at(node.name_); }
+
+    size_t name_len(const Node &node) const { return strlen(name(node)); }
+    uint64_t size(const Node &node) const { return node.size_; }
+    int type(const Node &node) const { return node.type_; }
+    size_t nsubs(const Node &node) const { return node.nsubs_; }
+    Node first_sub(const Node &node) const { return decode(node.subs_); }
+    DirStamp stamp(const Node &node) const { return node.stamp_; }
+    uint32_t generation() const { return header_.generation_; }
+
+    bool counts(const Node &node, NodeCounts *counts) const
+    {
+        *counts = node.counts_;
+        return counted();
+    }
+
+    // Checkpoints are never binary.
+    bool pending(const Node &) const { return false; }
+
+    // BinaryWriter sorts them.
+    bool sorted() const { return true; }
+
+    const SpilledFiles *spilled(const Node &) const { return NULL; }
+
+    bool breakdown(Breakdown *breakdown) const;
+
+    bool summary(const Node &node, DirSummary *summary) const
+    {
+        if (node.entries_ == 0) {
+            return false;
+        }
+        *summary = DirSummary();
+        summary->entries_ = node.entries_ - 1;
+        if (node.largest_ > 0 && node.largest_ <= header_.nstrings_) {
+            summary->largest_ = string_at(node.largest_ - 1);
+            summary->largest_len_ = strlen(summary->largest_);
+            summary->largest_size_ = node.largest_size_;
+        }
+        return true;
+    }
+
+    Node next_sibling(const Node &node) const
+    {
+        const uint8_t *end = data_ + size_;
+        uint64_t left = end - node.subs_;
+        return decode(node.subs_ + std::min(node.subs_size_, left));
+    }
+
+private:
+    BinarySnapshot(const BinarySnapshot &);
+    BinarySnapshot &operator=(const BinarySnapshot &);
+
+    // The string at index in the table, or "" if it or its NUL would lie
+    // past the end of the mapping.
+    const char *string_at(uint64_t index) const
+    {
+        if (index >= header_.nstrings_ || offsets_[index] >= size_ - header_.strings_) {
+            return "";
+        }
+        const uint8_t *p = data_ + header_.strings_ + offsets_[index];
+        if (!memchr(p, '\0', data_ + size_ - p)) {
+            return "";
+        }
+        return reinterpret_cast<const char *>(p);
+    }
+
+    // Decodes the node at p, which with its sub files must end by end.
+    // Each sub file takes a byte at least, so a node has no more of them
+    // than bytes for them.
+    bool decode(const uint8_t *p, const uint8_t *end, Node *node) const
+    {
+        *node = Node();
+        uint64_t type = 0;
+        if (p < end
+                && (p = get_varint(p, end, &node->name_)) != NULL
+                && (p = get_varint(p, end, &node->size_)) != NULL
+                && (p = get_varint(p, end, &type)) != NULL
+                && (p = decode_stamp(p, type, &node->stamp_)) != NULL
+                && (p = decode_summary(p, type, node)) != NULL
+                && (p = decode_counts(p, type, &node->counts_)) != NULL
+                && (p = get_varint(p, end, &node->nsubs_)) != NULL
+                && (p = get_varint(p, end, &node->subs_size_)) != NULL
+                && p <= end && node->subs_size_ <= uint64_t(end - p)
+                && node->nsubs_ <= node->subs_size_) {
+            node->type_ = type;
+            node->subs_ = p;
+            return true;
+        }
+        return false;
+    }
+
+    // Nodes are only decoded once check_nodes() passed, so this does not
+    // fail; were it to, the node would be an empty file.
+    Node decode(const uint8_t *p) const
+    {
+        Node node;
+        if (!decode(p, data_ + size_, &node)) {
+            node = Node();
+            node.subs_ = data_ + size_;
+        }
+        return node;
+    }
+
+    // Walks all the nodes once, without recursion: each must decode, the
+    // sub files of a node must take exactly its subs_size_ bytes, and there
+    // must be node_count() of them.
+    bool check_nodes() const;
+
+    const uint8_t *decode_stamp(const uint8_t *p, uint64_t type, DirStamp *stamp) const
+    {
+        if (header_.version_ < 2 || type != FILE_TYPE_DIRECTORY) {
+            return p;
+        }
+        const uint8_t *end = data_ + size_;
+        uint64_t mtime, ctime;
+        if ((p = get_varint(p, end, &mtime)) != NULL
+                && (p = get_varint(p, end, &ctime)) != NULL
+                && (p = get_varint(p, end, &stamp->ino_)) != NULL) {
+            stamp->mtime_ = mtime;
+            stamp->ctime_ = ctime;
+        }
+        return p;
+    }
+
+    const uint8_t *decode_summary(const uint8_t *p, uint64_t type, Node *node) const
+    {
+        if (header_.version_ < 3 || type != FILE_TYPE_DIRECTORY) {
+            return p;
+        }
+        const uint8_t *end = data_ + size_;
+        if ((p = get_varint(p, end, &node->entries_)) == NULL || node->entries_ == 0) {
+            return p;
+        }
+        if ((p = get_varint(p, end, &node->largest_)) != NULL) {
+            p = get_varint(p, end, &node->largest_size_);
+        }
+        return p;
+    }
+
+    bool counted() const { return header_.version_ >= 4 && (header_.flags_ & BINARY_COUNTS); }
+
+    const uint8_t *decode_counts(const uint8_t *p, uint64_t type, NodeCounts *counts) const
+    {
+        if (!counted()) {
+            return p;
+        }
+        const uint8_t *end = data_ + size_;
+        if ((p = get_varint(p, end, &counts->apparent_)) != NULL && type == FILE_TYPE_DIRECTORY
+                && (p = get_varint(p, end, &counts->files_)) != NULL) {
+            p = get_varint(p, end, &counts->dirs_);
+        }
+        return p;
+    }
+
+    const uint8_t *data_;
+    size_t size_;
+    BinaryHeader header_;
+    const uint64_t *offsets_;
+};
+
+// One finding of a diff, passed to a DiffCallback.
+struct DiffRecord
+{
+    enum Kind {
+        GREW,           // grew by more than a single sub file explains
+        ADDED,          // only in the newer snapshot
+        REMOVED,        // only in the older snapshot
+        LARGEST_GREW,   // the largest entry of a summarized directory grew
+        LARGEST_NEW,    // another entry is now the largest, old_size_ is 0
+        ENTRIES,        // the sizes are entry counts of a summarized directory
+        FILES,          // the sizes are file counts, which grew by more than
+                        // a single sub file explains, or of an added directory
+        BREAKDOWN,      // path_ is a Breakdown key as dimension:key, uid:1000
+    };
+
+    Kind kind_;
+    const char *path_;  // NUL terminated, valid during the callback only
+    size_t path_len_;
+    uint64_t old_size_;
+    uint64_t new_size_;
+};
+
+// Called by the diff for each record, in the order of the walk: the sub
+// files of a grown directory come before it.  The BREAKDOWN records come
+// last.
+typedef std::function<void (const DiffRecord &)> DiffCallback;
+
+// How JSON snapshots are written.
+struct JsonOptions
+{
+    bool compact_;              // without indentation
+    Compression compression_;
+    size_t jobs_;               // threads writing the sub files of the root, if compact_
+
+    JsonOptions()
+    : compact_(false)
+    , compression_(COMPRESSION_NONE)
+    , jobs_(1)
+    {}
+};
+
+// A snapshot as diff and convert read it: JSON snapshots are loaded into a
+// FileTree, or with stream, left to be read by a JsonCursor; binary ones are
+// mapped and read in place.
+struct Snapshot
+{
+    FileTree tree_;
+    BinarySnapshot binary_;
+    std::string file_path_;
+    bool is_binary_;
+    bool stream_;
+
+    Snapshot()
+    : is_binary_(false)
+    , stream_(false)
+    {}
+
+    bool load(const std::string &file_path, bool stream = false);
+
+    // A streamed snapshot has its breakdown read from its head.
+    bool breakdown(Breakdown *breakdown) const;
+};
+
+// With njobs > 1, snapshots loaded in memory are diffed by a ParallelDiff;
+// streamed ones always by a single thread.  Their breakdowns, if any, are
+// diffed after the nodes.
+bool diff_snapshots(const Snapshot &newer, const Snapshot &older, const DiffCallback &callback,
+        size_t njobs = 1);
+
+// Diffs two trees in memory, such as two scan() results, sorting the sub
+// files of those which are not sorted().
+bool diff_trees(const FileTree &newer, const FileTree &older, const DiffCallback &callback,
+        size_t njobs = 1);
+
+// Writes tree to a new snapshot file named after root.  Returns its name,
+// or an empty string on failure.
+std::string write_snapshot(const FileTree &tree, const std::string &root, bool binary, int version,
+        const JsonOptions &json = JsonOptions());
+
+// Merges the snapshots of the shards of one walk, see ScanOptions::shard_,
+// into a JSON snapshot at file_path: the snapshot of the walk of the whole
+// tree, sorted, unless files with several hard links are in more than one
+// shard and count_links_ was not set, since each shard counts them once.
+// The shards, binary or sorted JSON, are read side by side
+// as streams, so that only their current paths are held: the sub files of
+// their roots are merged by name, and each is copied from the one shard
+// which has it.  Returns false if a shard cannot be read, is not of the
+// same root, or has a sub file of the root another one has too.  That no
+// shard is missing is left to the caller.
+bool merge_shards(const std::vector<std::string> &shards, const std::string &file_path,
+        const JsonOptions &json = JsonOptions());
+
+// What scan() walks and keeps.  The defaults are those of `dmon stat`.
+struct ScanOptions
+{
+    const char *backend_;   // "auto", "posix" or "uring"
+    int depth_;             // levels of directories kept as nodes
+    size_t jobs_;
+    bool one_filesystem_;   // see EntryFilter
+    bool count_links_;
+    bool summarize_;        // see DirSummary
+    unsigned breakdown_by_; // see Breakdown, a mask of 1 << Dimension
+    bool counted_;          // see NodeCounts
+    std::vector<std::string> excludes_;     // NameFilter patterns
+    std::vector<std::string> includes_;
+    std::string checkpoint_;    // see Checkpoint; if set, walks with one thread
+    double checkpoint_every_;   // seconds between saves
+    bool resume_;               // from checkpoint_, if it is there; hard
+                                // links counted before it count again
+    uint32_t shard_;            // see EntryFilter::set_shard(); the root of
+    uint32_t nshards_;          // shards above 0 leaves out its own size
+    double max_ops_;            // see ScanThrottle, 0 for no cap
+    double target_latency_;     // seconds per entry, 0 to keep all jobs_
+    SpillPolicy spill_;         // of huge directories, see SpilledFiles
+    ScanStats *stats_;          // to time the walk into, or NULL
+
+    ScanOptions()
+    : backend_("auto")
+    , depth_(5)
+    , jobs_(1)
+    , one_filesystem_(false)
+    , count_links_(false)
+    , summarize_(false)
+    , breakdown_by_(0)
+    , counted_(false)
+    , checkpoint_every_(300)
+    , resume_(false)
+    , shard_(0)
+    , nshards_(1)
+    , max_ops_(0)
+    , target_latency_(0)
+    , stats_(NULL)
+    {}
+};
+
+// Walks root into tree.  Returns false if the backend is unknown.  With a
+// checkpoint_, the walk is saved to it as it goes, and with resume_, goes
+// on from where the one saved there stopped; a checkpoint of another root,
+// or none, starts over.  The checkpoint is left for the caller to remove.
+bool scan(const std::string &root, const ScanOptions &options, FileTree &tree);
+
+} // namespace dmon
+
+#endif // DMON_H
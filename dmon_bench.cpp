@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+
+// Microbenchmarks of the scan, serialize, load and diff paths on
+// synthetic trees, built both on disk (tmpfs by default) and in memory.
+#include "dmon_internal.h"
+#include "dmon_synth.h"
+#include <getopt.h>
+
+// Current resident set size, in bytes.
+size_t current_rss()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(fp, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t file_size_of(const std::string &path)
+{
+    struct stat st;
+    return (stat(path.c_str(), &st) == 0) ? st.st_size : 0;
+}
+
+// Times rounds runs of a benchmark and prints the mean, with the
+// throughput in entries and optionally bytes per second.
+class Bench
+{
+public:
+    Bench(const char *name, size_t rounds)
+    : name_(name)
+    , rounds_(rounds)
+    , total_(0)
+    , rss_before_(current_rss())
+    {}
+
+    void start() { start_ = now_sec(); }
+    void stop() { total_ += now_sec() - start_; }
+
+    // The mean of a round.
+    double seconds() const { return total_ / rounds_; }
+
+    void report(size_t nentries, size_t nbytes = 0) const
+    {
+        double seconds = this->seconds();
+        printf("%-24s %8.3f s %10.2f M entries/s", name_, seconds, nentries / seconds / 1e6);
+        if (nbytes > 0) {
+            printf(" %8.1f MB/s", nbytes / seconds / 1e6);
+        }
+        size_t rss = current_rss();
+        printf("  rss %+.1f MB\n", (double(rss) - double(rss_before_)) / 1e6);
+    }
+
+private:
+    const char *name_;
+    size_t rounds_;
+    double total_;
+    double start_;
+    size_t rss_before_;
+};
+
+void bench_scan(const std::string &root, size_t rounds, size_t njobs)
+{
+    const char *backends[] = {"posix", "uring"};
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (size_t jobs = 1; jobs <= njobs; jobs = (jobs < njobs) ? njobs : jobs + 1) {
+            char name[64];
+            snprintf(name, sizeof(name), "scan %s -j%zu", backends[b], jobs);
+            Bench bench(name, rounds);
+            size_t nentries = 0;
+            for (size_t round = 0; round < rounds; round++) {
+                FileTree tree;
+                tree.set_root(root);
+                bench.start();
+                tree.walk_parallel(backends[b], FileTree::MAX_DEPTH, jobs);
+                bench.stop();
+                nentries = tree.size();
+            }
+            bench.report(nentries);
+        }
+    }
+}
+
+// Replays the same entries for every directory opened, from memory, so
+// that only the work of list_dir() on them is measured.
+class ReplayBackend : public ScanBackend
+{
+public:
+    explicit ReplayBackend(const std::vector<std::string> &names)
+    : names_(names)
+    {}
+
+    const char *name() const { return "replay"; }
+
+    DirStream *open(int fd, const std::string &)
+    {
+        return new Stream(fd, names_);
+    }
+
+private:
+    class Stream : public DirStream
+    {
+    public:
+        // fd stays the caller's
+        Stream(int fd, const std::vector<std::string> &names)
+        : DirStream(fd)
+        , names_(names)
+        , pos_(0)
+        {}
+
+        bool next(std::vector<DirEntry> &entries)
+        {
+            entries.clear();
+            for (; pos_ < names_.size() && entries.size() < 256; pos_++) {
+                DirEntry entry;
+                entry.name_ = names_[pos_].c_str();
+                entry.error_ = 0;
+                memset(&entry.st_, 0, sizeof(entry.st_));
+                entry.st_.st_mode = S_IFREG | 0644;
+                entry.st_.st_nlink = 1;
+                entry.st_.st_ino = pos_ + 1;
+                entry.st_.st_size = 4096;
+                entry.st_.st_blocks = 8;
+                entries.push_back(entry);
+            }
+            return !entries.empty();
+        }
+
+    private:
+        const std::vector<std::string> &names_;
+        size_t pos_;
+    };
+
+    const std::vector<std::string> &names_;
+};
+
+// Lists a directory of nfiles files, replayed from memory, through the
+// generic list_dir() and through the one list_dir_for() picks for the
+// features of a few `dmon stat` options, for the cost per entry of the
+// branches the specialized ones leave out.
+void bench_list(size_t nfiles, size_t rounds)
+{
+    std::vector<std::string> names;
+    for (size_t i = 0; i < nfiles; i++) {
+        names.push_back(file_name(i));
+    }
+    ReplayBackend backend(names);
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    const size_t nlists = 16;
+    const char *configs[] = {"-l", "(default)", "--exclude", "--by=ext"};
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        EntryFilter filter;
+        filter.set_count_links(c == 0);
+        if (c == 2) {
+            NameFilter names;
+            names.exclude("*.o");
+            names.compile();
+            filter.set_names(names);
+        }
+        Breakdown::Tally tally((c == 3) ? 1u << Breakdown::BY_EXT : 0);
+        unsigned features = filter.features() | ((c == 3) ? WALK_TALLY : 0);
+        ListDir listers[] = {list_dir, list_dir_for(features)};
+        double ns[2];
+        for (int l = 0; l < 2; l++) {
+            char name[64];
+            snprintf(name, sizeof(name), "list %s %s", l ? "special" : "generic", configs[c]);
+            Bench bench(name, rounds);
+            DirListing listing;
+            struct stat root_st;
+            memset(&root_st, 0, sizeof(root_st));
+            for (size_t round = 0; round < rounds; round++) {
+                filter.reset(root_st);
+                bench.start();
+                for (size_t i = 0; i < nlists; i++) {
+                    delete listers[l](backend, fd, "/replay", listing, &filter, &tally, NULL);
+                }
+                bench.stop();
+            }
+            bench.report(nfiles * nlists);
+            ns[l] = bench.seconds() * 1e9 / (nfiles * nlists);
+        }
+        printf("%-24s %8.1f ns/entry generic, %.1f specialized\n", configs[c], ns[0], ns[1]);
+    }
+    close(fd);
+}
+
+// Diff records are dropped, so that only the traversal is measured.
+void ignore_diff(const DiffRecord &)
+{
+}
+
+// Serializes, loads and diffs the in-memory trees old_tree and new_tree,
+// through files under dir.
+void bench_snapshots(const FileTree &old_tree, const FileTree &new_tree, const std::string &dir, size_t rounds)
+{
+    size_t nentries = new_tree.size();
+    std::string json[2] = {join_path(dir, "old.json"), join_path(dir, "new.json")};
+    std::string bin[2] = {join_path(dir, "old.bin"), join_path(dir, "new.bin")};
+
+    {
+        Bench bench("serialize json", rounds);
+        for (size_t round = 0; round < rounds; round++) {
+            bench.start();
+            write_json_file(FileTreeView(new_tree), json[1], SNAPSHOT_VERSION);
+            bench.stop();
+        }
+        bench.report(nentries, file_size_of(json[1]));
+    }
+    {
+        Bench bench("serialize binary", rounds);
+        for (size_t round = 0; round < rounds; round++) {
+            bench.start();
+            BinaryWriter writer(new_tree);
+            writer.write(bin[1]);
+            bench.stop();
+        }
+        bench.report(nentries, file_size_of(bin[1]));
+    }
+    write_json_file(FileTreeView(old_tree), json[0], SNAPSHOT_VERSION);
+    BinaryWriter writer(old_tree);
+    writer.write(bin[0]);
+
+    {
+        Bench bench("load json", rounds);
+        for (size_t round = 0; round < rounds; round++) {
+            FileTree tree;
+            bench.start();
+            tree.from_json(json[1]);
+            bench.stop();
+        }
+        bench.report(nentries, file_size_of(json[1]));
+    }
+    {
+        // mapping is lazy, so read every node to compare
+        Bench bench("load binary", rounds);
+        for (size_t round = 0; round < rounds; round++) {
+            bench.start();
+            BinarySnapshot snapshot;
+            snapshot.open(bin[1]);
+            ViewCursor<BinarySnapshot> cursor(snapshot);
+            DiffEntry entry;
+            size_t depth = 0;
+            if (cursor.next(entry)) {
+                cursor.enter();
+                depth++;
+            }
+            while (depth > 0) {
+                if (cursor.next(entry)) {
+                    cursor.enter();
+                    depth++;
+                }
+                else {
+                    depth--;
+                }
+            }
+            bench.stop();
+        }
+        bench.report(nentries, file_size_of(bin[1]));
+    }
+
+    struct DiffCase {
+        const char *name_;
+        const std::string *files_;
+        bool stream_;
+    } cases[] = {
+        {"diff json", json, false},
+        {"diff json --stream", json, true},
+        {"diff binary", bin, false},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        Bench bench(cases[c].name_, rounds);
+        for (size_t round = 0; round < rounds; round++) {
+            Snapshot older, newer;
+            bench.start();
+            bool ok;
+            {
+                QuietStderr quiet;
+                ok = older.load(cases[c].files_[0], cases[c].stream_)
+                    && newer.load(cases[c].files_[1], cases[c].stream_)
+                    && diff_snapshots(newer, older, ignore_diff);
+            }
+            bench.stop();
+            if (!ok) {
+                LOG("%s failed", cases[c].name_);
+            }
+        }
+        bench.report(nentries);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        unlink(json[i].c_str());
+        unlink(bin[i].c_str());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    TreeShape shape;
+    size_t rounds = 3;
+    size_t njobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string dir = "/dev/shm";
+    bool disk = true;
+    enum {
+        OPT_FANOUT = 256,
+        OPT_DEPTH,
+        OPT_FILES,
+        OPT_FILE_SIZE,
+        OPT_DIR,
+        OPT_NO_DISK,
+    };
+    static const struct option long_options[] = {
+        {"fanout", required_argument, NULL, OPT_FANOUT},
+        {"depth", required_argument, NULL, OPT_DEPTH},
+        {"files", required_argument, NULL, OPT_FILES},
+        {"file-size", required_argument, NULL, OPT_FILE_SIZE},
+        {"dir", required_argument, NULL, OPT_DIR},
+        {"no-disk", no_argument, NULL, OPT_NO_DISK},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = std::max(1ul, strtoul(optarg, NULL, 10));
+            break;
+        case 'j':
+            njobs = std::max(1ul, strtoul(optarg, NULL, 10));
+            break;
+        case OPT_FANOUT:
+            shape.fanout_ = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_DEPTH:
+            shape.depth_ = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_FILES:
+            shape.files_ = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_FILE_SIZE:
+            shape.file_size_ = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_DIR:
+            dir = optarg;
+            break;
+        case OPT_NO_DISK:
+            disk = false;
+            break;
+        default:
+            printf(
+                    "Usage:\n"
+                    "    %s [-n rounds] [-j N] [--fanout=N] [--depth=N] [--files=N] [--file-size=bytes]\n"
+                    "          [--dir=path] [--no-disk]\n",
+                    argv[0]
+                    );
+            return -1;
+        }
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "dmon_bench.%d", int(getpid()));
+    std::string root = join_path(dir, name);
+    if (mkdir(root.c_str(), 0755) != 0) {
+        LOG("cannot create %s: %s", root.c_str(), strerror(errno));
+        return -1;
+    }
+
+    FileTree old_tree, new_tree;
+    double start = now_sec();
+    build_tree(old_tree, root, shape, 0);
+    build_tree(new_tree, root, shape, 1);
+    printf("%zu entries, fanout %u, depth %u, %u files per directory, %zu rounds\n",
+            new_tree.size(), shape.fanout_, shape.depth_, shape.files_, rounds);
+    printf("%-24s %8.3f s  %.1f bytes/entry\n", "build in memory", (now_sec() - start) / 2,
+            double(new_tree.memory_usage()) / new_tree.size());
+
+    int ret = 0;
+    if (disk) {
+        std::string tree_root = join_path(root, "tree");
+        start = now_sec();
+        if (create_subs(tree_root, shape, 0, 1, 0)) {
+            printf("%-24s %8.3f s\n", "create on disk", now_sec() - start);
+            bench_scan(tree_root, rounds, njobs);
+        }
+        else {
+            ret = -1;
+        }
+        remove_tree(tree_root);
+    }
+    bench_list(1 << 16, rounds);
+    bench_snapshots(old_tree, new_tree, root, rounds);
+    rmdir(root.c_str());
+    printf("max rss %s\n", r_sz(max_rss()));
+    return ret;
+}
@@ -0,0 +1,3161 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+
+// The rest of dmon, for its own sources: the walk, the snapshot writers
+// and cursors, the diff, the caches and the history, with the platform
+// headers they need, and shorthands.  Not part of the libdmon API in
+// dmon.h, and not stable.
+#ifndef DMON_INTERNAL_H
+#define DMON_INTERNAL_H
+
+#include "dmon.h"
+
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <cerrno>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <ctime>
+#include <cmath>
+#include <sys/uio.h>
+#include <climits>
+
+#include <rapidjson/writer.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/filereadstream.h>
+#include <rapidjson/error/en.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/stringbuffer.h>
+#include <chrono>
+#include <list>
+#include <set>
+#include <thread>
+
+#define LOG(FMT, ARGS...) dmon::log_message(__FILE__, __LINE__, FMT, ARGS)
+
+namespace dmon {
+
+const size_t BLOCK_SIZE = 512;
+
+
+std::string flatten_path(const std::string &path);
+
+std::string time_to_str();
+
+double now_sec();
+
+// Peak resident set size of the process so far, in bytes.
+size_t max_rss();
+
+// ext is ".json" or ".bin"
+std::string make_snapshot_file_name(const std::string &path, const char *ext);
+
+std::string readable_size(size_t nbytes);
+
+// non-reentrant version, for convenience
+const char *r_sz(size_t nbytes);
+
+uint64_t now_ns();
+
+// Returns false if name is none of "none", "gzip" or "zstd", or if dmon
+// was built without the library for it.
+bool parse_compression(const char *name, Compression *compression);
+
+// ".json", ".json.gz" or ".json.zst"
+const char *json_extension(Compression compression);
+
+// Creates file_path to write a stream compressed on the fly, which fclose()
+// ends.
+FILE *open_compressed(const std::string &file_path, Compression compression);
+
+// Opens a JSON snapshot to read it, decompressed on the fly if it starts
+// with the magic number of gzip or zstd.
+FILE *open_json(const std::string &file_path);
+
+// Appends len bytes of data to out, compressed as a whole gzip member or
+// zstd frame, so that such pieces concatenate into a valid stream.
+bool compress_piece(Compression compression, const char *data, size_t len, std::string &out);
+
+// Writes all of iov, IOV_MAX buffers per writev().
+bool writev_all(int fd, std::vector<struct iovec> &iov);
+
+// Counters and timers for `stat --stats`, passed to a scan by pointer.
+// Without one, the hot paths only test for NULL; with one, each timed call
+// costs two clock reads and two relaxed atomic adds, from any thread.
+class ScanStats
+{
+public:
+    enum Op {
+        OP_OPENDIR,     // openat() of a directory
+        OP_READDIR,     // readdir() or getdents64()
+        OP_LSTAT,       // fstatat() or statx, one per entry
+        OP_ALLOC,       // adding listed entries to the tree, one per node
+        NOPS,
+    };
+
+    static const size_t NSLOWEST = 10;
+
+    ScanStats()
+    : entries_(0)
+    , dirs_(0)
+    , slowest_min_(0)
+    {
+        for (size_t i = 0; i < NOPS; i++) {
+            calls_[i] = 0;
+            nsecs_[i] = 0;
+        }
+    }
+
+    void add(Op op, uint64_t calls, uint64_t nsecs)
+    {
+        calls_[op].fetch_add(calls, std::memory_order_relaxed);
+        nsecs_[op].fetch_add(nsecs, std::memory_order_relaxed);
+    }
+
+    // Counts a directory of nentries listed in nsecs, keeping the slowest.
+    void add_dir(const std::string &path, uint64_t nentries, uint64_t nsecs)
+    {
+        dirs_.fetch_add(1, std::memory_order_relaxed);
+        entries_.fetch_add(nentries, std::memory_order_relaxed);
+        if (nsecs <= slowest_min_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        slowest_.push_back(std::make_pair(nsecs, path));
+        std::sort(slowest_.begin(), slowest_.end(), std::greater<std::pair<uint64_t, std::string> >());
+        if (slowest_.size() > NSLOWEST) {
+            slowest_.pop_back();
+        }
+        if (slowest_.size() == NSLOWEST) {
+            slowest_min_ = slowest_.back().first;
+        }
+    }
+
+    void add_phase(const char *name, double seconds)
+    {
+        phases_.push_back(std::make_pair(name, seconds));
+    }
+
+    // Reports what was counted, through LOG or as JSON on stdout.
+    void report(bool json) const;
+
+private:
+    std::atomic<uint64_t> calls_[NOPS];
+    std::atomic<uint64_t> nsecs_[NOPS];
+    std::atomic<uint64_t> entries_;
+    std::atomic<uint64_t> dirs_;
+    std::atomic<uint64_t> slowest_min_;
+    std::mutex mutex_;
+    std::vector<std::pair<uint64_t, std::string> > slowest_;   // slowest first
+    std::vector<std::pair<const char *, double> > phases_;
+};
+
+// Adds the time from its construction to its end to op of stats, unless
+// stats is NULL.
+class OpTimer
+{
+public:
+    OpTimer(ScanStats *stats, ScanStats::Op op, uint64_t calls = 1)
+    : stats_(stats)
+    , op_(op)
+    , calls_(calls)
+    , start_(stats ? now_ns() : 0)
+    {}
+
+    ~OpTimer()
+    {
+        if (start_) {
+            stats_->add(op_, calls_, now_ns() - start_);
+        }
+    }
+
+private:
+    OpTimer(const OpTimer &);
+    OpTimer &operator=(const OpTimer &);
+
+    ScanStats *stats_;
+    ScanStats::Op op_;
+    uint64_t calls_;
+    uint64_t start_;
+};
+
+// Holds a walk back for `stat --max-ops` and `--target-latency`, so that
+// it does not starve what else runs on the filesystem.
+//
+// A token bucket caps the entries listed and stat'ed, plus one per
+// directory, per second over all threads; a thread which overdraws it
+// sleeps off the debt.  With a target latency, the time per entry goes
+// into a histogram of 8 buckets per power of 2, and every ADJUST_NS the
+// 99th percentile of the window sets how many workers of the parallel
+// walk may take tasks: starting from one, they double while it stays
+// under the target, are halved once it goes over, and are then only
+// added one at a time.  Unless configured, list_dir() only tests a flag.
+// Each FileTree has its own, for the walks of it.
+class ScanThrottle
+{
+public:
+    static const uint64_t ADJUST_NS = 100000000;
+    static const uint64_t MIN_SAMPLES = 64;     // per window, else it goes on
+    static const size_t NBUCKETS = 62 * 8;
+
+    ScanThrottle();
+
+    bool enabled() const { return rate_ > 0 || target_ns_ > 0; }
+    bool adaptive() const { return target_ns_ > 0; }
+
+    // ops_per_sec of 0 for no cap, target_ns of 0 to keep all workers.
+    void configure(double ops_per_sec, uint64_t target_ns);
+
+    // Starts a walk of njobs workers, all of them active unless adaptive.
+    void start(size_t njobs);
+
+    // Whether worker self of the parallel walk may take a task.
+    bool active(size_t self) const { return self < active_.load(std::memory_order_relaxed); }
+
+    size_t workers() const { return active_.load(std::memory_order_relaxed); }
+
+    // The percentile of the last window, 0 before the first.
+    uint64_t latency_ns() const { return latency_ns_; }
+
+    // Takes ops tokens, sleeping if the bucket is overdrawn.
+    void limit(uint64_t ops)
+    {
+        if (rate_ > 0) {
+            take(ops);
+        }
+    }
+
+    // Counts ops entries listed in nsecs in all, then limits them.
+    void sample(uint64_t ops, uint64_t nsecs)
+    {
+        if (target_ns_ > 0 && ops > 0) {
+            histogram_[bucket(nsecs / ops)].fetch_add(ops, std::memory_order_relaxed);
+            samples_.fetch_add(ops, std::memory_order_relaxed);
+            uint64_t now = now_ns();
+            if (now - window_start_.load(std::memory_order_relaxed) >= ADJUST_NS) {
+                adjust(now);
+            }
+        }
+        limit(ops);
+    }
+
+    static size_t bucket(uint64_t nsecs);
+
+    // The largest latency of bucket i.
+    static uint64_t bucket_ceiling(size_t i);
+
+private:
+    ScanThrottle(const ScanThrottle &);
+    ScanThrottle &operator=(const ScanThrottle &);
+
+    void take(uint64_t ops);
+    void adjust(uint64_t now);
+
+    double rate_;
+    uint64_t target_ns_;
+    size_t njobs_;
+    std::atomic<size_t> active_;
+    std::mutex bucket_mutex_;
+    double tokens_;
+    uint64_t refilled_ns_;
+    std::atomic<uint64_t> histogram_[NBUCKETS];
+    std::atomic<uint64_t> samples_;
+    std::atomic<uint64_t> window_start_;
+    std::mutex adjust_mutex_;
+    bool slow_start_;
+    uint64_t latency_ns_;
+};
+
+// Skips "." and "..", and entries whose d_type tells they are neither
+// regular files, directories nor symlinks, which the walker would drop
+// anyway.  Those are never stat'ed.
+bool want_dirent(const char *name, unsigned char d_type);
+
+// An entry of a directory together with its lstat() result.
+struct DirEntry
+{
+    const char *name_;  // valid until the next call to DirStream::next()
+    int error_;         // errno of the failed stat, st_ is garbage if not 0
+    struct stat st_;
+};
+
+// The entries of one open directory, in readdir order.
+class DirStream
+{
+public:
+    explicit DirStream(int fd)
+    : fd_(fd)
+    {}
+
+    virtual ~DirStream() {}
+
+    // The fd of the directory, for openat() on its sub directories.
+    int fd() const { return fd_; }
+
+    // Replaces entries with the next batch.  Returns false once the
+    // directory is exhausted.
+    virtual bool next(std::vector<DirEntry> &entries) = 0;
+
+protected:
+    int fd_;
+};
+
+// How the walker lists and stats directories.  Backends are not thread
+// safe; each walker thread has its own.
+class ScanBackend
+{
+public:
+    ScanBackend()
+    : stats_(NULL)
+    {}
+
+    virtual ~ScanBackend() {}
+
+    virtual const char *name() const = 0;
+
+    // Where its calls are timed, or NULL.
+    ScanStats *stats() const { return stats_; }
+
+    // Takes ownership of fd, the open directory path.  Returns NULL on
+    // failure, with errno set and fd closed.
+    virtual DirStream *open(int fd, const std::string &path) = 0;
+
+    // Returns the backend named name ("posix" or "uring"), or NULL if
+    // there is no such backend.  A backend which is not supported by the
+    // running kernel falls back to "posix".  Its calls are timed into stats
+    // if not NULL.
+    static ScanBackend *create(const char *name, ScanStats *stats = NULL);
+
+    // Resolves "auto" to the backend to use for scanning path: "uring" on
+    // network filesystems, where batching hides the round trips, and
+    // "posix" elsewhere, where stat is cheap enough that the io_uring
+    // overhead does not pay off.  Other names are returned unchanged.
+    static const char *choose(const char *name, const char *path);
+
+protected:
+    ScanStats *stats_;
+};
+
+// A deque of tasks per worker thread of a parallel walk or diff: a worker
+// takes its own newest task, so that it goes depth first, or else steals
+// the oldest of another worker, which is likely the largest.
+template <typename Task>
+class WorkQueues
+{
+public:
+    explicit WorkQueues(size_t nworkers)
+    : workers_(nworkers)
+    {}
+
+    size_t size() const { return workers_.size(); }
+
+    void push(size_t self, Task *task)
+    {
+        Worker &worker = workers_[self];
+        std::lock_guard<std::mutex> lock(worker.mutex_);
+        worker.tasks_.push_back(task);
+    }
+
+    // Returns NULL if every deque is empty.
+    Task *pop(size_t self)
+    {
+        {
+            Worker &worker = workers_[self];
+            std::lock_guard<std::mutex> lock(worker.mutex_);
+            if (!worker.tasks_.empty()) {
+                Task *task = worker.tasks_.back();
+                worker.tasks_.pop_back();
+                return task;
+            }
+        }
+        for (size_t i = 1; i < workers_.size(); i++) {
+            Worker &victim = workers_[(self + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex_);
+            if (!victim.tasks_.empty()) {
+                Task *task = victim.tasks_.front();
+                victim.tasks_.pop_front();
+                return task;
+            }
+        }
+        return NULL;
+    }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex_;
+        std::deque<Task *> tasks_;
+    };
+
+    std::vector<Worker> workers_;
+};
+
+// How a worker finding every deque of WorkQueues empty waits for more:
+// it yields at first, then sleeps ever longer, up to 1 ms, so that on a
+// narrow tree the idle workers leave their cores idle too.
+class IdleBackoff
+{
+public:
+    IdleBackoff()
+    : idle_(0)
+    {}
+
+    // Once a task was taken.
+    void reset() { idle_ = 0; }
+
+    void wait()
+    {
+        if (idle_ < YIELDS) {
+            idle_++;
+            std::this_thread::yield();
+            return;
+        }
+        unsigned shift = idle_ - YIELDS;
+        if (shift < MAX_SHIFT) {
+            idle_++;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min(1u << shift, 1000u)));
+    }
+
+private:
+    static const unsigned YIELDS = 16;
+    static const unsigned MAX_SHIFT = 10;   // 1024 us, cut to 1 ms
+
+    unsigned idle_;
+};
+
+// Stamps a directory from its stat.  A directory changed within the last
+// second is not stamped: timestamps are coarse, so a change made right
+// after the stat could go unnoticed by a later walk.
+DirStamp make_stamp(const struct stat &st);
+
+struct DirListing;
+
+// The sub files other than directories of one huge directory, moved out of
+// its DirListing to disk so that the memory of a walk stays bounded however
+// many entries a directory has: every spill() appends a run of records
+// sorted by name to an unlinked temporary file, and a Reader merges the
+// runs back in name order when the snapshot is written.  Only the totals
+// stay in memory.
+class SpilledFiles
+{
+public:
+    struct Record
+    {
+        const char *name_;  // valid until the next call to Reader::next()
+        size_t name_len_;
+        int type_;
+        uint64_t size_;
+        uint64_t apparent_;
+    };
+
+    // Merges the runs.  Several readers may read the same files at once.
+    class Reader
+    {
+    public:
+        explicit Reader(const SpilledFiles &files);
+
+        // Returns false at the end, or on a read error, which is logged.
+        bool next(Record &record);
+
+    private:
+        struct Run
+        {
+            uint64_t offset_;   // of the next record in the file
+            uint64_t end_;
+            std::vector<char> buf_;     // [pos_, len_) are the bytes at offset_
+            size_t pos_;
+            size_t len_;
+            Record record_;     // the current one, ahead of offset_
+        };
+
+        // Makes need bytes at offset_ readable in buf_.
+        bool fill(Run &run, size_t need);
+
+        // Reads the next record of run into its record_.
+        bool advance(Run &run);
+
+        // orders the run with the least name on top of the heap
+        struct After
+        {
+            const std::vector<Run> *runs_;
+
+            bool operator()(size_t lhs, size_t rhs) const;
+        };
+
+        const SpilledFiles &files_;
+        std::vector<Run> runs_;
+        std::vector<size_t> heap_;
+        size_t last_;       // run of the record returned last, or -1
+    };
+
+    ~SpilledFiles();
+
+    // Creates the temporary file in dir.  Returns NULL on failure.
+    static SpilledFiles *create(const std::string &dir);
+
+    // Has no runs, for reading none.
+    static const SpilledFiles &none();
+
+    // Moves the sub files of listing other than directories to a new run.
+    // Returns false on a write error, which is logged, leaving listing as
+    // it was.
+    bool spill(DirListing &listing);
+
+    uint64_t count() const { return count_; }
+    uint64_t size() const { return size_; }
+    uint64_t apparent() const { return apparent_; }
+
+    // The largest of them, of ties the least in name order, for DirSummary.
+    const std::string &largest() const { return largest_; }
+    uint64_t largest_size() const { return largest_size_; }
+
+private:
+    explicit SpilledFiles(int fd);
+    SpilledFiles(const SpilledFiles &);
+    SpilledFiles &operator=(const SpilledFiles &);
+
+    int fd_;
+    std::vector<std::pair<uint64_t, uint64_t> > runs_;  // offset and length
+    uint64_t end_;
+    uint64_t count_;
+    uint64_t size_;
+    uint64_t apparent_;
+    std::string largest_;
+    uint64_t largest_size_;
+};
+
+// The entries of one directory, collected before they are added to a
+// FileTree so that they can be stored next to each other.  With a spill
+// policy, list_dir() moves the sub files other than directories to
+// spilled_ once there are more than after_ of them, and then all of them,
+// leaving only the sub directories.
+struct DirListing
+{
+    struct Entry
+    {
+        size_t size_;
+        uint64_t apparent_;     // st_size
+        size_t name_;   // offset in names_
+        uint32_t name_len_;
+        uint8_t type_;
+        DirStamp stamp_;
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<char> names_;
+    size_t nfiles_;     // entries which are not directories
+    SpillPolicy spill_;
+    std::unique_ptr<SpilledFiles> spilled_;  // NULL unless spilled
+
+    DirListing()
+    : nfiles_(0)
+    {}
+
+    const char *name(const Entry &entry) const { return &names_[entry.name_]; }
+
+    // Keeps the spill policy.
+    void clear()
+    {
+        entries_.clear();
+        names_.clear();
+        nfiles_ = 0;
+        spilled_.reset();
+    }
+
+    // Moves the sub files which are not directories to spilled_, created
+    // first if need be.  Returns false on failure, which is logged.
+    bool spill();
+
+    void add(const char *name, int type, size_t size, const DirStamp &stamp = DirStamp(), uint64_t apparent = 0)
+    {
+        Entry entry;
+        entry.size_ = size;
+        entry.apparent_ = apparent;
+        entry.stamp_ = stamp;
+        entry.name_ = names_.size();
+        entry.name_len_ = strlen(name);
+        entry.type_ = type;
+        names_.insert(names_.end(), name, name + entry.name_len_ + 1);
+        entries_.push_back(entry);
+        if (type != FILE_TYPE_DIRECTORY) {
+            nfiles_++;
+        }
+    }
+
+    // Whether the entries are in the order of FileTree::compare_names().
+    bool sorted() const;
+
+    // Puts the entries in that order, as list_dir() leaves them.
+    void sort();
+};
+
+// Classifies an entry the way the walker stores it: FILE_TYPE_UNKNOWN for
+// anything but regular files, directories and symlinks, which are dropped.
+int stat_to_type(const struct stat &st, size_t *size);
+
+// A set of (st_dev, st_ino) pairs, for counting each hard linked file
+// once.  Only files with more than one link go in, so it stays small next
+// to the tree.  It is split in shards by hash, each an open addressing
+// table of 16 byte slots with its own lock, so that the threads of the
+// parallel walker seldom wait on each other, and a lookup touches one or
+// two cache lines.
+class InodeSet
+{
+public:
+    InodeSet() {}
+
+    // Adds the inode.  Returns false if it was in already.
+    bool insert(uint64_t dev, uint64_t ino)
+    {
+        uint64_t hash = mix(ino ^ (dev * 0x9e3779b97f4a7c15ULL));
+        Shard &shard = shards_[hash >> (64 - SHARD_BITS)];
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        if (ino == 0) {
+            // 0 marks an empty slot
+            bool found = std::find(shard.zero_devs_.begin(), shard.zero_devs_.end(), dev) != shard.zero_devs_.end();
+            if (!found) {
+                shard.zero_devs_.push_back(dev);
+            }
+            return !found;
+        }
+        if ((shard.size_ + 1) * 2 > shard.slots_.size()) {
+            grow(shard);
+        }
+        if (!insert(shard.slots_, hash, dev, ino)) {
+            return false;
+        }
+        shard.size_++;
+        return true;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < NSHARDS; i++) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex_);
+            std::vector<Slot>().swap(shards_[i].slots_);
+            shards_[i].zero_devs_.clear();
+            shards_[i].size_ = 0;
+        }
+    }
+
+private:
+    InodeSet(const InodeSet &);
+    InodeSet &operator=(const InodeSet &);
+
+    static const unsigned SHARD_BITS = 6;
+    static const size_t NSHARDS = size_t(1) << SHARD_BITS;
+
+    struct Slot
+    {
+        uint64_t dev_;
+        uint64_t ino_;
+    };
+
+    // Padded to a cache line, so that threads locking neighbouring shards
+    // do not share one.
+    struct Shard
+    {
+        std::mutex mutex_;
+        std::vector<Slot> slots_;           // a power of two, half full at most
+        std::vector<uint64_t> zero_devs_;   // devices with an inode 0
+        size_t size_;
+        char pad_[64];
+
+        Shard()
+        : size_(0)
+        {}
+    };
+
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    static bool insert(std::vector<Slot> &slots, uint64_t hash, uint64_t dev, uint64_t ino)
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            Slot &slot = slots[i];
+            if (slot.ino_ == 0) {
+                slot.dev_ = dev;
+                slot.ino_ = ino;
+                return true;
+            }
+            if (slot.ino_ == ino && slot.dev_ == dev) {
+                return false;
+            }
+        }
+    }
+
+    static void grow(Shard &shard)
+    {
+        std::vector<Slot> slots(std::max(size_t(64), shard.slots_.size() * 2));
+        memset(slots.data(), 0, slots.size() * sizeof(Slot));
+        for (size_t i = 0; i < shard.slots_.size(); i++) {
+            const Slot &slot = shard.slots_[i];
+            if (slot.ino_ != 0) {
+                insert(slots, mix(slot.ino_ ^ (slot.dev_ * 0x9e3779b97f4a7c15ULL)), slot.dev_, slot.ino_);
+            }
+        }
+        shard.slots_.swap(slots);
+    }
+
+    Shard shards_[NSHARDS];
+};
+
+// Glob patterns over file names, matched one path component at a time and
+// never against a full path, so that a pattern names what the walk prunes
+// wherever it is met: `node_modules`, `*.o`, `.snapshot/`.  A pattern is
+// made of literal bytes, `?` for any byte, `*` for any run of bytes, a
+// leading `.` included, `[...]` for a set with `a-z` ranges and `!` or `^`
+// negation, and `\` quoting the next byte; a `[` with no `]` is literal.
+// A trailing `/` makes a pattern only match directories.
+//
+// A name is left out if it matches an exclude pattern and no include
+// pattern, whatever their order, so `--exclude='.*' --include=.config`
+// keeps .config and no other dot file.  All patterns are compiled together
+// into one DFA over bytes, letting admit() cost a table lookup per byte of
+// the name however many patterns there are.
+class NameFilter
+{
+public:
+    NameFilter() {}
+
+    void exclude(const std::string &pattern) { add(pattern, EXCLUDE); }
+    void include(const std::string &pattern) { add(pattern, INCLUDE); }
+    bool empty() const { return patterns_.empty(); }
+
+    // Builds the DFA for the patterns added so far.  admit() keeps
+    // everything until then.
+    void compile();
+
+    // Returns false if a file called name, a directory if is_dir, is left
+    // out.  Thread safe.
+    bool admit(const char *name, size_t len, bool is_dir) const
+    {
+        if (accept_.empty()) {
+            return true;
+        }
+        uint32_t state = START;
+        for (size_t i = 0; i < len && state != DEAD; i++) {
+            state = next_[state * 256 + (unsigned char)name[i]];
+        }
+        unsigned match = accept_[state];
+        // the directory only bits sit above the others
+        match = is_dir ? (match | (match >> 2)) : (match & (EXCLUDE | INCLUDE));
+        return !(match & EXCLUDE) || (match & INCLUDE);
+    }
+
+private:
+    enum {
+        EXCLUDE = 1,
+        INCLUDE = 2,
+        DIR_ONLY = 4,   // shifts EXCLUDE or INCLUDE
+        DEAD = 0,
+        START = 1,
+    };
+
+    // A byte set, or with star_ any run of bytes of it.
+    struct Token
+    {
+        uint64_t bits_[4];
+        bool star_;
+
+        bool has(unsigned char c) const { return bits_[c >> 6] & (uint64_t(1) << (c & 63)); }
+    };
+
+    struct Pattern
+    {
+        std::vector<Token> tokens_;
+        unsigned accept_;   // EXCLUDE or INCLUDE, times DIR_ONLY if so
+    };
+
+    void add(const std::string &pattern, unsigned kind);
+    // Adds position pos of pattern, and those reached from it through
+    // stars matching nothing, to the DFA state states.
+    void close(uint32_t pattern, size_t pos, std::vector<uint64_t> &states) const;
+
+    std::vector<Pattern> patterns_;
+    // next_[state * 256 + byte] is the state after byte; state 0 is dead,
+    // with no pattern left to match, and state 1 the start
+    std::vector<uint32_t> next_;
+    std::vector<unsigned char> accept_;
+};
+
+// See Breakdown.
+class Breakdown::Tally
+{
+public:
+    // dimensions is a mask of 1 << Dimension.
+    explicit Tally(unsigned dimensions = 0)
+    : dimensions_(dimensions)
+    {}
+
+    void add(const char *name, const struct stat &st, uint64_t size)
+    {
+        if (dimensions_ == 0) {
+            return;
+        }
+        if (dimensions_ & (1 << BY_UID)) {
+            count(ids_[BY_UID][st.st_uid], size);
+        }
+        if (dimensions_ & (1 << BY_GID)) {
+            count(ids_[BY_GID][st.st_gid], size);
+        }
+        if ((dimensions_ & (1 << BY_EXT)) && S_ISREG(st.st_mode)) {
+            const char *dot = strrchr(name, '.');
+            size_t len = (dot && dot != name) ? strlen(dot + 1) : 0;
+            if (len > MAX_EXT) {
+                len = 0;
+            }
+            ext_.assign(len > 0 ? dot + 1 : "", len);
+            count(exts_[ext_], size);
+        }
+    }
+
+    // Adds the tally to breakdown and starts a new one.
+    void flush(Breakdown &breakdown);
+
+private:
+    static void count(Usage &usage, uint64_t size)
+    {
+        usage.size_ += size;
+        usage.count_++;
+    }
+
+    unsigned dimensions_;
+    std::unordered_map<uint32_t, Usage> ids_[2];    // by BY_UID and BY_GID
+    std::unordered_map<std::string, Usage> exts_;
+    std::string ext_;
+};
+
+// Writes breakdown as the "breakdown" member of a JSON snapshot's root: an
+// array of {"by": dimension, "key": key, "size": size, "count": count}.
+template <typename Writer>
+void write_breakdown(const Breakdown &breakdown, Writer &writer)
+{
+    writer.Key("breakdown");
+    writer.StartArray();
+    for (int d = 0; d < Breakdown::NDIMENSIONS; d++) {
+        const Breakdown::Table &table = breakdown.table(d);
+        for (Breakdown::Table::const_iterator it = table.begin(); it != table.end(); ++it) {
+            writer.StartObject();
+            writer.Key("by");
+            writer.String(Breakdown::dimension_name(d));
+            writer.Key("key");
+            writer.String(it->first.data(), it->first.size());
+            writer.Key("size");
+            writer.Uint64(it->second.size_);
+            writer.Key("count");
+            writer.Uint64(it->second.count_);
+            writer.EndObject();
+        }
+    }
+    writer.EndArray();
+}
+
+// What list_dir() does for each entry besides keeping it, as the bits of
+// the Features of the list_dir_with() specialized for a walk, so that the
+// loop over entries has no branch for a feature the walk runs without.
+enum WalkFeature
+{
+    WALK_FILTER = 1 << 0,       // names, one_filesystem or shards of EntryFilter
+    WALK_DEDUP = 1 << 1,        // hard links counted once, see EntryFilter
+    WALK_TALLY = 1 << 2,        // see Breakdown::Tally
+    WALK_SPILL = 1 << 3,        // see SpillPolicy
+    WALK_THROTTLE = 1 << 4,     // see ScanThrottle
+    WALK_ALL = (1 << 5) - 1,
+};
+
+// What a walk leaves out or counts once, on top of stat_to_type(): with
+// one_filesystem, entries on other devices than the root, as `du -x`
+// does, so mount points are neither listed nor crossed; unless
+// count_links, the size of a file with several hard links is only counted
+// for the first link walked, the others being kept with size 0.  With
+// several threads, which link that is depends on the order of the walk.
+// Entries the NameFilter leaves out are dropped too, a directory then
+// never being opened.  The root is never filtered.
+class EntryFilter
+{
+public:
+    EntryFilter()
+    : one_filesystem_(false)
+    , count_links_(true)
+    , dev_(0)
+    , shard_(0)
+    , nshards_(1)
+    {}
+
+    void set_one_filesystem(bool one_filesystem) { one_filesystem_ = one_filesystem; }
+    void set_count_links(bool count_links) { count_links_ = count_links; }
+    void set_names(const NameFilter &names) { names_ = names; }
+    const NameFilter &names() const { return names_; }
+
+    // With nshards above 1, only the sub files of root whose names
+    // shard_of() maps to shard are admitted, so that nshards walks, each of
+    // another shard, split the tree between them.  The root is told by its
+    // path as passed to list_dir().
+    void set_shard(uint32_t shard, uint32_t nshards, const std::string &root)
+    {
+        shard_ = shard;
+        nshards_ = nshards;
+        root_ = root;
+    }
+
+    // FNV-1a of name, so that every host maps a name alike.
+    static uint32_t shard_of(const char *name, uint32_t nshards)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (const char *p = name; *p; p++) {
+            hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+        }
+        return hash % nshards;
+    }
+
+    // The WalkFeature bits of what it is set to do.
+    unsigned features() const
+    {
+        return ((!names_.empty() || one_filesystem_ || nshards_ > 1) ? WALK_FILTER : 0)
+            | (!count_links_ ? WALK_DEDUP : 0);
+    }
+
+    // Whether the sub files of the directory at path are sharded.
+    bool sharded(const std::string &path) const { return nshards_ > 1 && path == root_; }
+    bool in_shard(const char *name) const { return shard_of(name, nshards_) == shard_; }
+
+    // Starts a new walk of the tree rooted at a file with st.
+    void reset(const struct stat &st)
+    {
+        dev_ = st.st_dev;
+        links_.clear();
+    }
+
+    // Returns false if the entry called name with st is to be left out.
+    // Otherwise sets *size and *apparent to the size and apparent size it
+    // adds.  Thread safe.
+    bool admit(const char *name, const struct stat &st, size_t *size, uint64_t *apparent)
+    {
+        return admit_with<WALK_ALL>(name, st, size, apparent);
+    }
+
+    // Same as admit(), for a walk with only the given WalkFeature bits.
+    template <unsigned Features>
+    bool admit_with(const char *name, const struct stat &st, size_t *size, uint64_t *apparent)
+    {
+        if ((Features & WALK_FILTER) && !names_.empty() && !names_.admit(name, strlen(name), S_ISDIR(st.st_mode))) {
+            return false;
+        }
+        if ((Features & WALK_FILTER) && one_filesystem_ && st.st_dev != dev_) {
+            return false;
+        }
+        *apparent = st.st_size;
+        if ((Features & WALK_DEDUP) && !count_links_ && !S_ISDIR(st.st_mode) && st.st_nlink > 1
+                && !links_.insert(st.st_dev, st.st_ino)) {
+            *size = 0;
+            *apparent = 0;
+        }
+        return true;
+    }
+
+private:
+    bool one_filesystem_;
+    bool count_links_;
+    dev_t dev_;
+    InodeSet links_;
+    NameFilter names_;
+    uint32_t shard_;
+    uint32_t nshards_;
+    std::string root_;
+};
+
+// Opens a directory for reading without following a symlink in its last
+// component.  parent_fd may be AT_FDCWD.  The call is timed into stats if
+// not NULL.
+int open_dir(int parent_fd, const char *name, ScanStats *stats = NULL);
+
+// Lists the directory open as fd into listing, through filter if not
+// NULL, and adds the entries admitted to tally if not NULL, held back by
+// throttle if not NULL.  The directory is counted in the stats() of
+// backend.  Returns the stream, still holding fd for openat() on the sub
+// directories, or NULL if the directory could not be opened.
+DirStream *list_dir(ScanBackend &backend, int fd, const std::string &path, DirListing &listing,
+        EntryFilter *filter = NULL, Breakdown::Tally *tally = NULL, ScanThrottle *throttle = NULL);
+
+
+// Same as list_dir(), specialized for a walk with only the WalkFeature
+// bits in features: one without them leaves the filter, tally, spill
+// policy or throttle which they stand for unused.  list_dir() itself is
+// the one with WALK_ALL.
+ListDir list_dir_for(unsigned features);
+
+// Saves a walk in progress to file_path, at most every interval seconds,
+// as a compact JSON snapshot in which the directories not walked to the
+// end carry "pending"; see FileTree::resume().  Each save is written aside
+// and renamed over the last one, so a walk killed at any time leaves a
+// whole checkpoint behind.
+class Checkpoint
+{
+public:
+    Checkpoint(const std::string &file_path, double interval)
+    : file_path_(file_path)
+    , interval_(interval)
+    , last_(now_sec())
+    {}
+
+    const std::string &file_path() const { return file_path_; }
+
+    bool due() const { return now_sec() - last_ >= interval_; }
+
+    // Adds tally, if not NULL, to the breakdown of tree first, as what it
+    // holds is of the directories already read.
+    void save(FileTree &tree, Breakdown::Tally *tally);
+
+private:
+    std::string file_path_;
+    double interval_;
+    double last_;
+};
+
+// ViewCursor and write_json() work on any snapshot that provides this
+// read-only view of its nodes:
+//
+//     typedef ... Node;                         // cheap to copy
+//     Node root() const;
+//     const char *name(const Node &) const;     // NUL terminated
+//     size_t name_len(const Node &) const;
+//     uint64_t size(const Node &) const;
+//     int type(const Node &) const;
+//     size_t nsubs(const Node &) const;
+//     Node first_sub(const Node &) const;       // only if nsubs() > 0
+//     Node next_sibling(const Node &) const;    // only if not the last one
+//     DirStamp stamp(const Node &) const;
+//     bool summary(const Node &, DirSummary *) const;   // false if none
+//     bool counts(const Node &, NodeCounts *) const;    // false if none
+//     bool pending(const Node &) const;     // see FileTree::pending()
+//     bool sorted() const;                  // see FileTree::sorted()
+//     const SpilledFiles *spilled(const Node &) const;  // see FileTree::spilled()
+//     uint32_t generation() const;
+//     bool breakdown(Breakdown *) const;                // false if none
+//
+// diff_cursors() expects sub files sorted by name.
+class FileTreeView
+{
+public:
+    typedef NodeId Node;
+
+    explicit FileTreeView(const FileTree &tree)
+    : tree_(tree)
+    {}
+
+    Node root() const { return 0; }
+    const char *name(Node id) const { return tree_.name(tree_.node(id)); }
+    size_t name_len(Node id) const { return tree_.node(id).name_len_; }
+    uint64_t size(Node id) const { return tree_.node(id).size_; }
+    int type(Node id) const { return tree_.node(id).type_; }
+    size_t nsubs(Node id) const { return tree_.node(id).nsubs_; }
+    Node first_sub(Node id) const { return tree_.node(id).first_sub_; }
+    Node next_sibling(Node id) const { return id + 1; }
+    DirStamp stamp(Node id) const { return tree_.stamp(id); }
+    uint32_t generation() const { return tree_.generation(); }
+
+    bool breakdown(Breakdown *breakdown) const
+    {
+        *breakdown = tree_.breakdown();
+        return !breakdown->empty();
+    }
+
+    bool counts(Node id, NodeCounts *counts) const
+    {
+        *counts = tree_.counts(id);
+        return tree_.counted();
+    }
+
+    bool pending(Node id) const { return tree_.pending(id); }
+    bool sorted() const { return tree_.sorted(); }
+    const SpilledFiles *spilled(Node id) const { return tree_.spilled(id); }
+
+    bool summary(Node id, DirSummary *summary) const
+    {
+        const DirSummary *found = tree_.summary(id);
+        if (found) {
+            *summary = *found;
+        }
+        return found != NULL;
+    }
+
+private:
+    const FileTree &tree_;
+};
+
+// A FileTreeView with the sub files of every directory in name order,
+// whatever their order in the tree, for diffing trees which are not
+// sorted().
+// The order costs 4 bytes per node.
+class SortedTreeView
+{
+public:
+    // a position in order_, whose sub files are at the positions of the
+    // ids of the sub files of the node there
+    typedef NodeId Node;
+
+    explicit SortedTreeView(const FileTree &tree)
+    : tree_(tree)
+    , order_(tree.size())
+    {
+        order_[0] = 0;
+        std::vector<NodeId> stack(1, 0);
+        while (!stack.empty()) {
+            const FileInfo &file = tree_.node(stack.back());
+            stack.pop_back();
+            if (file.nsubs_ == 0) {
+                continue;
+            }
+            NodeId *begin = &order_[file.first_sub_];
+            NodeId *end = begin + file.nsubs_;
+            for (uint32_t i = 0; i < file.nsubs_; i++) {
+                begin[i] = file.first_sub_ + i;
+                stack.push_back(file.first_sub_ + i);
+            }
+            NameLess less(tree_);
+            if (!std::is_sorted(begin, end, less)) {
+                std::sort(begin, end, less);
+            }
+        }
+    }
+
+    Node root() const { return 0; }
+    const char *name(Node pos) const { return tree_.name(file(pos)); }
+    size_t name_len(Node pos) const { return file(pos).name_len_; }
+    uint64_t size(Node pos) const { return file(pos).size_; }
+    int type(Node pos) const { return file(pos).type_; }
+    size_t nsubs(Node pos) const { return file(pos).nsubs_; }
+    Node first_sub(Node pos) const { return file(pos).first_sub_; }
+    Node next_sibling(Node pos) const { return pos + 1; }
+    DirStamp stamp(Node pos) const { return tree_.stamp(order_[pos]); }
+    uint32_t generation() const { return tree_.generation(); }
+    bool breakdown(Breakdown *breakdown) const { return FileTreeView(tree_).breakdown(breakdown); }
+    bool counts(Node pos, NodeCounts *counts) const { return FileTreeView(tree_).counts(order_[pos], counts); }
+    bool pending(Node pos) const { return tree_.pending(order_[pos]); }
+    bool sorted() const { return true; }
+    const SpilledFiles *spilled(Node pos) const { return tree_.spilled(order_[pos]); }
+
+    bool summary(Node pos, DirSummary *summary) const
+    {
+        return FileTreeView(tree_).summary(order_[pos], summary);
+    }
+
+private:
+    struct NameLess
+    {
+        const FileTree &tree_;
+
+        explicit NameLess(const FileTree &tree)
+        : tree_(tree)
+        {}
+
+        bool operator()(NodeId lhs, NodeId rhs) const
+        {
+            const FileInfo &l = tree_.node(lhs);
+            const FileInfo &r = tree_.node(rhs);
+            return FileTree::compare_names(tree_.name(l), l.name_len_, tree_.name(r), r.name_len_) < 0;
+        }
+    };
+
+    const FileInfo &file(Node pos) const { return tree_.node(order_[pos]); }
+
+    const FileTree &tree_;
+    std::vector<NodeId> order_;
+};
+
+size_t varint_size(uint64_t value);
+
+void put_varint(FILE *fp, uint64_t value);
+
+// Writes tree as a binary snapshot.  The sub files of every directory are
+// written sorted by name, whatever their order in the tree.
+class BinaryWriter
+{
+public:
+    explicit BinaryWriter(const FileTree &tree)
+    : tree_(tree)
+    {}
+
+    bool write(const std::string &file_path)
+    {
+        size_t nnodes = tree_.size();
+        order_.resize(nnodes);
+        names_.resize(nnodes);
+        subs_sizes_.resize(nnodes);
+        order_[0] = 0;
+        prepare(0);
+
+        FILE *fp = fopen(file_path.c_str(), "wb");
+        if (!fp) {
+            LOG("cannot open file %s", file_path.c_str());
+            return false;
+        }
+        std::vector<char> breakdown;
+        if (!tree_.breakdown().empty()) {
+            tree_.breakdown().encode(breakdown);
+        }
+        BinaryHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic_, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        h.version_ = tree_.counted() ? BINARY_VERSION : 3;
+        h.flags_ = BINARY_SORTED | (breakdown.empty() ? 0 : BINARY_BREAKDOWN) | (tree_.counted() ? BINARY_COUNTS : 0);
+        h.nnodes_ = nnodes;
+        h.generation_ = tree_.generation();
+        h.nstrings_ = string_offsets_.size();
+        h.strings_ = sizeof(h);
+        h.offsets_ = align8(h.strings_ + strings_.size());
+        h.nodes_ = h.offsets_ + h.nstrings_ * sizeof(uint64_t);
+        h.file_size_ = h.nodes_ + node_size(0) + subs_sizes_[0] + breakdown.size();
+
+        fwrite(&h, sizeof(h), 1, fp);
+        fwrite(strings_.data(), 1, strings_.size(), fp);
+        for (uint64_t pos = h.strings_ + strings_.size(); pos < h.offsets_; pos++) {
+            putc(0, fp);
+        }
+        fwrite(string_offsets_.data(), sizeof(uint64_t), string_offsets_.size(), fp);
+        write_node(fp, 0);
+        if (!breakdown.empty()) {
+            fwrite(breakdown.data(), 1, breakdown.size(), fp);
+        }
+        bool ok = !ferror(fp);
+        if (fclose(fp) != 0 || !ok) {
+            LOG("failed to write %s", file_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+    struct NameLess
+    {
+        const FileTree &tree_;
+
+        explicit NameLess(const FileTree &tree)
+        : tree_(tree)
+        {}
+
+        bool operator()(NodeId lhs, NodeId rhs) const
+        {
+            const FileInfo &l = tree_.node(lhs);
+            const FileInfo &r = tree_.node(rhs);
+            return FileTree::compare_names(tree_.name(l), l.name_len_, tree_.name(r), r.name_len_) < 0;
+        }
+    };
+
+    // Interns the names and computes the sorted order and encoded size of
+    // the subtree of id.  The sorted sub files of a node with sub files
+    // [first, first + n) are order_[first, first + n).
+    void prepare(NodeId id)
+    {
+        const FileInfo &file = tree_.node(id);
+        names_[id] = intern(tree_.name(file), file.name_len_);
+        const DirSummary *summary = tree_.summary(id);
+        if (summary && summary->largest_) {
+            intern(summary->largest_, summary->largest_len_);
+        }
+        uint64_t subs_size = 0;
+        if (file.nsubs_ > 0) {
+            NodeId *begin = &order_[file.first_sub_];
+            NodeId *end = begin + file.nsubs_;
+            for (size_t i = 0; i < file.nsubs_; i++) {
+                begin[i] = file.first_sub_ + i;
+            }
+            if (!std::is_sorted(begin, end, NameLess(tree_))) {
+                std::sort(begin, end, NameLess(tree_));
+            }
+            for (NodeId *it = begin; it != end; ++it) {
+                prepare(*it);
+                subs_size += node_size(*it) + subs_sizes_[*it];
+            }
+        }
+        subs_sizes_[id] = subs_size;
+    }
+
+    uint32_t intern(const char *s, size_t len)
+    {
+        std::string name(s, len);
+        std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> ret =
+            string_ids_.insert(std::make_pair(name, (uint32_t)string_offsets_.size()));
+        if (ret.second) {
+            string_offsets_.push_back(strings_.size());
+            strings_.insert(strings_.end(), name.c_str(), name.c_str() + name.size() + 1);
+        }
+        return ret.first->second;
+    }
+
+    uint64_t node_size(NodeId id) const
+    {
+        const FileInfo &file = tree_.node(id);
+        uint64_t size = varint_size(names_[id]) + varint_size(file.size_) + 1
+            + varint_size(file.nsubs_) + varint_size(subs_sizes_[id]);
+        if (file.type_ == FILE_TYPE_DIRECTORY) {
+            const DirStamp &stamp = tree_.stamp(id);
+            size += varint_size(stamp.mtime_) + varint_size(stamp.ctime_) + varint_size(stamp.ino_);
+            const DirSummary *summary = tree_.summary(id);
+            size += varint_size(summary ? summary->entries_ + 1 : 0);
+            if (summary) {
+                size += varint_size(largest(*summary)) + varint_size(summary->largest_size_);
+            }
+        }
+        if (tree_.counted()) {
+            NodeCounts counts = tree_.counts(id);
+            size += varint_size(counts.apparent_);
+            if (file.type_ == FILE_TYPE_DIRECTORY) {
+                size += varint_size(counts.files_) + varint_size(counts.dirs_);
+            }
+        }
+        return size;
+    }
+
+    // Returns the index plus one of the largest name of summary, which
+    // prepare() interned, or 0 if it has none.
+    uint32_t largest(const DirSummary &summary) const
+    {
+        if (!summary.largest_) {
+            return 0;
+        }
+        return string_ids_.find(std::string(summary.largest_, summary.largest_len_))->second + 1;
+    }
+
+    void write_node(FILE *fp, NodeId id)
+    {
+        const FileInfo &file = tree_.node(id);
+        put_varint(fp, names_[id]);
+        put_varint(fp, file.size_);
+        putc(file.type_, fp);
+        if (file.type_ == FILE_TYPE_DIRECTORY) {
+            const DirStamp &stamp = tree_.stamp(id);
+            put_varint(fp, stamp.mtime_);
+            put_varint(fp, stamp.ctime_);
+            put_varint(fp, stamp.ino_);
+            const DirSummary *summary = tree_.summary(id);
+            put_varint(fp, summary ? summary->entries_ + 1 : 0);
+            if (summary) {
+                put_varint(fp, largest(*summary));
+                put_varint(fp, summary->largest_size_);
+            }
+        }
+        if (tree_.counted()) {
+            NodeCounts counts = tree_.counts(id);
+            put_varint(fp, counts.apparent_);
+            if (file.type_ == FILE_TYPE_DIRECTORY) {
+                put_varint(fp, counts.files_);
+                put_varint(fp, counts.dirs_);
+            }
+        }
+        put_varint(fp, file.nsubs_);
+        put_varint(fp, subs_sizes_[id]);
+        for (size_t i = 0; i < file.nsubs_; i++) {
+            write_node(fp, order_[file.first_sub_ + i]);
+        }
+    }
+
+    const FileTree &tree_;
+    std::vector<NodeId> order_;
+    std::vector<uint32_t> names_;
+    std::vector<uint64_t> subs_sizes_;
+    std::unordered_map<std::string, uint32_t> string_ids_;
+    std::vector<char> strings_;
+    std::vector<uint64_t> string_offsets_;
+};
+
+// A node as the cursors of diff_cursors() read it, and as
+// write_json_members() writes it.
+struct DiffEntry
+{
+    const char *name_;  // valid until the next call on the cursor
+    size_t name_len_;
+    uint64_t size_;
+    int type_;
+    DirStamp stamp_;
+    bool summarized_;       // summary_ is set, also valid until the next call
+    DirSummary summary_;
+    bool counted_;          // counts_ is set
+    NodeCounts counts_;
+};
+
+// Writes the members of a node up to its "subs": its name as "path" if
+// full_path, else as "name", and for the root only, a version above 1,
+// "sorted" if sorted, a generation above 0 and a breakdown if not NULL.
+template <typename Writer>
+void write_json_members(Writer &writer, const DiffEntry &entry, bool full_path, int version, bool sorted,
+        uint32_t generation, const Breakdown *breakdown, bool pending)
+{
+    if (version > 1) {
+        writer.Key("version");
+        writer.Int(version);
+    }
+    // before any "subs", for from_json() to know it in time
+    if (sorted) {
+        writer.Key("sorted");
+        writer.Bool(true);
+    }
+    writer.Key(full_path ? "path" : "name");
+    writer.String(entry.name_, entry.name_len_);
+    writer.Key("size");
+    writer.Uint64(entry.size_);
+    writer.Key("type");
+    writer.Uint(entry.type_);
+    const DirStamp &stamp = entry.stamp_;
+    if (stamp.valid()) {
+        writer.Key("mtime");
+        writer.Uint64(stamp.mtime_);
+        writer.Key("ctime");
+        writer.Uint64(stamp.ctime_);
+        writer.Key("ino");
+        writer.Uint64(stamp.ino_);
+    }
+    if (generation > 0) {
+        writer.Key("generation");
+        writer.Uint(generation);
+    }
+    if (breakdown) {
+        write_breakdown(*breakdown, writer);
+    }
+    if (entry.summarized_) {
+        const DirSummary &summary = entry.summary_;
+        writer.Key("entries");
+        writer.Uint64(summary.entries_);
+        if (summary.largest_) {
+            writer.Key("largest");
+            writer.String(summary.largest_, summary.largest_len_);
+            writer.Key("largest_size");
+            writer.Uint64(summary.largest_size_);
+        }
+    }
+    if (entry.counted_) {
+        const NodeCounts &counts = entry.counts_;
+        writer.Key("apparent");
+        writer.Uint64(counts.apparent_);
+        if (entry.type_ == FILE_TYPE_DIRECTORY) {
+            writer.Key("files");
+            writer.Uint64(counts.files_);
+            writer.Key("dirs");
+            writer.Uint64(counts.dirs_);
+        }
+    }
+    if (pending) {
+        writer.Key("pending");
+        writer.Bool(true);
+    }
+}
+
+// Writes every sub file of the root in place; see ParallelJsonWriter for a
+// split which does not.
+struct NoJsonSplit
+{
+    template <typename Node, typename Writer>
+    bool operator()(const Node &, Writer &, const std::string &)
+    {
+        return false;
+    }
+};
+
+// Writes a snapshot of the given version, see SNAPSHOT_VERSION.  path is
+// the path of node; version 1 snapshots use it as the buffer for the paths
+// of the sub files.  Each sub file of the root is first offered to split,
+// with its path, which may take it to write it elsewhere.
+template <typename View, typename Writer, typename Split>
+void write_json(const View &view, const typename View::Node &node, Writer &writer, int version, std::string &path,
+        Split &split)
+{
+    bool is_root = path.empty();
+    if (is_root) {
+        path.assign(view.name(node), view.name_len(node));
+    }
+    writer.StartObject();
+    bool full_path = is_root || version == 1;
+    DiffEntry entry;
+    entry.name_ = full_path ? path.data() : view.name(node);
+    entry.name_len_ = full_path ? path.size() : view.name_len(node);
+    entry.size_ = view.size(node);
+    entry.type_ = view.type(node);
+    entry.stamp_ = view.stamp(node);
+    entry.summarized_ = view.summary(node, &entry.summary_);
+    entry.counted_ = view.counts(node, &entry.counts_);
+    Breakdown breakdown;
+    bool has_breakdown = is_root && view.breakdown(&breakdown);
+    write_json_members(writer, entry, full_path, is_root ? version : 0, is_root && view.sorted(),
+            is_root ? view.generation() : 0, has_breakdown ? &breakdown : NULL, view.pending(node));
+    size_t nsubs = view.nsubs(node);
+    const SpilledFiles *spilled = view.spilled(node);
+    if (nsubs > 0 || spilled) {
+        writer.Key("subs");
+        writer.StartArray();
+        // the spilled sub files are merged in by name
+        SpilledFiles::Reader reader(spilled ? *spilled : SpilledFiles::none());
+        SpilledFiles::Record record;
+        bool more = reader.next(record);
+        typename View::Node sub = (nsubs > 0) ? view.first_sub(node) : node;
+        size_t i = 0;
+        while (i < nsubs || more) {
+            size_t len = path.size();
+            if (i < nsubs && (!more || FileTree::compare_names(view.name(sub), view.name_len(sub),
+                            record.name_, record.name_len_) < 0)) {
+                if (version == 1) {
+                    push_path(path, view.name(sub), view.name_len(sub));
+                }
+                if (!is_root || !split(sub, writer, path)) {
+                    write_json(view, sub, writer, version, path, split);
+                }
+                if (++i < nsubs) {
+                    sub = view.next_sibling(sub);
+                }
+            }
+            else {
+                if (version == 1) {
+                    push_path(path, record.name_, record.name_len_);
+                }
+                DiffEntry file;
+                file.name_ = (version == 1) ? path.data() : record.name_;
+                file.name_len_ = (version == 1) ? path.size() : record.name_len_;
+                file.size_ = record.size_;
+                file.type_ = record.type_;
+                file.summarized_ = false;
+                file.counted_ = entry.counted_;
+                file.counts_ = NodeCounts();
+                file.counts_.apparent_ = record.apparent_;
+                writer.StartObject();
+                write_json_members(writer, file, version == 1, 0, false, 0, NULL, false);
+                writer.EndObject();
+                more = reader.next(record);
+            }
+            path.resize(len);
+        }
+        writer.EndArray();
+    }
+    writer.EndObject();
+}
+
+template <typename View, typename Writer>
+void write_json(const View &view, Writer &writer, int version = SNAPSHOT_VERSION)
+{
+    std::string path;
+    NoJsonSplit split;
+    write_json(view, view.root(), writer, version, path, split);
+}
+
+// diff_cursors() reads both snapshots as preorder streams through cursors,
+// so that it never needs more than the current path of either:
+//
+//     bool next(DiffEntry &);   // reads the next sibling at the current
+//                               // level, or returns false at the end of
+//                               // it and steps back up to the parent
+//     void enter();             // makes the sub files of the entry last
+//                               // read the current level
+//
+// Calling next() again without enter() skips the sub files of the entry.
+// The first level holds only the root.  Sub files must come sorted by
+// name.  See DiffEntry for what they read of a node.
+
+// A cursor over any view; see FileTreeView.
+template <typename View>
+class ViewCursor
+{
+public:
+    explicit ViewCursor(const View &view)
+    : view_(view)
+    {
+        push(view.root(), 1);
+    }
+
+    // A cursor whose first level holds only node.
+    ViewCursor(const View &view, const typename View::Node &node)
+    : view_(view)
+    {
+        push(node, 1);
+    }
+
+    bool next(DiffEntry &entry)
+    {
+        Level &level = levels_.back();
+        if (level.left_ == 0) {
+            levels_.pop_back();
+            return false;
+        }
+        if (level.started_) {
+            level.node_ = view_.next_sibling(level.node_);
+        }
+        level.started_ = true;
+        level.left_--;
+        const typename View::Node &node = level.node_;
+        entry.name_ = view_.name(node);
+        entry.name_len_ = view_.name_len(node);
+        entry.size_ = view_.size(node);
+        entry.type_ = view_.type(node);
+        entry.stamp_ = view_.stamp(node);
+        entry.summarized_ = view_.summary(node, &entry.summary_);
+        entry.counted_ = view_.counts(node, &entry.counts_);
+        return true;
+    }
+
+    void enter()
+    {
+        const typename View::Node &node = levels_.back().node_;
+        size_t nsubs = view_.nsubs(node);
+        push((nsubs > 0) ? view_.first_sub(node) : typename View::Node(), nsubs);
+    }
+
+    bool failed() const { return false; }
+
+    // The node of the entry last read.
+    const typename View::Node &node() const { return levels_.back().node_; }
+
+private:
+    struct Level
+    {
+        typename View::Node node_;
+        size_t left_;
+        bool started_;
+    };
+
+    void push(const typename View::Node &first, size_t n)
+    {
+        Level level;
+        level.node_ = first;
+        level.left_ = n;
+        level.started_ = false;
+        levels_.push_back(level);
+    }
+
+    const View &view_;
+    std::vector<Level> levels_;
+};
+
+// A cursor which pulls a JSON snapshot token by token, so that it is diffed
+// without being loaded.  Each node must have its "subs" after its other
+// members, as write_json() puts them, and sub files must be sorted by name,
+// as in snapshots converted from binary ones; anything else fails.
+class JsonCursor
+{
+public:
+    JsonCursor()
+    : fp_(NULL)
+    , stream_(NULL)
+    , handler_(token_)
+    , has_subs_(false)
+    , entered_(true)
+    , failed_(false)
+    {}
+
+    ~JsonCursor()
+    {
+        delete stream_;
+        if (fp_) {
+            fclose(fp_);
+        }
+    }
+
+    bool open(const std::string &file_path)
+    {
+        fp_ = open_json(file_path);
+        if (!fp_) {
+            LOG("cannot open file %s", file_path.c_str());
+            return false;
+        }
+        file_path_ = file_path;
+        buf_.resize(1024 * 256);
+        stream_ = new rapidjson::FileReadStream(fp_, buf_.data(), buf_.size());
+        reader_.IterativeParseInit();
+        levels_.push_back(Level());
+        return true;
+    }
+
+    bool next(DiffEntry &entry)
+    {
+        if (failed_) {
+            return false;
+        }
+        if (!entered_ && has_subs_) {
+            skip(1);
+            finish_node();
+        }
+        entered_ = true;
+        for (;;) {
+            if (levels_.empty()) {
+                return false;
+            }
+            Level &level = levels_.back();
+            bool is_root = (levels_.size() == 1);
+            if (level.empty_ || (is_root && level.started_)) {
+                levels_.pop_back();
+                return false;
+            }
+            if (!read()) {
+                return false;
+            }
+            if (token_.kind_ == TOKEN_START_OBJECT) {
+                if (!read_node(entry, is_root)) {
+                    return false;
+                }
+                if (level.started_ && FileTree::compare_names(entry.name_, entry.name_len_,
+                            level.last_name_.data(), level.last_name_.size()) <= 0) {
+                    return fail("sub files are not sorted by name");
+                }
+                level.last_name_.assign(entry.name_, entry.name_len_);
+                level.started_ = true;
+                entered_ = false;
+                return true;
+            }
+            if (is_root) {
+                return fail("json value is not an object");
+            }
+            if (token_.kind_ == TOKEN_END_ARRAY) {
+                levels_.pop_back();
+                finish_node();
+                return false;
+            }
+            LOG("WARN: element of 'subs' is not an object in %s", file_path_.c_str());
+            if (token_.kind_ == TOKEN_START_ARRAY) {
+                skip(1);
+            }
+        }
+    }
+
+    void enter()
+    {
+        entered_ = true;
+        levels_.push_back(Level());
+        levels_.back().empty_ = !has_subs_;
+    }
+
+    bool failed() const { return failed_; }
+
+    // The breakdown of the root, once its entry was read.
+    const Breakdown &breakdown() const { return breakdown_; }
+
+private:
+    enum TokenKind {
+        TOKEN_START_OBJECT,
+        TOKEN_END_OBJECT,
+        TOKEN_START_ARRAY,
+        TOKEN_END_ARRAY,
+        TOKEN_KEY,
+        TOKEN_STRING,
+        TOKEN_NUMBER,
+        TOKEN_OTHER,
+    };
+
+    struct Token
+    {
+        TokenKind kind_;
+        std::string str_;
+        uint64_t number_;
+    };
+
+    struct Handler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, Handler>
+    {
+        Token &token_;
+
+        explicit Handler(Token &token)
+        : token_(token)
+        {}
+
+        bool set(TokenKind kind)
+        {
+            token_.kind_ = kind;
+            return true;
+        }
+
+        bool Default() { return set(TOKEN_OTHER); }
+        bool Null() { return Default(); }
+        bool Bool(bool) { return Default(); }
+        bool Double(double) { return Default(); }
+        bool Int(int value) { return (value < 0) ? Default() : Uint64(value); }
+        bool Int64(int64_t value) { return (value < 0) ? Default() : Uint64(value); }
+        bool Uint(unsigned value) { return Uint64(value); }
+
+        bool Uint64(uint64_t value)
+        {
+            token_.number_ = value;
+            return set(TOKEN_NUMBER);
+        }
+
+        bool String(const char *s, rapidjson::SizeType len, bool)
+        {
+            token_.str_.assign(s, len);
+            return set(TOKEN_STRING);
+        }
+
+        bool Key(const char *s, rapidjson::SizeType len, bool)
+        {
+            token_.str_.assign(s, len);
+            return set(TOKEN_KEY);
+        }
+
+        bool StartObject() { return set(TOKEN_START_OBJECT); }
+        bool EndObject(rapidjson::SizeType) { return set(TOKEN_END_OBJECT); }
+        bool StartArray() { return set(TOKEN_START_ARRAY); }
+        bool EndArray(rapidjson::SizeType) { return set(TOKEN_END_ARRAY); }
+    };
+
+    struct Level
+    {
+        std::string last_name_;
+        bool started_;
+        bool empty_;
+
+        Level()
+        : started_(false)
+        , empty_(false)
+        {}
+    };
+
+    bool fail(const char *what)
+    {
+        if (!failed_) {
+            LOG("%s in %s at %zu", what, file_path_.c_str(), stream_->Tell());
+        }
+        failed_ = true;
+        return false;
+    }
+
+    bool read()
+    {
+        if (failed_) {
+            return false;
+        }
+        if (!reader_.IterativeParseNext<rapidjson::kParseDefaultFlags>(*stream_, handler_)) {
+            if (reader_.HasParseError()) {
+                LOG("failed to parse json from %s, error at %zu: %s",
+                        file_path_.c_str(),
+                        reader_.GetErrorOffset(),
+                        rapidjson::GetParseError_En(reader_.GetParseErrorCode())
+                        );
+                failed_ = true;
+                return false;
+            }
+            return fail("unexpected end of json");
+        }
+        return true;
+    }
+
+    // Skips tokens until depth open objects and arrays are closed.
+    void skip(int depth)
+    {
+        while (depth > 0 && read()) {
+            if (token_.kind_ == TOKEN_START_OBJECT || token_.kind_ == TOKEN_START_ARRAY) {
+                depth++;
+            }
+            else if (token_.kind_ == TOKEN_END_OBJECT || token_.kind_ == TOKEN_END_ARRAY) {
+                depth--;
+            }
+        }
+    }
+
+    // Skips the value after a key.
+    void skip_value()
+    {
+        if (read() && (token_.kind_ == TOKEN_START_OBJECT || token_.kind_ == TOKEN_START_ARRAY)) {
+            skip(1);
+        }
+    }
+
+    // Reads the records of a "breakdown" array up to its end, its start
+    // having just been read.
+    void read_breakdown()
+    {
+        while (read() && token_.kind_ != TOKEN_END_ARRAY) {
+            if (token_.kind_ == TOKEN_START_ARRAY) {
+                skip(1);
+            }
+            if (token_.kind_ != TOKEN_START_OBJECT) {
+                continue;
+            }
+            std::string by, key;
+            Breakdown::Usage usage;
+            while (read() && token_.kind_ == TOKEN_KEY) {
+                std::string member;
+                member.swap(token_.str_);
+                if (!read()) {
+                    return;
+                }
+                if (token_.kind_ == TOKEN_START_OBJECT || token_.kind_ == TOKEN_START_ARRAY) {
+                    skip(1);
+                }
+                else if (token_.kind_ == TOKEN_STRING && member == "by") {
+                    by.swap(token_.str_);
+                }
+                else if (token_.kind_ == TOKEN_STRING && member == "key") {
+                    key.swap(token_.str_);
+                }
+                else if (token_.kind_ == TOKEN_NUMBER && member == "size") {
+                    usage.size_ = token_.number_;
+                }
+                else if (token_.kind_ == TOKEN_NUMBER && member == "count") {
+                    usage.count_ = token_.number_;
+                }
+            }
+            int dimension = Breakdown::find_dimension(by.data(), by.size());
+            if (dimension >= 0) {
+                breakdown_.add(dimension, key, usage);
+            }
+        }
+    }
+
+    static bool is_node_member(const std::string &key)
+    {
+        return key == "path" || key == "name" || key == "size" || key == "type"
+            || key == "entries" || key == "largest" || key == "largest_size"
+            || key == "apparent" || key == "files" || key == "dirs";
+    }
+
+    // Reads the members of a node object up to its "subs", or to its end
+    // if it has none.  The full "path" of a version 1 snapshot is cut to
+    // its last component, except for the root.
+    bool read_node(DiffEntry &entry, bool is_root)
+    {
+        name_.clear();
+        entry.size_ = 0;
+        entry.type_ = FILE_TYPE_UNKNOWN;
+        entry.stamp_ = DirStamp();
+        entry.summarized_ = false;
+        entry.summary_ = DirSummary();
+        entry.counted_ = false;
+        entry.counts_ = NodeCounts();
+        bool has_largest = false;
+        has_subs_ = false;
+        while (read() && token_.kind_ == TOKEN_KEY) {
+            std::string key;
+            key.swap(token_.str_);
+            if (key == "subs") {
+                if (read() && token_.kind_ == TOKEN_START_ARRAY) {
+                    has_subs_ = true;
+                    break;
+                }
+                LOG("WARN: json value for 'subs' is not an array in %s", file_path_.c_str());
+                if (token_.kind_ == TOKEN_START_OBJECT) {
+                    skip(1);
+                }
+                continue;
+            }
+            if (!read()) {
+                break;
+            }
+            if (token_.kind_ == TOKEN_START_ARRAY && is_root && key == "breakdown") {
+                read_breakdown();
+            }
+            else if (token_.kind_ == TOKEN_START_OBJECT || token_.kind_ == TOKEN_START_ARRAY) {
+                skip(1);
+            }
+            else if (token_.kind_ == TOKEN_STRING && (key == "path" || key == "name")) {
+                name_.swap(token_.str_);
+                size_t sep = name_.rfind(SEP);
+                if (!is_root && sep != std::string::npos) {
+                    name_.erase(0, sep + 1);
+                }
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "size") {
+                entry.size_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "type") {
+                entry.type_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "mtime") {
+                entry.stamp_.mtime_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "ctime") {
+                entry.stamp_.ctime_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "ino") {
+                entry.stamp_.ino_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "entries") {
+                entry.summarized_ = true;
+                entry.summary_.entries_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_STRING && key == "largest") {
+                largest_.swap(token_.str_);
+                has_largest = true;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "largest_size") {
+                entry.summary_.largest_size_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "apparent") {
+                entry.counted_ = true;
+                entry.counts_.apparent_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "files") {
+                entry.counts_.files_ = token_.number_;
+            }
+            else if (token_.kind_ == TOKEN_NUMBER && key == "dirs") {
+                entry.counts_.dirs_ = token_.number_;
+            }
+            else if (is_root && key == "version"
+                    && (token_.kind_ != TOKEN_NUMBER || token_.number_ < 1 || token_.number_ > SNAPSHOT_VERSION)) {
+                return fail("unsupported snapshot version");
+            }
+        }
+        if (failed_) {
+            return false;
+        }
+        if (has_subs_ == (token_.kind_ == TOKEN_END_OBJECT)) {
+            return fail("malformed node");
+        }
+        entry.name_ = name_.c_str();
+        entry.name_len_ = name_.size();
+        if (has_largest) {
+            entry.summary_.largest_ = largest_.c_str();
+            entry.summary_.largest_len_ = largest_.size();
+        }
+        return true;
+    }
+
+    // Skips the members after the "subs" of a node, up to its end.
+    void finish_node()
+    {
+        while (read() && token_.kind_ == TOKEN_KEY) {
+            if (is_node_member(token_.str_)) {
+                fail("member after 'subs'");
+                return;
+            }
+            skip_value();
+        }
+    }
+
+    FILE *fp_;
+    std::string file_path_;
+    std::vector<char> buf_;
+    rapidjson::FileReadStream *stream_;
+    rapidjson::Reader reader_;
+    Token token_;
+    Handler handler_;
+    std::vector<Level> levels_;
+    std::string name_;
+    std::string largest_;
+    bool has_subs_;     // the entry last read has a "subs" array
+    bool entered_;      // its sub files are being read, or it has none
+    bool failed_;
+    Breakdown breakdown_;
+};
+
+void report_diff(const DiffCallback &callback, DiffRecord::Kind kind, const std::string &path,
+        uint64_t old_size, uint64_t new_size);
+
+// Reports what a DirSummary on both sides tells of a grown directory
+// below the kept depth: which entry is now the largest, and how many
+// entries were added or removed.
+void diff_summaries(const DirSummary &summary, const std::string &largest,
+        const DirSummary &older, const std::string &older_largest, std::string &path,
+        const DiffCallback &callback);
+
+// Reports a BREAKDOWN record for every key whose size differs between the
+// breakdowns, in the order of Breakdown::Dimension then of the keys.  A
+// dimension missing from either side was not tallied there, and is skipped.
+void diff_breakdowns(const Breakdown &newer, const Breakdown &older, const DiffCallback &callback);
+
+// The files an entry counts for: 1 for a file, the NodeCounts::files_ of a
+// counted directory, else 0.
+inline uint64_t file_count(const DiffEntry &entry)
+{
+    if (entry.type_ != FILE_TYPE_DIRECTORY) {
+        return 1;
+    }
+    return entry.counted_ ? entry.counts_.files_ : 0;
+}
+
+// Reports entry as ADDED, at path, and as well its files as FILES if it is
+// a directory and the diff is of counted snapshots.
+inline void report_added(const DiffCallback &callback, const std::string &path, const DiffEntry &entry,
+        bool counted)
+{
+    report_diff(callback, DiffRecord::ADDED, path, 0, entry.size_);
+    if (counted && entry.type_ == FILE_TYPE_DIRECTORY && entry.counted_ && entry.counts_.files_ > 0) {
+        report_diff(callback, DiffRecord::FILES, path, 0, entry.counts_.files_);
+    }
+}
+
+// Takes none of the pairs diff_entries() meets to diff them elsewhere; see
+// ParallelDiff for one which does.
+struct NoSplit
+{
+    template <typename NewCursor, typename OldCursor>
+    bool operator()(NewCursor &, const DiffEntry &, OldCursor &, const DiffEntry &, const std::string &)
+    {
+        return false;
+    }
+};
+
+// Reports the files which grew from older to file, both just read from
+// their cursors, path being the path of both.  With counts on both sides,
+// a directory which holds more files than before is looked into as well,
+// whatever its size, and its FILES are reported as the sizes are.  Each pair of sub files of
+// the same name is first offered to split, which may take it to diff it
+// elsewhere, in which case it is skipped here.
+template <typename NewCursor, typename OldCursor, typename Split>
+void diff_entries(NewCursor &new_cursor, const DiffEntry &file,
+        OldCursor &old_cursor, const DiffEntry &older, std::string &path, const DiffCallback &callback,
+        Split &split)
+{
+    uint64_t file_size = file.size_;
+    uint64_t older_size = older.size_;
+    bool counted = file.counted_ && older.counted_;
+    uint64_t files = file_count(file);
+    uint64_t older_files = file_count(older);
+    bool grew = file_size > older_size;
+    bool more_files = counted && files > older_files;
+    if (!grew && !more_files) {
+        return;
+    }
+    // copied, as the cursors move on
+    bool summarized = file.summarized_ && older.summarized_;
+    DirSummary summary, older_summary;
+    std::string largest, older_largest;
+    if (summarized) {
+        summary = file.summary_;
+        older_summary = older.summary_;
+        if (summary.largest_) {
+            largest.assign(summary.largest_, summary.largest_len_);
+        }
+        if (older_summary.largest_) {
+            older_largest.assign(older_summary.largest_, older_summary.largest_len_);
+        }
+    }
+
+    bool both_dirs = (file.type_ == FILE_TYPE_DIRECTORY) && (older.type_ == FILE_TYPE_DIRECTORY);
+    if (both_dirs) {
+        size_t change_count = 0;
+        size_t last_inc = 0;
+        size_t files_change_count = 0;
+        uint64_t last_files_inc = 0;
+        new_cursor.enter();
+        old_cursor.enter();
+        DiffEntry lfile, rfile;
+        bool lhas = new_cursor.next(lfile);
+        bool rhas = old_cursor.next(rfile);
+        while (lhas && rhas) {
+            uint64_t lsize = lfile.size_;
+            uint64_t rsize = rfile.size_;
+            uint64_t lfiles = file_count(lfile);
+            uint64_t rfiles = file_count(rfile);
+            int cmp = FileTree::compare_names(lfile.name_, lfile.name_len_, rfile.name_, rfile.name_len_);
+            size_t len = path.size();
+            if (cmp == 0) {
+                push_path(path, lfile.name_, lfile.name_len_);
+                if (!split(new_cursor, lfile, old_cursor, rfile, path)) {
+                    diff_entries(new_cursor, lfile, old_cursor, rfile, path, callback, split);
+                }
+                path.resize(len);
+                lhas = new_cursor.next(lfile);
+                rhas = old_cursor.next(rfile);
+                change_count += (lsize != rsize) ? 1 : 0;
+                if (lsize > rsize) {
+                    last_inc = lsize - rsize;
+                }
+                files_change_count += (lfiles != rfiles) ? 1 : 0;
+                if (lfiles > rfiles) {
+                    last_files_inc = lfiles - rfiles;
+                }
+            }
+            else if (cmp < 0) {
+                push_path(path, lfile.name_, lfile.name_len_);
+                report_added(callback, path, lfile, counted);
+                path.resize(len);
+                lhas = new_cursor.next(lfile);
+                if (lsize > 0) {
+                    change_count++;
+                    last_inc = lsize;
+                }
+                if (lfiles > 0) {
+                    files_change_count++;
+                    last_files_inc = lfiles;
+                }
+            }
+            else {
+                push_path(path, rfile.name_, rfile.name_len_);
+                report_diff(callback, DiffRecord::REMOVED, path, rsize, 0);
+                path.resize(len);
+                rhas = old_cursor.next(rfile);
+                if (rsize > 0) {
+                    change_count++;
+                }
+                files_change_count += (rfiles > 0) ? 1 : 0;
+            }
+        }
+        for (; lhas; lhas = new_cursor.next(lfile)) {
+            uint64_t lsize = lfile.size_;
+            uint64_t lfiles = file_count(lfile);
+            size_t len = push_path(path, lfile.name_, lfile.name_len_);
+            report_added(callback, path, lfile, counted);
+            path.resize(len);
+            last_inc = lsize;
+            if (lfiles > 0) {
+                files_change_count++;
+                last_files_inc = lfiles;
+            }
+        }
+        while (rhas) {
+            rhas = old_cursor.next(rfile);
+        }
+        if (grew) {
+            size_t total_inc = file_size - older_size;
+            if (change_count == 1 && last_inc == total_inc) {
+                // the size change is caused by a sub file
+            }
+            else {
+                report_diff(callback, DiffRecord::GREW, path, older_size, file_size);
+            }
+            if (summarized) {
+                diff_summaries(summary, largest, older_summary, older_largest, path, callback);
+            }
+        }
+        if (more_files && !(files_change_count == 1 && last_files_inc == files - older_files)) {
+            report_diff(callback, DiffRecord::FILES, path, older_files, files);
+        }
+    }
+    else if (grew) {
+        report_diff(callback, DiffRecord::GREW, path, older_size, file_size);
+    }
+}
+
+// Diffs two snapshots in one pass over both.  Returns false if either
+// cursor failed, in which case the report is incomplete.
+template <typename NewCursor, typename OldCursor>
+bool diff_cursors(NewCursor &new_cursor, OldCursor &old_cursor, const DiffCallback &callback)
+{
+    DiffEntry root, old_root;
+    if (!new_cursor.next(root) || !old_cursor.next(old_root)) {
+        return false;
+    }
+    std::string path(root.name_, root.name_len_);
+    NoSplit split;
+    diff_entries(new_cursor, root, old_cursor, old_root, path, callback, split);
+    return !new_cursor.failed() && !old_cursor.failed();
+}
+
+// Diffs two views in memory with njobs threads, and reports the records
+// in the order diff_cursors() does.  A pair of directories over threshold
+// bytes which grew is diffed by a task of its own, into a buffer which is
+// reported, once all the tasks are done, where the pair would have been.
+// The views are only read, from any thread.
+template <typename NewView, typename OldView>
+class ParallelDiff
+{
+public:
+    ParallelDiff(const NewView &new_view, const OldView &old_view, size_t njobs)
+    : new_view_(new_view)
+    , old_view_(old_view)
+    , workers_(std::max(njobs, size_t(1)))
+    , threshold_(0)
+    , pending_(0)
+    {}
+
+    bool diff(const DiffCallback &callback)
+    {
+        // about 16 tasks per thread, were the sizes spread evenly
+        const uint64_t MIN_THRESHOLD = 1024 * 1024;
+        threshold_ = std::max(MIN_THRESHOLD, new_view_.size(new_view_.root()) / (workers_.size() * 16));
+        Task *root = new Task(new_view_.root(), old_view_.root(),
+                std::string(new_view_.name(new_view_.root()), new_view_.name_len(new_view_.root())));
+        pending_ = 1;
+        workers_.push(0, root);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers_.size(); i++) {
+            threads.push_back(std::thread(&ParallelDiff::run, this, i));
+        }
+        run(0);
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        report(root, callback);
+        delete root;
+        return true;
+    }
+
+private:
+    struct Task;
+
+    // A record, or the place of the records of a task.
+    struct Item
+    {
+        DiffRecord::Kind kind_;
+        uint64_t old_size_;
+        uint64_t new_size_;
+        size_t path_;       // in paths_ of the task
+        size_t path_len_;
+        Task *task_;        // if set, the rest is not
+    };
+
+    struct Task
+    {
+        typename NewView::Node new_node_;
+        typename OldView::Node old_node_;
+        std::string path_;
+        std::vector<Item> items_;
+        std::string paths_;     // NUL terminated
+
+        Task(const typename NewView::Node &new_node, const typename OldView::Node &old_node,
+                const std::string &path)
+        : new_node_(new_node)
+        , old_node_(old_node)
+        , path_(path)
+        {}
+
+        ~Task()
+        {
+            for (size_t i = 0; i < items_.size(); i++) {
+                delete items_[i].task_;
+            }
+        }
+
+        void add(const DiffRecord &record)
+        {
+            Item item;
+            item.kind_ = record.kind_;
+            item.old_size_ = record.old_size_;
+            item.new_size_ = record.new_size_;
+            item.path_ = paths_.size();
+            item.path_len_ = record.path_len_;
+            item.task_ = NULL;
+            paths_.append(record.path_, record.path_len_ + 1);
+            items_.push_back(item);
+        }
+    };
+
+    class Split
+    {
+    public:
+        Split(ParallelDiff &diff, Task *task, size_t self)
+        : diff_(diff)
+        , task_(task)
+        , self_(self)
+        {}
+
+        bool operator()(ViewCursor<NewView> &new_cursor, const DiffEntry &file,
+                ViewCursor<OldView> &old_cursor, const DiffEntry &older, const std::string &path)
+        {
+            if (file.type_ != FILE_TYPE_DIRECTORY || older.type_ != FILE_TYPE_DIRECTORY
+                    || file.size_ <= older.size_ || file.size_ < diff_.threshold_) {
+                return false;
+            }
+            Task *task = new Task(new_cursor.node(), old_cursor.node(), path);
+            Item item = Item();
+            item.task_ = task;
+            task_->items_.push_back(item);
+            diff_.pending_++;
+            diff_.workers_.push(self_, task);
+            return true;
+        }
+
+    private:
+        ParallelDiff &diff_;
+        Task *task_;
+        size_t self_;
+    };
+
+    void run(size_t self)
+    {
+        IdleBackoff backoff;
+        while (pending_ > 0) {
+            Task *task = workers_.pop(self);
+            if (!task) {
+                backoff.wait();
+                continue;
+            }
+            backoff.reset();
+            ViewCursor<NewView> new_cursor(new_view_, task->new_node_);
+            ViewCursor<OldView> old_cursor(old_view_, task->old_node_);
+            DiffEntry file, older;
+            new_cursor.next(file);
+            old_cursor.next(older);
+            std::string path = task->path_;
+            Split split(*this, task, self);
+            diff_entries(new_cursor, file, old_cursor, older, path, [task](const DiffRecord &record) {
+                task->add(record);
+            }, split);
+            pending_--;
+        }
+    }
+
+    void report(const Task *task, const DiffCallback &callback) const
+    {
+        for (size_t i = 0; i < task->items_.size(); i++) {
+            const Item &item = task->items_[i];
+            if (item.task_) {
+                report(item.task_, callback);
+                continue;
+            }
+            DiffRecord record;
+            record.kind_ = item.kind_;
+            record.path_ = task->paths_.data() + item.path_;
+            record.path_len_ = item.path_len_;
+            record.old_size_ = item.old_size_;
+            record.new_size_ = item.new_size_;
+            callback(record);
+        }
+    }
+
+    const NewView &new_view_;
+    const OldView &old_view_;
+    WorkQueues<Task> workers_;
+    uint64_t threshold_;
+    std::atomic<size_t> pending_;
+};
+
+// Writes a compact snapshot with the sub files of the root serialized by
+// several threads.  The root is written first, with a hole where each of
+// its sub files goes; each hole is then filled by a piece serialized, and
+// compressed if asked for, by any thread into a buffer of its own, and
+// the pieces are written in order with writev() as soon as those before
+// them are.  The output is the same as that of a single Writer.
+template <typename View>
+class ParallelJsonWriter
+{
+public:
+    ParallelJsonWriter(const View &view, int version, const JsonOptions &options)
+    : view_(view)
+    , version_(version)
+    , options_(options)
+    , fd_(-1)
+    , next_(0)
+    , written_(0)
+    , failed_(false)
+    {}
+
+    bool write(const std::string &file_path)
+    {
+        fd_ = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            LOG("cannot open file %s", file_path.c_str());
+            return false;
+        }
+        rapidjson::Writer<rapidjson::StringBuffer> writer(root_);
+        std::string path;
+        write_json(view_, view_.root(), writer, version_, path, *this);
+        // the end of the root is a piece after the last sub file
+        Hole end;
+        end.offset_ = root_.GetSize();
+        holes_.push_back(end);
+        pieces_.resize(holes_.size());
+        done_.resize(holes_.size(), false);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(options_.jobs_, holes_.size()); i++) {
+            threads.push_back(std::thread(&ParallelJsonWriter::run, this));
+        }
+        run();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        if (close(fd_) != 0) {
+            failed_ = true;
+        }
+        if (failed_) {
+            LOG("cannot write %s: %s", file_path.c_str(), strerror(errno));
+        }
+        return !failed_;
+    }
+
+    // Takes sub, a sub file of the root, leaving a hole for it.
+    template <typename RootWriter>
+    bool operator()(const typename View::Node &sub, RootWriter &writer, const std::string &path)
+    {
+        // writes the separator before it
+        writer.RawValue("", 0, rapidjson::kObjectType);
+        Hole hole;
+        hole.sub_ = sub;
+        hole.path_ = path;
+        hole.offset_ = root_.GetSize();
+        holes_.push_back(hole);
+        return true;
+    }
+
+private:
+    struct Hole
+    {
+        typename View::Node sub_;
+        std::string path_;
+        size_t offset_;     // in the root
+    };
+
+    void run()
+    {
+        for (size_t i = next_++; i < holes_.size() && !failed_; i = next_++) {
+            // the root up to the hole, then the sub file
+            size_t begin = (i > 0) ? holes_[i - 1].offset_ : 0;
+            std::string piece(root_.GetString() + begin, holes_[i].offset_ - begin);
+            if (i + 1 < holes_.size()) {
+                rapidjson::StringBuffer sub;
+                rapidjson::Writer<rapidjson::StringBuffer> writer(sub);
+                NoJsonSplit split;
+                write_json(view_, holes_[i].sub_, writer, version_, holes_[i].path_, split);
+                piece.append(sub.GetString(), sub.GetSize());
+            }
+            if (options_.compression_ != COMPRESSION_NONE) {
+                std::string compressed;
+                if (!compress_piece(options_.compression_, piece.data(), piece.size(), compressed)) {
+                    failed_ = true;
+                }
+                piece.swap(compressed);
+            }
+            finish(i, piece);
+        }
+    }
+
+    // Writes the pieces from written_ on which are done.
+    void finish(size_t i, std::string &piece)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pieces_[i].swap(piece);
+        done_[i] = true;
+        std::vector<struct iovec> iov;
+        size_t end = written_;
+        for (; end < done_.size() && done_[end]; end++) {
+            struct iovec v;
+            v.iov_base = const_cast<char *>(pieces_[end].data());
+            v.iov_len = pieces_[end].size();
+            iov.push_back(v);
+        }
+        if (iov.empty()) {
+            return;
+        }
+        if (!failed_ && !writev_all(fd_, iov)) {
+            failed_ = true;
+        }
+        for (; written_ < end; written_++) {
+            std::string().swap(pieces_[written_]);
+        }
+    }
+
+    const View &view_;
+    int version_;
+    const JsonOptions &options_;
+    int fd_;
+    rapidjson::StringBuffer root_;
+    std::vector<Hole> holes_;
+    std::atomic<size_t> next_;
+    std::mutex mutex_;                  // for the rest
+    std::vector<std::string> pieces_;
+    std::vector<bool> done_;
+    size_t written_;
+    std::atomic<bool> failed_;
+};
+
+template <typename View>
+bool write_json_file(const View &view, const std::string &file_path, int version,
+        const JsonOptions &options = JsonOptions())
+{
+    if (options.compact_ && options.jobs_ > 1) {
+        ParallelJsonWriter<View> writer(view, version, options);
+        return writer.write(file_path);
+    }
+    const size_t BUF_SIZE = 1024 * 256;
+    char buf[BUF_SIZE];
+    FILE *fp = open_compressed(file_path, options.compression_);
+    if (!fp) {
+        LOG("cannot open file %s", file_path.c_str());
+        return false;
+    }
+    rapidjson::FileWriteStream fs(fp, buf, BUF_SIZE);
+    if (options.compact_) {
+        rapidjson::Writer<rapidjson::FileWriteStream> writer(fs);
+        write_json(view, writer, version);
+    }
+    else {
+        rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(fs);
+        writer.SetIndent(' ', 1);
+        write_json(view, writer, version);
+    }
+    if (fclose(fp) != 0) {
+        LOG("cannot write %s: %s", file_path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+template <typename NewCursor>
+bool diff_to_older(NewCursor &new_cursor, const Snapshot &older, const DiffCallback &callback)
+{
+    if (older.is_binary_) {
+        ViewCursor<BinarySnapshot> old_cursor(older.binary_);
+        return diff_cursors(new_cursor, old_cursor, callback);
+    }
+    if (older.stream_) {
+        JsonCursor old_cursor;
+        return old_cursor.open(older.file_path_) && diff_cursors(new_cursor, old_cursor, callback);
+    }
+    FileTreeView old_view(older.tree_);
+    ViewCursor<FileTreeView> old_cursor(old_view);
+    return diff_cursors(new_cursor, old_cursor, callback);
+}
+
+// recently found or inserted one to make room.
+template <typename Value>
+class LruCache
+{
+public:
+    explicit LruCache(size_t capacity)
+    : capacity_(std::max<size_t>(1, capacity))
+    {}
+
+    size_t size() const { return index_.size(); }
+
+    // Returns NULL if key is not there.  The value is valid until the next
+    // insert() or erase().
+    Value *find(const std::string &key)
+    {
+        typename Index::iterator it = index_.find(key);
+        if (it == index_.end()) {
+            return NULL;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    // Replaces the value of key, if any.
+    Value &insert(const std::string &key, const Value &value)
+    {
+        erase(key);
+        entries_.push_front(std::make_pair(key, value));
+        index_[key] = entries_.begin();
+        while (entries_.size() > capacity_) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+        return entries_.front().second;
+    }
+
+    void erase(const std::string &key)
+    {
+        typename Index::iterator it = index_.find(key);
+        if (it != index_.end()) {
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+    }
+
+private:
+    typedef std::list<std::pair<std::string, Value> > Entries;  // most recent first
+    typedef std::unordered_map<std::string, typename Entries::iterator> Index;
+
+    size_t capacity_;
+    Entries entries_;
+    Index index_;
+};
+
+// The snapshots last asked for, kept loaded for `dmon serve`: JSON ones in
+// a FileTree, binary ones mapped.  A snapshot is keyed by its file path and
+// loaded again once the file has another mtime, size or inode.  Not thread
+// safe.
+class SnapshotCache
+{
+public:
+    explicit SnapshotCache(size_t capacity)
+    : snapshots_(capacity)
+    {}
+
+    // Sets version to a string which tells this version of file_path from
+    // any other, for keying what is computed from it, without loading it.
+    // Returns false if the file cannot be stat'ed.
+    static bool version(const std::string &file_path, std::string *version);
+
+    // Returns NULL if file_path cannot be loaded.  Sets version as above.
+    // The snapshot stays valid while it is held, even once dropped from
+    // the cache.
+    std::shared_ptr<const Snapshot> get(const std::string &file_path, std::string *version);
+
+private:
+    struct Entry
+    {
+        std::string version_;
+        std::shared_ptr<const Snapshot> snapshot_;
+    };
+
+    LruCache<Entry> snapshots_;
+};
+
+// Keeps the n records of a diff which tell of the most growth in bytes:
+// the GREW, ADDED and LARGEST_GREW ones, or with RANK_FILES in files: the
+// FILES ones.  As the diff reports a directory only when its growth is not
+// all in one sub file, each growth is kept once, at the path it is
+// attributed to.  Takes O(n) memory, a min-heap of the records.
+class TopDiffs
+{
+public:
+    enum Rank {
+        RANK_BYTES,
+        RANK_FILES,
+    };
+
+    // Returns false if name is neither "bytes" nor "files".
+    static bool parse_rank(const char *name, Rank *rank);
+
+    explicit TopDiffs(size_t n, Rank rank = RANK_BYTES)
+    : n_(n)
+    , rank_(rank)
+    {}
+
+    void offer(const DiffRecord &record);
+
+    // Passes the kept records to callback, the most growth first.
+    void report(const DiffCallback &callback) const;
+
+private:
+    struct Entry
+    {
+        uint64_t delta_;
+        DiffRecord::Kind kind_;
+        uint64_t old_size_;
+        uint64_t new_size_;
+        std::string path_;
+    };
+
+    // orders the most growth first, of ties the smaller path
+    static bool after(const Entry &a, const Entry &b)
+    {
+        return a.delta_ != b.delta_ ? a.delta_ > b.delta_ : a.path_ < b.path_;
+    }
+
+    size_t n_;
+    Rank rank_;
+    std::vector<Entry> heap_;
+};
+
+// Writes DiffRecords to a stream in a machine readable format, through a
+// buffer of its own, with the sizes in bytes.  write() may be called from
+// several threads; each record is written whole.
+//  tsv     kind, path, old size, new size and delta, tab separated; tabs,
+//          newlines and backslashes in paths are escaped with backslashes
+//  json    an array of records
+//  ndjson  a record per line
+// A record is {"kind": ..., "path": ..., "old": ..., "new": ..., "delta": ...},
+// where kind is one of those of DiffWriter::kind_name().
+class DiffWriter
+{
+public:
+    enum Format {
+        FORMAT_TSV,
+        FORMAT_JSON,
+        FORMAT_NDJSON,
+    };
+
+    // Returns false if name is none of "tsv", "json" or "ndjson".
+    static bool parse_format(const char *name, Format *format);
+    static const char *kind_name(DiffRecord::Kind kind);
+
+    DiffWriter(FILE *fp, Format format);
+    ~DiffWriter() { finish(); }
+
+    void write(const DiffRecord &record);
+
+    // Ends the output and flushes it.  Returns false on a write error.
+    bool finish();
+
+private:
+    DiffWriter(const DiffWriter &);
+    DiffWriter &operator=(const DiffWriter &);
+
+    // Makes room for len more bytes, flushing the buffer if needed.
+    void reserve(size_t len);
+    void flush();
+    void put(const char *s, size_t len)
+    {
+        memcpy(&buf_[used_], s, len);
+        used_ += len;
+    }
+    void put(char c) { buf_[used_++] = c; }
+    void put_int(int64_t value);
+    void put_uint(uint64_t value);
+    void put_path(const char *path, size_t len);
+
+    FILE *fp_;
+    Format format_;
+    std::vector<char> buf_;
+    size_t used_;
+    size_t count_;      // records written
+    bool finished_;
+    bool failed_;
+    std::mutex mutex_;
+};
+
+// Walks a tree again with an older snapshot of it at hand.  A directory
+// whose stamp did not change still has the same sub files, so it is not
+// read again; its sub files are only stat'ed again for their sizes, as a
+// file can grow in place without touching its directory.  With
+// trust_mtime, the old sizes of the files are kept as well and only the sub
+// directories are stat'ed, to check their own stamps.  That misses files
+// changed in place, hence the periodic full walks of `stat --rescan-every`.
+// The hard links among the kept sizes are not seen by the EntryFilter, so
+// trust_mtime may count a file again through a link in a directory read
+// again.  A tree with a breakdown_by() or counts() needs the owner or
+// apparent size of every file, so its files are stat'ed whatever
+// trust_mtime.
+template <typename OldView>
+class IncrementalWalker
+{
+public:
+    IncrementalWalker(FileTree &tree, ScanBackend &backend, const OldView &old_view, bool trust_mtime)
+    : tree_(tree)
+    , backend_(backend)
+    , old_view_(old_view)
+    , trust_mtime_(trust_mtime && tree.breakdown_by() == 0 && !tree.counted())
+    , tally_(tree.breakdown_by())
+    , reused_(0)
+    , read_(0)
+    {}
+
+    void walk(int depth)
+    {
+        const FileInfo &file = tree_.root();
+        if (file.type_ != FILE_TYPE_DIRECTORY)
+            return;
+        tree_.specialize();
+        std::string path = tree_.name_str(file);
+        OldNode old_root = old_view_.root();
+        const OldNode *older = &old_root;
+        if (FileTree::compare_names(old_view_.name(old_root), old_view_.name_len(old_root),
+                    path.data(), path.size()) != 0) {
+            LOG("WARN: old snapshot is of %s, not %s", old_view_.name(old_root), path.c_str());
+            older = NULL;
+        }
+        NodeCounts below = tree_.counts(0);
+        walk_at(open_dir(AT_FDCWD, path.c_str(), backend_.stats()), path, 0, older, depth, &below);
+        tree_.set_counts(0, below);
+        tally_.flush(tree_.breakdown());
+        LOG("%zu directories reused, %zu read", reused_, read_);
+    }
+
+private:
+    typedef typename OldView::Node OldNode;
+
+    struct OldSub
+    {
+        const char *name_;
+        size_t name_len_;
+        OldNode node_;
+    };
+
+    struct OldSubLess
+    {
+        bool operator()(const OldSub &lhs, const OldSub &rhs) const
+        {
+            return FileTree::compare_names(lhs.name_, lhs.name_len_, rhs.name_, rhs.name_len_) < 0;
+        }
+    };
+
+    // Same as FileTree::walk_at(), with older the node of the directory in
+    // the old snapshot, or NULL.
+    size_t walk_at(int fd, const std::string &path, NodeId id, const OldNode *older, int depth, NodeCounts *below)
+    {
+        if (depth <= 0) {
+            return tree_.walk_at(backend_, fd, path, id, depth, below, &tally_);
+        }
+        DirListing listing;
+        DirStream *stream = NULL;
+        bool reused = older && fd >= 0 && reuse(fd, id, *older, listing);
+        if (reused) {
+            reused_++;
+        }
+        else {
+            read_++;
+            stream = tree_.lister()(backend_, fd, path, listing, &tree_.filter(), &tally_, &tree_.throttle());
+            if (!stream) {
+                tree_.set_stamp(id, DirStamp());
+                return 0;
+            }
+        }
+        int dir_fd = reused ? fd : stream->fd();
+        NodeId first = tree_.add_subs(id, listing);
+
+        std::vector<OldSub> old_subs;
+        if (older) {
+            sub_dirs(*older, old_subs);
+        }
+        size_t sub_size = 0;
+        for (size_t i = 0; i < listing.entries_.size(); i++) {
+            const DirListing::Entry &entry = listing.entries_[i];
+            size_t size = entry.size_;
+            NodeCounts sub;
+            sub.apparent_ = entry.apparent_;
+            if (entry.type_ == FILE_TYPE_DIRECTORY) {
+                OldSub key;
+                key.name_ = listing.name(entry);
+                key.name_len_ = entry.name_len_;
+                typename std::vector<OldSub>::const_iterator it =
+                    std::lower_bound(old_subs.begin(), old_subs.end(), key, OldSubLess());
+                bool found = (it != old_subs.end() && !OldSubLess()(key, *it));
+                size += walk_at(open_dir(dir_fd, key.name_, backend_.stats()), join_path(path, key.name_),
+                        first + i, found ? &it->node_ : NULL, depth - 1, &sub);
+                tree_.set_counts(first + i, sub);
+                below->dirs_++;
+            }
+            else {
+                below->files_++;
+            }
+            below->add(sub);
+            sub_size += size;
+        }
+        if (reused) {
+            close(fd);
+        }
+        else {
+            delete stream;
+        }
+        tree_.node(id).size_ += sub_size;
+        return sub_size;
+    }
+
+    // Fills listing from the sub files of older if the directory open as fd
+    // did not change since.  Returns false if it did or might have.
+    bool reuse(int fd, NodeId id, const OldNode &older, DirListing &listing)
+    {
+        const DirStamp &stamp = tree_.stamp(id);
+        if (!stamp.valid() || old_view_.type(older) != FILE_TYPE_DIRECTORY || !(old_view_.stamp(older) == stamp)) {
+            return false;
+        }
+        listing.clear();
+        // only added once the whole directory is, as list_dir() tallies it
+        // again otherwise
+        Breakdown::Tally tally(tree_.breakdown_by());
+        size_t nsubs = old_view_.nsubs(older);
+        OldNode sub = (nsubs > 0) ? old_view_.first_sub(older) : OldNode();
+        for (size_t i = 0; i < nsubs; i++) {
+            if (i > 0) {
+                sub = old_view_.next_sibling(sub);
+            }
+            const char *name = old_view_.name(sub);
+            if (trust_mtime_ && old_view_.type(sub) != FILE_TYPE_DIRECTORY) {
+                if (tree_.filter().names().admit(name, old_view_.name_len(sub), false)) {
+                    listing.add(name, old_view_.type(sub), old_view_.size(sub));
+                }
+                continue;
+            }
+            struct stat st;
+            OpTimer timer(backend_.stats(), ScanStats::OP_LSTAT);
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                return false;
+            }
+            size_t size;
+            uint64_t apparent;
+            int type = stat_to_type(st, &size);
+            if (type == FILE_TYPE_UNKNOWN) {
+                return false;
+            }
+            if (!tree_.filter().admit(name, st, &size, &apparent)) {
+                continue;
+            }
+            tally.add(name, st, size);
+            listing.add(name, type, size, (type == FILE_TYPE_DIRECTORY) ? make_stamp(st) : DirStamp(), apparent);
+        }
+        tally.flush(tree_.breakdown());
+        return true;
+    }
+
+    // The sub directories of older, still sorted by name.
+    void sub_dirs(const OldNode &older, std::vector<OldSub> &subs) const
+    {
+        size_t nsubs = old_view_.nsubs(older);
+        OldNode sub = (nsubs > 0) ? old_view_.first_sub(older) : OldNode();
+        for (size_t i = 0; i < nsubs; i++) {
+            if (i > 0) {
+                sub = old_view_.next_sibling(sub);
+            }
+            if (old_view_.type(sub) == FILE_TYPE_DIRECTORY) {
+                OldSub old_sub;
+                old_sub.name_ = old_view_.name(sub);
+                old_sub.name_len_ = old_view_.name_len(sub);
+                old_sub.node_ = sub;
+                subs.push_back(old_sub);
+            }
+        }
+    }
+
+    FileTree &tree_;
+    ScanBackend &backend_;
+    const OldView &old_view_;
+    bool trust_mtime_;
+    Breakdown::Tally tally_;
+    size_t reused_;
+    size_t read_;
+};
+
+template <typename OldView>
+void walk_since(FileTree &tree, const char *backend_name, const OldView &old_view, bool trust_mtime, int depth)
+{
+    ScanBackend *backend = ScanBackend::create(backend_name, tree.stats());
+    IncrementalWalker<OldView> walker(tree, *backend, old_view, trust_mtime);
+    walker.walk(depth);
+    delete backend;
+}
+
+// Sets up tree, which loses its nodes, for a walk of root with options.
+void prepare_scan(FileTree &tree, const std::string &root, const ScanOptions &options);
+
+// History store layout, in native byte order, with every block 8 byte
+// aligned:
+//     HistoryHeader
+//     blocks, each a HistoryBlock then length bytes of payload:
+//       HISTORY_PATHS   varint count, then the varint length and bytes of
+//                       each path first met, zero padded; a path's id is
+//                       its position among the paths of all such blocks
+//       HISTORY_COLUMN  int64 time, uint64 count, then the uint64 sizes of
+//                       the paths of ids below count in one snapshot,
+//                       HISTORY_NONE for those not in it
+// Both are only ever appended.  A block cut short by a failed append is
+// ignored, and overwritten by the next one.
+const char HISTORY_MAGIC[8] = {'D', 'M', 'O', 'N', 'H', 'I', 'S', 'T'};
+const uint32_t HISTORY_VERSION = 1;
+const uint32_t HISTORY_PATHS = 1;
+const uint32_t HISTORY_COLUMN = 2;
+const uint64_t HISTORY_NONE = ~(uint64_t)0;
+
+struct HistoryHeader
+{
+    char magic_[8];
+    uint32_t version_;
+    uint32_t reserved_;
+};
+
+struct HistoryBlock
+{
+    uint32_t type_;
+    uint32_t reserved_;
+    uint64_t length_;
+};
+
+// The sizes of the paths of many snapshots of a tree, for `dmon history`:
+// each path is interned once, and each snapshot adds a column of sizes
+// indexed by path id.  Reading a column costs no more than the pages of
+// the sizes asked for, and the paths are only read by find() and path().
+class HistoryStore
+{
+public:
+    HistoryStore();
+    ~HistoryStore() { unmap(); }
+
+    // Maps file_path; a missing file is an empty store, which append()
+    // creates.
+    bool open(const std::string &file_path);
+
+    // Adds a column of the sizes of all the nodes of view, a snapshot taken
+    // at time, and the paths not in the store yet.  Appends hold flock() on
+    // the file, so that one after another's takes its paths and its end
+    // into account.
+    template <typename View>
+    bool append(const View &view, int64_t time)
+    {
+        int fd = lock();
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = load_paths();
+        if (ok) {
+            size_t npaths = paths_.size();
+            std::vector<uint64_t> sizes(npaths, HISTORY_NONE);
+            std::string path(view.name(view.root()), view.name_len(view.root()));
+            collect(view, view.root(), path, sizes);
+            ok = write(fd, npaths, time, sizes);
+        }
+        close(fd);
+        // the new blocks are read back as any others
+        return map() && ok;
+    }
+
+    // The columns, oldest first.
+    size_t columns() const { return columns_.size(); }
+    int64_t time(size_t column) const { return columns_[column].time_; }
+
+    // Returns HISTORY_NONE if the path of id is not in the column.
+    uint64_t size(size_t column, uint32_t id) const
+    {
+        const Column &c = columns_[column];
+        return id < c.count_ ? c.sizes_[id] : HISTORY_NONE;
+    }
+
+    bool find(const std::string &path, uint32_t *id);
+    size_t paths();
+    const std::string &path(uint32_t id) const { return paths_[id]; }
+
+private:
+    struct Column
+    {
+        int64_t time_;
+        uint64_t count_;
+        const uint64_t *sizes_;
+    };
+
+    HistoryStore(const HistoryStore &);
+    HistoryStore &operator=(const HistoryStore &);
+
+    template <typename View>
+    void collect(const View &view, const typename View::Node &node, std::string &path,
+            std::vector<uint64_t> &sizes)
+    {
+        uint32_t id = intern(path);
+        if (id >= sizes.size()) {
+            sizes.resize(id + 1, HISTORY_NONE);
+        }
+        sizes[id] = view.size(node);
+        size_t nsubs = view.nsubs(node);
+        if (nsubs == 0) {
+            return;
+        }
+        typename View::Node sub = view.first_sub(node);
+        for (size_t i = 0; i < nsubs; i++) {
+            if (i > 0) {
+                sub = view.next_sibling(sub);
+            }
+            size_t len = path.size();
+            push_path(path, view.name(sub), view.name_len(sub));
+            collect(view, sub, path, sizes);
+            path.resize(len);
+        }
+    }
+
+    uint32_t intern(const std::string &path);
+    bool load_paths();
+    bool map();
+    void unmap();
+    // Opens the file for writing, creating it, takes an exclusive flock()
+    // on it and maps it again if other appends grew it meanwhile.  Returns
+    // the fd, which holds the lock until closed, or -1 on failure.
+    int lock();
+    // Writes the paths from id npaths on and a column of sizes to fd at
+    // end_, which the caller has locked.
+    bool write(int fd, size_t npaths, int64_t time, const std::vector<uint64_t> &sizes);
+
+    std::string file_path_;
+    const uint8_t *data_;
+    size_t size_;
+    size_t end_;        // of the last whole block
+    std::vector<std::pair<size_t, size_t> > path_blocks_;   // payload offsets and lengths
+    std::vector<Column> columns_;
+    bool paths_loaded_;
+    std::vector<std::string> paths_;
+    std::unordered_map<std::string, uint32_t> ids_;
+};
+
+} // namespace dmon
+
+using namespace rapidjson;
+using namespace dmon;
+
+#endif // DMON_INTERNAL_H
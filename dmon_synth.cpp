@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+#include "dmon_internal.h"
+#include "dmon_synth.h"
+
+// A small deterministic generator, so that two trees built from the same
+// shape and variant are equal.
+class Lcg
+{
+public:
+    explicit Lcg(uint64_t seed)
+    : state_(seed * 0x9e3779b97f4a7c15ULL + 1)
+    {}
+
+    uint64_t next()
+    {
+        state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state_ >> 33;
+    }
+
+private:
+    uint64_t state_;
+};
+
+std::string dir_name(unsigned i)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "d%04u", i);
+    return buf;
+}
+
+std::string file_name(unsigned i)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "f%06u", i);
+    return buf;
+}
+
+// Sizes are in whole blocks, as a walk would see them.  Variant 1 is a
+// later state of variant 0: about one file in twenty grew, and every
+// seventh directory has one more file.
+size_t file_size(const TreeShape &shape, Lcg &rng, unsigned variant)
+{
+    size_t size = (rng.next() % (shape.file_size_ + 1)) / BLOCK_SIZE * BLOCK_SIZE;
+    bool grew = (rng.next() % 20 == 0);
+    if (variant > 0 && grew) {
+        size += 8 * BLOCK_SIZE;
+    }
+    return size;
+}
+
+unsigned file_count(const TreeShape &shape, uint64_t dir_seed, unsigned variant)
+{
+    return shape.files_ + ((variant > 0 && dir_seed % 7 == 0) ? 1 : 0);
+}
+
+// Adds the synthetic sub files of node id, at level, to tree.
+void build_subs(FileTree &tree, NodeId id, const TreeShape &shape, unsigned level, uint64_t seed, unsigned variant)
+{
+    Lcg rng(seed);
+    DirListing listing;
+    unsigned ndirs = (level < shape.depth_) ? shape.fanout_ : 0;
+    for (unsigned i = 0; i < ndirs; i++) {
+        listing.add(dir_name(i).c_str(), FILE_TYPE_DIRECTORY, 4096);
+    }
+    unsigned nfiles = file_count(shape, seed, variant);
+    for (unsigned i = 0; i < nfiles; i++) {
+        listing.add(file_name(i).c_str(), FILE_TYPE_REGULAR, file_size(shape, rng, variant));
+    }
+    NodeId first = tree.add_subs(id, listing);
+    size_t size = 0;
+    for (unsigned i = 0; i < listing.entries_.size(); i++) {
+        if (i < ndirs) {
+            build_subs(tree, first + i, shape, level + 1, seed * 31 + i + 1, variant);
+        }
+        size += tree.node(first + i).size_;
+    }
+    tree.node(id).size_ += size;
+}
+
+void build_tree(FileTree &tree, const std::string &root, const TreeShape &shape, unsigned variant)
+{
+    tree.set_root(root);
+    build_subs(tree, 0, shape, 0, 1, variant);
+}
+
+bool write_file(const std::string &path, size_t size)
+{
+    static const std::vector<char> zeros(1024 * 1024);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG("cannot create %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    while (ok && size > 0) {
+        size_t n = std::min(size, zeros.size());
+        ok = (write(fd, zeros.data(), n) == ssize_t(n));
+        size -= n;
+    }
+    close(fd);
+    return ok;
+}
+
+// The directory the files of path, at level, are hard links to, or an
+// empty string if they are none.
+std::string link_dir(const std::string &path, const TreeShape &shape, unsigned level)
+{
+    if (shape.links_ == 0 || level <= shape.link_level_) {
+        return std::string();
+    }
+    size_t pos = path.size();
+    for (unsigned i = shape.link_level_; i < level; i++) {
+        pos = path.rfind(SEP, pos - 1);
+    }
+    std::string dir = path.substr(0, pos);
+    for (unsigned i = shape.link_level_; i < level; i++) {
+        dir = join_path(dir, dir_name(0));
+    }
+    return (dir == path) ? std::string() : dir;
+}
+
+bool create_subs(const std::string &path, const TreeShape &shape, unsigned level, uint64_t seed, unsigned variant)
+{
+    if (mkdir(path.c_str(), 0755) != 0) {
+        LOG("cannot create %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    Lcg rng(seed);
+    unsigned ndirs = (level < shape.depth_) ? shape.fanout_ : 0;
+    unsigned nfiles = file_count(shape, seed, variant);
+    std::string links = link_dir(path, shape, level);
+    for (unsigned i = 0; i < nfiles; i++) {
+        std::string file_path = join_path(path, file_name(i));
+        size_t size = file_size(shape, rng, variant);
+        if (!links.empty() && i % shape.links_ == 0 && i < shape.files_) {
+            // created before, as the first directories are
+            std::string target = join_path(links, file_name(i));
+            if (link(target.c_str(), file_path.c_str()) != 0) {
+                LOG("cannot link %s to %s: %s", file_path.c_str(), target.c_str(), strerror(errno));
+                return false;
+            }
+        }
+        else if (!write_file(file_path, size)) {
+            return false;
+        }
+    }
+    for (unsigned i = 0; i < ndirs; i++) {
+        if (!create_subs(join_path(path, dir_name(i)), shape, level + 1, seed * 31 + i + 1, variant)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void remove_tree(const std::string &path)
+{
+    DIR *dir = opendir(path.c_str());
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (0 == strcmp(".", ent->d_name) || 0 == strcmp("..", ent->d_name)) {
+                continue;
+            }
+            std::string sub = join_path(path, ent->d_name);
+            if (ent->d_type == DT_DIR) {
+                remove_tree(sub);
+            }
+            else {
+                unlink(sub.c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path.c_str());
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+
+// What dmon_bench and dmon_test share: synthetic trees, built both on disk
+// and in memory from the same shape.
+#ifndef DMON_SYNTH_H
+#define DMON_SYNTH_H
+
+#include "dmon.h"
+
+// The shape of a synthetic tree: every directory above depth has fanout
+// sub directories and files files, named so that they are sorted by name.
+struct TreeShape
+{
+    unsigned fanout_;
+    unsigned depth_;
+    unsigned files_;
+    size_t file_size_;  // upper bound, sizes are spread over [0, file_size_]
+    // On disk, every links_-th file below level link_level_, if links_ is
+    // not 0, is a hard link to the file of the same name in the first
+    // directory at its depth below the same directory at link_level_: at
+    // level 0, links cross the sub directories of the root, and so shards.
+    unsigned links_;
+    unsigned link_level_;
+
+    TreeShape()
+    : fanout_(4)
+    , depth_(6)
+    , files_(16)
+    , file_size_(16384)
+    , links_(0)
+    , link_level_(0)
+    {}
+};
+
+// The name of the i-th file of a directory.
+std::string file_name(unsigned i);
+
+// Builds the tree of shape in memory, rooted at the existing directory
+// root, without touching the disk below it.  Variant 1 is a later state of
+// variant 0: about one file in twenty grew, and every seventh directory has
+// one more file.
+void build_tree(dmon::FileTree &tree, const std::string &root, const TreeShape &shape, unsigned variant);
+
+// Creates the same tree as build_tree() under path, which must not exist,
+// for level 0 and seed 1, with the hard links of shape.
+bool create_subs(const std::string &path, const TreeShape &shape, unsigned level, uint64_t seed, unsigned variant);
+
+// Removes path and everything below it.
+void remove_tree(const std::string &path);
+
+// Sends stderr to /dev/null while alive, for the diff reports.
+class QuietStderr
+{
+public:
+    QuietStderr()
+    : saved_(dup(STDERR_FILENO))
+    {
+        fflush(stderr);
+        int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+    }
+
+    ~QuietStderr()
+    {
+        fflush(stderr);
+        if (saved_ >= 0) {
+            dup2(saved_, STDERR_FILENO);
+            close(saved_);
+        }
+    }
+
+private:
+    int saved_;
+};
+
+#endif // DMON_SYNTH_H
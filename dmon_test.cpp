@@ -0,0 +1,596 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+
+// Checks that the parallel paths agree with the serial ones, that filters,
+// spills, checkpoints and shards leave the walk as it should be, and that
+// snapshots survive a conversion and a history, on synthetic trees; run by
+// ctest.
+#include "dmon_internal.h"
+#include "dmon_synth.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+// Records of a diff as lines of text, to be compared as a whole.
+class DiffLines
+{
+public:
+    DiffCallback callback()
+    {
+        return [this](const DiffRecord &record) {
+            char sizes[64];
+            snprintf(sizes, sizeof(sizes), " %d %llu %llu", int(record.kind_),
+                    (unsigned long long)record.old_size_, (unsigned long long)record.new_size_);
+            lines_.push_back(std::string(record.path_, record.path_len_) + sizes);
+        };
+    }
+
+    const std::vector<std::string> &lines() const { return lines_; }
+
+private:
+    std::vector<std::string> lines_;
+};
+
+bool read_file(const std::string &file_path, std::string *content)
+{
+    FILE *fp = fopen(file_path.c_str(), "rb");
+    if (!fp) {
+        LOG("cannot open file %s", file_path.c_str());
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    content->clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        content->append(buf, n);
+    }
+    fclose(fp);
+    return true;
+}
+
+// A walk with several threads finds the same tree as one with a single
+// thread: the same nodes of the same sizes.
+bool test_walk_parallel(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 3;
+    shape.depth_ = 4;
+    shape.files_ = 8;
+    shape.file_size_ = 8192;
+    std::string root = join_path(dir, "tree");
+    if (!create_subs(root, shape, 0, 1, 0)) {
+        return false;
+    }
+    FileTree expected, serial, parallel;
+    build_tree(expected, root, shape, 0);
+    ScanOptions options;
+    bool ok = scan(root, options, serial);
+    options.jobs_ = 4;
+    ok = scan(root, options, parallel) && ok;
+    remove_tree(root);
+    if (!ok) {
+        LOG("cannot scan %s", root.c_str());
+        return false;
+    }
+    if (serial.size() != expected.size() || parallel.size() != serial.size()) {
+        LOG("walked %zu nodes with one thread and %zu with four, expect %zu",
+                serial.size(), parallel.size(), expected.size());
+        return false;
+    }
+    if (parallel.node(0).size_ != serial.node(0).size_) {
+        LOG("walked %llu bytes with four threads, %llu with one",
+                (unsigned long long)parallel.node(0).size_, (unsigned long long)serial.node(0).size_);
+        return false;
+    }
+    // both ways, as a diff reports growth but not shrinkage
+    DiffLines grew, shrank;
+    diff_trees(parallel, serial, grew.callback());
+    diff_trees(serial, parallel, shrank.callback());
+    if (!grew.lines().empty() || !shrank.lines().empty()) {
+        LOG("%zu differences between the walks, the first %s", grew.lines().size() + shrank.lines().size(),
+                (grew.lines().empty() ? shrank.lines() : grew.lines())[0].c_str());
+        return false;
+    }
+    return true;
+}
+
+// A JSON snapshot converted to binary and back is the same JSON.
+bool test_json_binary_json(const std::string &dir)
+{
+    TreeShape shape;
+    shape.depth_ = 4;
+    FileTree tree;
+    build_tree(tree, dir, shape, 1);
+    std::string json = join_path(dir, "tree.json");
+    std::string binary = join_path(dir, "tree.bin");
+    std::string again = join_path(dir, "again.json");
+    Snapshot loaded, converted;
+    bool ok = write_json_file(FileTreeView(tree), json, SNAPSHOT_VERSION)
+        && loaded.load(json)
+        && BinaryWriter(loaded.tree_).write(binary)
+        && converted.load(binary)
+        && converted.is_binary_
+        && write_json_file(converted.binary_, again, SNAPSHOT_VERSION);
+    std::string before, after;
+    ok = ok && read_file(json, &before) && read_file(again, &after);
+    unlink(json.c_str());
+    unlink(binary.c_str());
+    unlink(again.c_str());
+    if (!ok) {
+        LOG("cannot convert %s", json.c_str());
+        return false;
+    }
+    if (before != after) {
+        size_t at = std::mismatch(before.begin(), before.begin() + std::min(before.size(), after.size()),
+                after.begin()).first - before.begin();
+        LOG("%zu bytes of JSON became %zu through binary, first differing at %zu",
+                before.size(), after.size(), at);
+        return false;
+    }
+    return true;
+}
+
+bool write_whole_file(const std::string &file_path, const std::string &content)
+{
+    FILE *fp = fopen(file_path.c_str(), "wb");
+    if (!fp) {
+        LOG("cannot open file %s", file_path.c_str());
+        return false;
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), fp) == content.size();
+    return fclose(fp) == 0 && ok;
+}
+
+// Visits the nodes below node, up to limit of them.
+void count_nodes(const BinarySnapshot &view, const BinarySnapshot::Node &node, size_t limit, size_t *count)
+{
+    if (++*count > limit) {
+        return;
+    }
+    size_t nsubs = view.nsubs(node);
+    BinarySnapshot::Node sub = (nsubs > 0) ? view.first_sub(node) : node;
+    for (size_t i = 0; i < nsubs && *count <= limit; i++) {
+        if (i > 0) {
+            sub = view.next_sibling(sub);
+        }
+        count_nodes(view, sub, limit, count);
+    }
+}
+
+// A binary snapshot with any byte of its nodes changed either fails to
+// open, or has as many nodes as it claims, all of which can be visited.
+bool test_corrupt_binary(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 2;
+    shape.depth_ = 2;
+    shape.files_ = 3;
+    FileTree tree;
+    build_tree(tree, dir, shape, 0);
+    std::string binary = join_path(dir, "tree.bin");
+    std::string corrupt = join_path(dir, "corrupt.bin");
+    std::string content;
+    if (!BinaryWriter(tree).write(binary) || !read_file(binary, &content)) {
+        return false;
+    }
+    unlink(binary.c_str());
+    BinaryHeader header;
+    memcpy(&header, content.data(), sizeof(header));
+    const unsigned char flips[] = {0x01, 0x7f, 0x80, 0xff};
+    size_t rejected = 0, visited = 0, bad = 0;
+    bool ok = true;
+    {
+        QuietStderr quiet;
+        for (size_t pos = header.nodes_; ok && pos < content.size(); pos++) {
+            for (size_t i = 0; ok && i < sizeof(flips); i++) {
+                std::string changed = content;
+                changed[pos] ^= flips[i];
+                if (!write_whole_file(corrupt, changed)) {
+                    return false;
+                }
+                BinarySnapshot snapshot;
+                if (!snapshot.open(corrupt)) {
+                    rejected++;
+                    continue;
+                }
+                count_nodes(snapshot, snapshot.root(), snapshot.node_count(), &visited);
+                if (visited != snapshot.node_count()) {
+                    bad = pos;
+                    ok = false;
+                }
+                visited = 0;
+            }
+        }
+    }
+    unlink(corrupt.c_str());
+    if (!ok) {
+        LOG("with byte %zu changed, the nodes visited are not those counted", bad);
+    }
+    if (ok && rejected == 0) {
+        LOG("%s", "no corruption of the nodes was rejected");
+        ok = false;
+    }
+    return ok;
+}
+
+// The size of node id of the walk of a whole tree, and its number of nodes,
+// as a walk leaving out the directories named dir and the files named file
+// below it would find them.
+uint64_t filtered_size(const FileTree &tree, NodeId id, const char *dir, const char *file, size_t *nodes)
+{
+    const FileInfo &info = tree.node(id);
+    uint64_t size = info.size_;
+    ++*nodes;
+    for (uint32_t i = 0; i < info.nsubs_; i++) {
+        NodeId sub_id = info.first_sub_ + i;
+        const FileInfo &sub = tree.node(sub_id);
+        size -= sub.size_;
+        const char *excluded = (sub.type_ == FILE_TYPE_DIRECTORY) ? dir : file;
+        if (tree.name_str(sub) != excluded) {
+            size += filtered_size(tree, sub_id, dir, file, nodes);
+        }
+    }
+    return size;
+}
+
+// A walk with exclude and include patterns leaves out the names excluded
+// and not included, with all that is below them, wherever they are.
+bool test_filtered_scan(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 3;
+    shape.depth_ = 3;
+    shape.files_ = 6;
+    std::string root = join_path(dir, "tree");
+    if (!create_subs(root, shape, 0, 1, 0)) {
+        return false;
+    }
+    FileTree whole, filtered;
+    ScanOptions options;
+    bool ok = scan(root, options, whole);
+    // only directories for the first, and an include taking back f000000
+    options.excludes_.push_back("d0001/");
+    options.excludes_.push_back("f00000[0-2]");
+    options.includes_.push_back("f00000[!2]");
+    ok = scan(root, options, filtered) && ok;
+    remove_tree(root);
+    if (!ok) {
+        LOG("cannot scan %s", root.c_str());
+        return false;
+    }
+    size_t nodes = 0;
+    uint64_t size = filtered_size(whole, 0, "d0001", "f000002", &nodes);
+    if (filtered.size() != nodes || filtered.node(0).size_ != size) {
+        LOG("walked %zu nodes of %llu bytes with the filter, expect %zu of %llu", filtered.size(),
+                (unsigned long long)filtered.node(0).size_, nodes, (unsigned long long)size);
+        return false;
+    }
+    return true;
+}
+
+// Writes the snapshot of root walked with options into file_path.
+bool scan_to_json(const std::string &root, const ScanOptions &options, const std::string &file_path)
+{
+    FileTree tree;
+    if (!scan(root, options, tree)) {
+        LOG("cannot scan %s", root.c_str());
+        return false;
+    }
+    return write_json_file(FileTreeView(tree), file_path, SNAPSHOT_VERSION);
+}
+
+// A walk spilling the files of its directories to disk writes the same
+// JSON snapshot as one holding them all, with one thread or several.
+bool test_spill(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 3;
+    shape.depth_ = 3;
+    shape.files_ = 40;
+    std::string root = join_path(dir, "tree");
+    if (!create_subs(root, shape, 0, 1, 0)) {
+        return false;
+    }
+    std::string held = join_path(dir, "held.json");
+    std::string spilled = join_path(dir, "spilled.json");
+    bool ok = true, same = true;
+    for (size_t jobs = 1; ok && same && jobs <= 4; jobs += 3) {
+        ScanOptions options;
+        options.jobs_ = jobs;
+        ok = scan_to_json(root, options, held);
+        options.spill_.after_ = 8;
+        options.spill_.dir_ = dir;
+        FileTree tree;
+        ok = ok && scan(root, options, tree) && write_json_file(FileTreeView(tree), spilled, SNAPSHOT_VERSION);
+        std::string expected, actual;
+        ok = ok && read_file(held, &expected) && read_file(spilled, &actual);
+        if (ok && !tree.spilled(0)) {
+            LOG("the %u files of %s were not spilled", shape.files_, root.c_str());
+            same = false;
+        }
+        else if (ok && actual != expected) {
+            LOG("%zu bytes of JSON with %zu jobs spilling, %zu holding all the files",
+                    actual.size(), jobs, expected.size());
+            same = false;
+        }
+    }
+    remove_tree(root);
+    unlink(held.c_str());
+    unlink(spilled.c_str());
+    if (!ok) {
+        LOG("cannot scan %s", root.c_str());
+    }
+    return ok && same;
+}
+
+// A walk killed once it has saved a checkpoint, and resumed from it, makes
+// the same JSON snapshot as a walk from start to end.  The walk is held
+// back by a throttle, so that it is killed with much of it pending.
+bool test_checkpoint_resume(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 3;
+    shape.depth_ = 3;
+    shape.files_ = 6;
+    std::string root = join_path(dir, "tree");
+    if (!create_subs(root, shape, 0, 1, 0)) {
+        return false;
+    }
+    std::string checkpoint = join_path(dir, "tree.ckpt");
+    std::string whole = join_path(dir, "whole.json");
+    std::string resumed = join_path(dir, "resumed.json");
+    ScanOptions options;
+    bool ok = scan_to_json(root, options, whole);
+    options.checkpoint_ = checkpoint;
+    options.checkpoint_every_ = 0;
+    options.max_ops_ = 500;
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        QuietStderr quiet;
+        FileTree tree;
+        scan(root, options, tree);
+        _exit(0);
+    }
+    // waits for the first checkpoint, a second at most
+    for (int i = 0; pid > 0 && i < 1000 && access(checkpoint.c_str(), F_OK) != 0; i++) {
+        usleep(1000);
+    }
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (pid < 0 || access(checkpoint.c_str(), F_OK) != 0) {
+        LOG("no checkpoint of %s was saved", root.c_str());
+        ok = false;
+    }
+    options.checkpoint_every_ = 300;
+    options.max_ops_ = 0;
+    options.resume_ = true;
+    {
+        QuietStderr quiet;
+        ok = ok && scan_to_json(root, options, resumed);
+    }
+    std::string expected, actual;
+    ok = ok && read_file(whole, &expected) && read_file(resumed, &actual);
+    remove_tree(root);
+    unlink(checkpoint.c_str());
+    unlink((checkpoint + ".tmp").c_str());
+    unlink(whole.c_str());
+    unlink(resumed.c_str());
+    if (!ok) {
+        LOG("cannot resume the walk of %s", root.c_str());
+        return false;
+    }
+    if (actual != expected) {
+        size_t at = std::mismatch(expected.begin(), expected.begin() + std::min(expected.size(), actual.size()),
+                actual.begin()).first - expected.begin();
+        LOG("%zu bytes of JSON resumed from a checkpoint, %zu from one walk, first differing at %zu",
+                actual.size(), expected.size(), at);
+        return false;
+    }
+    return true;
+}
+
+// Checks that the size of the path of node id and those below it are in
+// column of store, and counts those not in the column before, if any.
+bool check_history(HistoryStore &store, size_t column, const FileTree &tree, NodeId id, std::string &path,
+        size_t *fresh)
+{
+    const FileInfo &info = tree.node(id);
+    uint32_t path_id;
+    if (!store.find(path, &path_id) || store.size(column, path_id) != info.size_) {
+        LOG("%s is not in column %zu of the history with its %llu bytes", path.c_str(), column,
+                (unsigned long long)info.size_);
+        return false;
+    }
+    if (column > 0 && store.size(column - 1, path_id) == HISTORY_NONE) {
+        ++*fresh;
+    }
+    for (uint32_t i = 0; i < info.nsubs_; i++) {
+        const FileInfo &sub = tree.node(info.first_sub_ + i);
+        size_t len = push_path(path, tree.name(sub), sub.name_len_);
+        bool ok = check_history(store, column, tree, info.first_sub_ + i, path, fresh);
+        path.resize(len);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The snapshots appended to a history are read back from its file, each
+// size by the path it was of as `dmon history trend` reads them, with one
+// path per node and a path new in a snapshot in none of those before.
+bool test_history(const std::string &dir)
+{
+    TreeShape shape;
+    shape.depth_ = 3;
+    shape.fanout_ = 2;
+    FileTree old_tree, new_tree;
+    build_tree(old_tree, dir, shape, 0);
+    shape.fanout_ = 3;
+    build_tree(new_tree, dir, shape, 1);
+    std::string file_path = join_path(dir, "history");
+    const int64_t times[] = {1000, 1000 + 86400};
+    bool ok;
+    {
+        HistoryStore store;
+        ok = store.open(file_path)
+            && store.append(FileTreeView(old_tree), times[0])
+            && store.append(FileTreeView(new_tree), times[1]);
+    }
+    HistoryStore store;
+    ok = ok && store.open(file_path);
+    if (!ok) {
+        unlink(file_path.c_str());
+        LOG("cannot append to the history %s", file_path.c_str());
+        return false;
+    }
+    if (store.columns() != 2 || store.time(0) != times[0] || store.time(1) != times[1]
+            || store.paths() != new_tree.size()) {
+        LOG("%zu snapshots of %zu paths in the history, expect 2 of %zu", store.columns(), store.paths(),
+                new_tree.size());
+        ok = false;
+    }
+    std::string path = dir;
+    size_t fresh = 0;
+    ok = ok && check_history(store, 0, old_tree, 0, path, &fresh)
+        && check_history(store, 1, new_tree, 0, path, &fresh);
+    unlink(file_path.c_str());
+    if (ok && fresh != new_tree.size() - old_tree.size()) {
+        LOG("%zu paths new in the second snapshot of the history, expect %zu", fresh,
+                new_tree.size() - old_tree.size());
+        ok = false;
+    }
+    return ok;
+}
+
+// The merge of the shards of a walk is the JSON snapshot of a walk of the
+// whole tree, with hard links within each of the sub directories of the
+// root, and even across them if every link is counted.
+bool test_shard_merge(const std::string &dir)
+{
+    TreeShape shape;
+    shape.fanout_ = 4;
+    shape.depth_ = 3;
+    shape.files_ = 6;
+    shape.links_ = 3;
+    const unsigned nshards = 3;
+    for (unsigned link_level = 0; link_level < 2; link_level++) {
+        shape.link_level_ = link_level;
+        std::string root = join_path(dir, "tree");
+        if (!create_subs(root, shape, 0, 1, 0)) {
+            return false;
+        }
+        ScanOptions options;
+        options.count_links_ = (link_level == 0);
+        std::string single = join_path(dir, "single.json");
+        std::string merged = join_path(dir, "merged.json");
+        std::vector<std::string> shards;
+        bool ok = scan_to_json(root, options, single);
+        options.nshards_ = nshards;
+        for (unsigned i = 0; ok && i < nshards; i++) {
+            options.shard_ = i;
+            shards.push_back(join_path(dir, "shard" + std::to_string(i) + ".json"));
+            QuietStderr quiet; // of the warning about hard links
+            ok = scan_to_json(root, options, shards.back());
+        }
+        ok = ok && merge_shards(shards, merged);
+        std::string expected, actual;
+        ok = ok && read_file(single, &expected) && read_file(merged, &actual);
+        remove_tree(root);
+        unlink(single.c_str());
+        unlink(merged.c_str());
+        for (size_t i = 0; i < shards.size(); i++) {
+            unlink(shards[i].c_str());
+        }
+        if (!ok) {
+            LOG("cannot merge the shards of %s", root.c_str());
+            return false;
+        }
+        if (actual != expected) {
+            size_t at = std::mismatch(expected.begin(), expected.begin() + std::min(expected.size(), actual.size()),
+                    actual.begin()).first - expected.begin();
+            LOG("with links below level %u, %zu bytes of JSON merged from shards, %zu from one walk, "
+                    "first differing at %zu", link_level, actual.size(), expected.size(), at);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A ParallelDiff reports the records of diff_cursors(), in the same order.
+bool test_parallel_diff(const std::string &dir)
+{
+    TreeShape shape;
+    FileTree old_tree, new_tree;
+    build_tree(old_tree, dir, shape, 0);
+    build_tree(new_tree, dir, shape, 1);
+    FileTreeView old_view(old_tree), new_view(new_tree);
+    DiffLines serial, parallel;
+    ViewCursor<FileTreeView> new_cursor(new_view), old_cursor(old_view);
+    if (!diff_cursors(new_cursor, old_cursor, serial.callback())) {
+        LOG("%s", "diff_cursors() failed");
+        return false;
+    }
+    ParallelDiff<FileTreeView, FileTreeView> diff(new_view, old_view, 4);
+    diff.diff(parallel.callback());
+    // more than the root, or nothing was left to the other threads
+    if (serial.lines().size() < 2) {
+        LOG("%s", "no records below the root between the variants");
+        return false;
+    }
+    if (parallel.lines() != serial.lines()) {
+        size_t n = std::min(parallel.lines().size(), serial.lines().size());
+        size_t at = std::mismatch(serial.lines().begin(), serial.lines().begin() + n,
+                parallel.lines().begin()).first - serial.lines().begin();
+        LOG("%zu records with four threads, %zu with one, first differing at %zu",
+                parallel.lines().size(), serial.lines().size(), at);
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    const char *tmp = getenv("TMPDIR");
+    std::string dir = join_path((tmp && *tmp) ? tmp : "/tmp", "dmon_test.XXXXXX");
+    std::vector<char> name(dir.begin(), dir.end());
+    name.push_back('\0');
+    if (!mkdtemp(name.data())) {
+        LOG("cannot create %s: %s", dir.c_str(), strerror(errno));
+        return 1;
+    }
+    dir = name.data();
+
+    int failed = 0;
+    struct {
+        const char *name_;
+        std::function<bool ()> run_;
+    } tests[] = {
+        {"walk_parallel", [&dir]() { return test_walk_parallel(dir); }},
+        {"json_binary_json", [&dir]() { return test_json_binary_json(dir); }},
+        {"parallel_diff", [&dir]() { return test_parallel_diff(dir); }},
+        {"corrupt_binary", [&dir]() { return test_corrupt_binary(dir); }},
+        {"filtered_scan", [&dir]() { return test_filtered_scan(dir); }},
+        {"spill", [&dir]() { return test_spill(dir); }},
+        {"checkpoint_resume", [&dir]() { return test_checkpoint_resume(dir); }},
+        {"history", [&dir]() { return test_history(dir); }},
+        {"shard_merge", [&dir]() { return test_shard_merge(dir); }},
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool ok = tests[i].run_();
+        printf("%-24s %s\n", tests[i].name_, ok ? "ok" : "FAILED");
+        failed += ok ? 0 : 1;
+    }
+    remove_tree(dir);
+    return failed ? 1 : 0;
+}
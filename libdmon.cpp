@@ -0,0 +1,3941 @@
+/*
+ * Copyright (C) 2019 Yang Yi <yyrust@gmail.com>
+ * All rights reserved.
+ *
+ * This software is licensed as described in the file LICENSE, which
+ * you should have received as part of this distribution.
+ *
+ * Author: Yang Yi <yyrust@gmail.com>
+ */
+#include "dmon_internal.h"
+#include <cstdarg>
+#include <sys/file.h>
+#ifdef DMON_HAVE_IO_URING
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // from linux/fs.h, not the st_blocks unit
+#endif
+#ifdef DMON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DMON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace dmon {
+
+static LogCallback &log_callback()
+{
+    static LogCallback callback = [](const char *line) { fprintf(stderr, "%s\n", line); };
+    return callback;
+}
+
+void set_log_callback(const LogCallback &callback)
+{
+    log_callback() = callback;
+}
+
+void log_message(const char *file, int line, const char *format, ...)
+{
+    const LogCallback &callback = log_callback();
+    if (!callback) {
+        return;
+    }
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "%s:%d: ", file, line);
+    if (len < 0 || len >= (int)sizeof(buf)) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + len, sizeof(buf) - len, format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if (len + n < (int)sizeof(buf)) {
+        callback(buf);
+        return;
+    }
+    std::vector<char> longer(len + n + 1); // too long for buf: format again
+    memcpy(longer.data(), buf, len);
+    va_start(args, format);
+    vsnprintf(longer.data() + len, n + 1, format, args);
+    va_end(args);
+    callback(longer.data());
+}
+
+std::string join_path(const std::string &prefix, const std::string &postfix)
+{
+    bool hasSep = (!prefix.empty() && prefix[prefix.size() - 1] == SEP);
+    if (hasSep)
+        return prefix + postfix;
+    else
+        return prefix + SEP + postfix;
+}
+
+std::string flatten_path(const std::string &path)
+{
+    std::vector<char> buf;
+    buf.resize(path.size());
+    for (size_t i = 0; i < path.size(); i++) {
+        int c = path[i];
+        buf[i] = (c == SEP) ? '_' : c;
+    }
+    return std::string(buf.data(), buf.size());
+}
+
+std::string time_to_str()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    char buf[128];
+    struct tm &tm = *localtime(&tv.tv_sec);
+    snprintf(buf, 128, "%04d.%02d.%02d-%02d.%02d.%02d.%06zu",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (size_t)tv.tv_usec);
+    return buf;
+}
+
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t max_rss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return size_t(usage.ru_maxrss) * 1024;
+}
+
+std::string make_snapshot_file_name(const std::string &path, const char *ext)
+{
+    return "dirs_" + flatten_path(path) + time_to_str() + ext;
+}
+
+std::string readable_size(size_t nbytes)
+{
+    const size_t nlevels = 4;
+
+    struct LevelInfo {
+        size_t size;
+        char unit;
+    } levels[nlevels] = {
+        {size_t(1024) * 1024 * 1024 * 1024, 'T'},
+        {1024 * 1024 * 1024, 'G'},
+        {1024 * 1024, 'M'},
+        {1024, 'K'},
+    };
+
+    for (size_t i = 0; i < nlevels; i++) {
+        size_t size = levels[i].size;
+        char unit = levels[i].unit;
+        if (nbytes >= size) {
+            size_t low_size = size / 1024;
+            size_t quot = nbytes / size;
+            size_t remainder = (nbytes - quot * size) / low_size;
+            char buf[64];
+            if (remainder == 0) {
+                snprintf(buf, 64, "%zu%c", quot, unit);
+            }
+            else {
+                double fquot = quot + remainder / 1024.0;
+                snprintf(buf, 64, "%.03lf%c", fquot, unit);
+            }
+            return buf;
+        }
+    }
+    char buf[64];
+    snprintf(buf, 64, "%zu", nbytes);
+    return buf;
+}
+
+const char *r_sz(size_t nbytes)
+{
+    static std::string s;
+    s = readable_size(nbytes);
+    return s.c_str();
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool parse_compression(const char *name, Compression *compression)
+{
+    if (0 == strcmp(name, "none")) {
+        *compression = COMPRESSION_NONE;
+        return true;
+    }
+#ifdef DMON_HAVE_ZLIB
+    if (0 == strcmp(name, "gzip")) {
+        *compression = COMPRESSION_GZIP;
+        return true;
+    }
+#endif
+#ifdef DMON_HAVE_ZSTD
+    if (0 == strcmp(name, "zstd")) {
+        *compression = COMPRESSION_ZSTD;
+        return true;
+    }
+#endif
+    return false;
+}
+
+const char *json_extension(Compression compression)
+{
+    switch (compression) {
+    case COMPRESSION_GZIP:
+        return ".json.gz";
+    case COMPRESSION_ZSTD:
+        return ".json.zst";
+    default:
+        return ".json";
+    }
+}
+
+bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool writev_all(int fd, std::vector<struct iovec> &iov)
+{
+    size_t i = 0;
+    while (i < iov.size()) {
+        int n = std::min(iov.size() - i, size_t(IOV_MAX));
+        ssize_t written = writev(fd, &iov[i], n);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return false;
+        }
+        // skips what was written, which may end inside a buffer
+        size_t left = written;
+        while (i < iov.size() && left >= iov[i].iov_len) {
+            left -= iov[i].iov_len;
+            i++;
+        }
+        if (left > 0) {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + left;
+            iov[i].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+#ifdef DMON_HAVE_ZLIB
+// fopencookie() functions over a gzFile
+ssize_t gzip_read(void *cookie, char *buf, size_t size)
+{
+    return gzread(static_cast<gzFile>(cookie), buf, std::min(size, size_t(INT_MAX)));
+}
+
+ssize_t gzip_write(void *cookie, const char *buf, size_t size)
+{
+    // 0 is an error
+    return size == 0 ? 0 : gzwrite(static_cast<gzFile>(cookie), buf, std::min(size, size_t(INT_MAX)));
+}
+
+int gzip_close(void *cookie)
+{
+    return gzclose(static_cast<gzFile>(cookie)) == Z_OK ? 0 : EOF;
+}
+#endif // DMON_HAVE_ZLIB
+
+#ifdef DMON_HAVE_ZSTD
+// A file compressed or decompressed with zstd, for fopencookie().
+struct ZstdFile
+{
+    int fd_;
+    ZSTD_CCtx *cctx_;
+    ZSTD_DCtx *dctx_;
+    std::vector<char> buf_;     // compressed
+    ZSTD_inBuffer in_;          // over buf_, when reading
+    bool eof_;
+
+    explicit ZstdFile(int fd)
+    : fd_(fd)
+    , cctx_(NULL)
+    , dctx_(NULL)
+    , buf_(ZSTD_CStreamOutSize())
+    , eof_(false)
+    {
+        in_.src = buf_.data();
+        in_.size = 0;
+        in_.pos = 0;
+    }
+};
+
+ssize_t zstd_read(void *cookie, char *buf, size_t size)
+{
+    ZstdFile *file = static_cast<ZstdFile *>(cookie);
+    ZSTD_outBuffer out = {buf, size, 0};
+    while (out.pos == 0 && size > 0) {
+        if (file->in_.pos == file->in_.size) {
+            if (file->eof_) {
+                break;
+            }
+            ssize_t n = read(file->fd_, file->buf_.data(), file->buf_.size());
+            if (n < 0) {
+                return -1;
+            }
+            file->eof_ = (n == 0);
+            file->in_.size = n;
+            file->in_.pos = 0;
+        }
+        // concatenated frames are decompressed one after another
+        size_t ret = ZSTD_decompressStream(file->dctx_, &out, &file->in_);
+        if (ZSTD_isError(ret)) {
+            LOG("zstd: %s", ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+    return out.pos;
+}
+
+// Compresses size bytes of buf, or with end, ends the frame.
+bool zstd_compress(ZstdFile *file, const char *buf, size_t size, bool end)
+{
+    ZSTD_inBuffer in = {buf, size, 0};
+    size_t left;
+    do {
+        ZSTD_outBuffer out = {file->buf_.data(), file->buf_.size(), 0};
+        left = ZSTD_compressStream2(file->cctx_, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left)) {
+            LOG("zstd: %s", ZSTD_getErrorName(left));
+            return false;
+        }
+        if (!write_all(file->fd_, file->buf_.data(), out.pos)) {
+            return false;
+        }
+    } while (end ? left > 0 : in.pos < in.size);
+    return true;
+}
+
+ssize_t zstd_write(void *cookie, const char *buf, size_t size)
+{
+    return zstd_compress(static_cast<ZstdFile *>(cookie), buf, size, false) ? size : 0;
+}
+
+int zstd_close(void *cookie)
+{
+    ZstdFile *file = static_cast<ZstdFile *>(cookie);
+    bool ok = !file->cctx_ || zstd_compress(file, NULL, 0, true);
+    ok = (close(file->fd_) == 0) && ok;
+    ZSTD_freeCCtx(file->cctx_);
+    ZSTD_freeDCtx(file->dctx_);
+    delete file;
+    return ok ? 0 : EOF;
+}
+#endif // DMON_HAVE_ZSTD
+
+FILE *open_compressed(const std::string &file_path, Compression compression)
+{
+    if (compression == COMPRESSION_NONE) {
+        return fopen(file_path.c_str(), "wb");
+    }
+    int fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+#ifdef DMON_HAVE_ZLIB
+    if (compression == COMPRESSION_GZIP) {
+        gzFile gz = gzdopen(fd, "wb");
+        if (!gz) {
+            close(fd);
+            return NULL;
+        }
+        cookie_io_functions_t io = {NULL, gzip_write, NULL, gzip_close};
+        return fopencookie(gz, "w", io);
+    }
+#endif
+#ifdef DMON_HAVE_ZSTD
+    if (compression == COMPRESSION_ZSTD) {
+        ZstdFile *file = new ZstdFile(fd);
+        file->cctx_ = ZSTD_createCCtx();
+        cookie_io_functions_t io = {NULL, zstd_write, NULL, zstd_close};
+        return fopencookie(file, "w", io);
+    }
+#endif
+    close(fd);
+    return NULL;
+}
+
+FILE *open_json(const std::string &file_path)
+{
+    int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    unsigned char magic[4] = {0, 0, 0, 0};
+    bool has_magic = pread(fd, magic, sizeof(magic), 0) == sizeof(magic);
+#ifdef DMON_HAVE_ZLIB
+    if (has_magic && magic[0] == 0x1f && magic[1] == 0x8b) {
+        gzFile gz = gzdopen(fd, "rb");
+        if (!gz) {
+            close(fd);
+            return NULL;
+        }
+        cookie_io_functions_t io = {gzip_read, NULL, NULL, gzip_close};
+        return fopencookie(gz, "r", io);
+    }
+#endif
+#ifdef DMON_HAVE_ZSTD
+    if (has_magic && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        ZstdFile *file = new ZstdFile(fd);
+        file->dctx_ = ZSTD_createDCtx();
+        cookie_io_functions_t io = {zstd_read, NULL, NULL, zstd_close};
+        return fopencookie(file, "r", io);
+    }
+#endif
+    (void)has_magic;
+    return fdopen(fd, "r");
+}
+
+bool compress_piece(Compression compression, const char *data, size_t len, std::string &out)
+{
+#ifdef DMON_HAVE_ZLIB
+    if (compression == COMPRESSION_GZIP) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 16 more window bits for a gzip header and trailer
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        // fed in chunks, as avail_in is 32 bits
+        const size_t CHUNK = 1 << 30;
+        const size_t OUT_CHUNK = 1 << 18;
+        size_t used = out.size();
+        int ret;
+        do {
+            if (z.avail_in == 0 && len > 0) {
+                size_t n = std::min(len, CHUNK);
+                z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+                z.avail_in = n;
+                data += n;
+                len -= n;
+            }
+            out.resize(used + OUT_CHUNK);
+            z.next_out = reinterpret_cast<Bytef *>(&out[used]);
+            z.avail_out = OUT_CHUNK;
+            ret = deflate(&z, len == 0 ? Z_FINISH : Z_NO_FLUSH);
+            used += OUT_CHUNK - z.avail_out;
+        } while (ret == Z_OK || ret == Z_BUF_ERROR);
+        out.resize(used);
+        deflateEnd(&z);
+        return ret == Z_STREAM_END;
+    }
+#endif
+#ifdef DMON_HAVE_ZSTD
+    if (compression == COMPRESSION_ZSTD) {
+        size_t used = out.size();
+        out.resize(used + ZSTD_compressBound(len));
+        size_t n = ZSTD_compress(&out[used], out.size() - used, data, len, 3);
+        if (ZSTD_isError(n)) {
+            LOG("zstd: %s", ZSTD_getErrorName(n));
+            return false;
+        }
+        out.resize(used + n);
+        return true;
+    }
+#endif
+    out.append(data, len);
+    return compression == COMPRESSION_NONE;
+}
+
+void ScanStats::report(bool json) const
+{
+    static const char *const OP_NAMES[NOPS] = {"opendir", "readdir", "lstat", "alloc"};
+    double walk_sec = 0;
+    for (size_t i = 0; i < phases_.size(); i++) {
+        if (0 == strcmp("walk", phases_[i].first)) {
+            walk_sec = phases_[i].second;
+        }
+    }
+    double entries_per_sec = (walk_sec > 0) ? entries_ / walk_sec : 0;
+    if (!json) {
+        LOG("stats: %llu entries in %llu directories, %.0f entries/s, max rss %s",
+                (unsigned long long)entries_, (unsigned long long)dirs_, entries_per_sec, r_sz(max_rss()));
+        for (size_t i = 0; i < phases_.size(); i++) {
+            LOG("stats: phase %s %.3f s", phases_[i].first, phases_[i].second);
+        }
+        for (size_t i = 0; i < NOPS; i++) {
+            uint64_t calls = calls_[i];
+            double sec = nsecs_[i] / 1e9;
+            LOG("stats: %s %llu calls, %.3f s, %.2f us/call", OP_NAMES[i], (unsigned long long)calls, sec,
+                    calls ? sec * 1e6 / calls : 0.0);
+        }
+        for (size_t i = 0; i < slowest_.size(); i++) {
+            LOG("stats: slow dir %.3f ms %s", slowest_[i].first / 1e6, slowest_[i].second.c_str());
+        }
+        return;
+    }
+    char buf[4096];
+    FileWriteStream fs(stdout, buf, sizeof(buf));
+    PrettyWriter<FileWriteStream> writer(fs);
+    writer.SetIndent(' ', 1);
+    writer.StartObject();
+    writer.Key("entries");
+    writer.Uint64(entries_);
+    writer.Key("dirs");
+    writer.Uint64(dirs_);
+    writer.Key("entries_per_sec");
+    writer.Double(entries_per_sec);
+    writer.Key("max_rss");
+    writer.Uint64(max_rss());
+    writer.Key("phases");
+    writer.StartObject();
+    for (size_t i = 0; i < phases_.size(); i++) {
+        writer.Key(phases_[i].first);
+        writer.Double(phases_[i].second);
+    }
+    writer.EndObject();
+    writer.Key("ops");
+    writer.StartObject();
+    for (size_t i = 0; i < NOPS; i++) {
+        writer.Key(OP_NAMES[i]);
+        writer.StartObject();
+        writer.Key("calls");
+        writer.Uint64(calls_[i]);
+        writer.Key("seconds");
+        writer.Double(nsecs_[i] / 1e9);
+        writer.EndObject();
+    }
+    writer.EndObject();
+    writer.Key("slowest_dirs");
+    writer.StartArray();
+    for (size_t i = 0; i < slowest_.size(); i++) {
+        writer.StartObject();
+        writer.Key("path");
+        writer.String(slowest_[i].second.data(), slowest_[i].second.size());
+        writer.Key("seconds");
+        writer.Double(slowest_[i].first / 1e9);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    fs.Flush();
+    putchar('\n');
+}
+
+ScanThrottle::ScanThrottle()
+: rate_(0)
+, target_ns_(0)
+, njobs_(1)
+, active_(SIZE_MAX)
+, tokens_(0)
+, refilled_ns_(0)
+, samples_(0)
+, window_start_(0)
+, slow_start_(true)
+, latency_ns_(0)
+{
+    for (size_t i = 0; i < NBUCKETS; i++) {
+        histogram_[i] = 0;
+    }
+}
+
+void ScanThrottle::configure(double ops_per_sec, uint64_t target_ns)
+{
+    rate_ = ops_per_sec;
+    target_ns_ = target_ns;
+    tokens_ = std::max(1.0, rate_ / 10);
+    refilled_ns_ = now_ns();
+}
+
+void ScanThrottle::start(size_t njobs)
+{
+    njobs_ = njobs;
+    active_ = target_ns_ > 0 ? 1 : SIZE_MAX;
+    slow_start_ = true;
+    latency_ns_ = 0;
+    for (size_t i = 0; i < NBUCKETS; i++) {
+        histogram_[i] = 0;
+    }
+    samples_ = 0;
+    window_start_ = now_ns();
+}
+
+size_t ScanThrottle::bucket(uint64_t nsecs)
+{
+    if (nsecs < 8) {
+        return nsecs;
+    }
+    int log2 = 63 - __builtin_clzll(nsecs);
+    return (log2 - 2) * 8 + ((nsecs >> (log2 - 3)) & 7);
+}
+
+uint64_t ScanThrottle::bucket_ceiling(size_t i)
+{
+    if (i < 8) {
+        return i;
+    }
+    int log2 = i / 8 + 2;
+    return ((8 + i % 8) << (log2 - 3)) + ((uint64_t(1) << (log2 - 3)) - 1);
+}
+
+void ScanThrottle::take(uint64_t ops)
+{
+    double wait;
+    {
+        std::lock_guard<std::mutex> lock(bucket_mutex_);
+        uint64_t now = now_ns();
+        // a burst of up to a tenth of a second once idle
+        tokens_ = std::min(std::max(1.0, rate_ / 10), tokens_ + (now - refilled_ns_) / 1e9 * rate_);
+        refilled_ns_ = now;
+        tokens_ -= ops;
+        wait = (tokens_ < 0) ? -tokens_ / rate_ : 0;
+    }
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+void ScanThrottle::adjust(uint64_t now)
+{
+    std::unique_lock<std::mutex> lock(adjust_mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || now - window_start_ < ADJUST_NS || samples_ < MIN_SAMPLES) {
+        return;
+    }
+    uint64_t counts[NBUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < NBUCKETS; i++) {
+        counts[i] = histogram_[i].exchange(0, std::memory_order_relaxed);
+        total += counts[i];
+    }
+    samples_ = 0;
+    window_start_ = now;
+    uint64_t rank = total - total / 100;
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (; i + 1 < NBUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    latency_ns_ = bucket_ceiling(i);
+    size_t active = active_;
+    if (latency_ns_ > target_ns_) {
+        active = std::max<size_t>(1, active / 2);
+        slow_start_ = false;
+    }
+    else if (active < njobs_) {
+        active = slow_start_ ? std::min(njobs_, active * 2) : active + 1;
+    }
+    active_ = active;
+}
+
+bool want_dirent(const char *name, unsigned char d_type)
+{
+    if (0 == strcmp(".", name) || 0 == strcmp("..", name)) {
+        return false;
+    }
+    switch (d_type) {
+    case DT_DIR:
+    case DT_REG:
+    case DT_LNK:
+    case DT_UNKNOWN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// readdir() + fstatat(), one entry at a time.
+class PosixScanBackend : public ScanBackend
+{
+public:
+    virtual const char *name() const { return "posix"; }
+
+    virtual DirStream *open(int fd, const std::string &)
+    {
+        DIR *dir = fdopendir(fd);
+        if (!dir) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return NULL;
+        }
+        return new Stream(dir, stats_);
+    }
+
+private:
+    class Stream : public DirStream
+    {
+    public:
+        Stream(DIR *dir, ScanStats *stats)
+        : DirStream(dirfd(dir))
+        , dir_(dir)
+        , stats_(stats)
+        {}
+
+        virtual ~Stream()
+        {
+            closedir(dir_);
+        }
+
+        virtual bool next(std::vector<DirEntry> &entries)
+        {
+            entries.clear();
+            struct dirent *ent;
+            while ((ent = read()) != NULL) {
+                if (!want_dirent(ent->d_name, ent->d_type)) {
+                    continue;
+                }
+                DirEntry entry;
+                entry.name_ = ent->d_name;
+                entry.error_ = 0;
+                OpTimer timer(stats_, ScanStats::OP_LSTAT);
+                if (fstatat(fd_, ent->d_name, &entry.st_, AT_SYMLINK_NOFOLLOW) != 0) {
+                    entry.error_ = errno;
+                }
+                entries.push_back(entry);
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        struct dirent *read()
+        {
+            OpTimer timer(stats_, ScanStats::OP_READDIR);
+            return readdir(dir_);
+        }
+
+        DIR *dir_;
+        ScanStats *stats_;
+    };
+};
+
+#ifdef DMON_HAVE_IO_URING
+// Just enough of io_uring, without liburing, to keep a batch of statx
+// requests in flight at once.
+class IoUring
+{
+public:
+    IoUring()
+    : fd_(-1)
+    , sq_ptr_(MAP_FAILED)
+    , cq_ptr_(MAP_FAILED)
+    , sqes_(reinterpret_cast<struct io_uring_sqe *>(MAP_FAILED))
+    , broken_(false)
+    {}
+
+    ~IoUring()
+    {
+        if (sqes_ != MAP_FAILED)
+            munmap(sqes_, params_.sq_entries * sizeof(struct io_uring_sqe));
+        if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+            munmap(cq_ptr_, cq_ring_size_);
+        if (sq_ptr_ != MAP_FAILED)
+            munmap(sq_ptr_, sq_ring_size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    // Returns false if io_uring or IORING_OP_STATX is not available.
+    bool init(unsigned entries)
+    {
+        memset(&params_, 0, sizeof(params_));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params_);
+        if (fd_ < 0)
+            return false;
+
+        sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params_.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ptr_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED)
+            return false;
+        cq_ptr_ = single_mmap ? sq_ptr_ :
+            mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED)
+            return false;
+        sqes_ = reinterpret_cast<struct io_uring_sqe *>(
+                mmap(NULL, params_.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED)
+            return false;
+
+        char *sq = reinterpret_cast<char *>(sq_ptr_);
+        char *cq = reinterpret_cast<char *>(cq_ptr_);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + params_.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params_.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params_.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + params_.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params_.cq_off.cqes);
+        return supports(IORING_OP_STATX);
+    }
+
+    unsigned entries() const { return params_.sq_entries; }
+
+    // Set once statx() failed; the ring is not entered again.
+    bool broken() const { return broken_; }
+
+    // lstat()s names[i] relative to dir_fd into stx[i], for i < n, with all
+    // of them in flight at once.  results[i] is 0 or a negative errno.
+    // n must not exceed entries().  Returns false, and the ring is
+    // broken(), if io_uring_enter() fails; names and stx are no longer
+    // written to by then.
+    bool statx(int dir_fd, const char *const *names, struct statx *stx, int *results, unsigned n)
+    {
+        if (broken_) {
+            return false;
+        }
+        unsigned tail = *sq_tail_;
+        for (unsigned i = 0; i < n; i++) {
+            unsigned index = tail & sq_mask_;
+            struct io_uring_sqe *sqe = &sqes_[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd;
+            sqe->addr = reinterpret_cast<__u64>(names[i]);
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = reinterpret_cast<__u64>(&stx[i]);
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = i;
+            sq_array_[index] = index;
+            tail++;
+        }
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+        unsigned to_submit = n;
+        unsigned completed = 0;
+        while (completed < n) {
+            int ret = syscall(__NR_io_uring_enter, fd_, to_submit, n - completed,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG("io_uring_enter() failed: %s, falling back to fstatat()", strerror(errno));
+                broken_ = true;
+                // the SQEs not submitted never will be; wait out the others
+                drain(n - to_submit - completed);
+                return false;
+            }
+            to_submit -= std::min<unsigned>(ret, to_submit);
+            completed += reap(results, n);
+        }
+        return true;
+    }
+
+private:
+    // Takes the CQEs there are, of requests below n.  Returns how many.
+    unsigned reap(int *results, unsigned n)
+    {
+        unsigned taken = 0;
+        unsigned head = *cq_head_;
+        unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data < n) {
+                if (results) {
+                    results[cqe.user_data] = cqe.res;
+                }
+                taken++;
+            }
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return taken;
+    }
+
+    // Waits for the inflight requests submitted to complete, so that the
+    // kernel no longer writes into the buffers they point to.  The CQ ring
+    // is polled if io_uring_enter() keeps failing.
+    void drain(unsigned inflight)
+    {
+        while (inflight > 0) {
+            int ret = syscall(__NR_io_uring_enter, fd_, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR) {
+                usleep(1000);
+            }
+            unsigned taken = reap(NULL, UINT_MAX);
+            inflight -= std::min(taken, inflight);
+        }
+    }
+
+    bool supports(unsigned op)
+    {
+        const unsigned nops = 256;
+        std::vector<char> buf(sizeof(struct io_uring_probe) + nops * sizeof(struct io_uring_probe_op));
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, nops) < 0)
+            return false;
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    int fd_;
+    struct io_uring_params params_;
+    void *sq_ptr_;
+    void *cq_ptr_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    struct io_uring_sqe *sqes_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe *cqes_;
+    bool broken_;
+};
+
+// Reads directories in large getdents64() chunks and stats every entry of
+// a chunk through one io_uring submission, so that on network filesystems
+// the round trips of a whole chunk overlap instead of adding up.
+class UringScanBackend : public ScanBackend
+{
+public:
+    static const unsigned RING_ENTRIES = 256;
+    static const size_t DENTS_BUF_SIZE = 64 * 1024;
+
+    bool init()
+    {
+        return ring_.init(RING_ENTRIES);
+    }
+
+    virtual const char *name() const { return "uring"; }
+
+    virtual DirStream *open(int fd, const std::string &)
+    {
+        return new Stream(fd, *this);
+    }
+
+private:
+    struct linux_dirent64
+    {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    class Stream : public DirStream
+    {
+    public:
+        Stream(int fd, UringScanBackend &backend)
+        : DirStream(fd)
+        , backend_(backend)
+        , buf_(DENTS_BUF_SIZE)
+        , eof_(false)
+        {}
+
+        virtual ~Stream()
+        {
+            close(fd_);
+        }
+
+        virtual bool next(std::vector<DirEntry> &entries)
+        {
+            entries.clear();
+            while (entries.empty() && !eof_) {
+                long nread;
+                {
+                    OpTimer timer(backend_.stats(), ScanStats::OP_READDIR);
+                    nread = syscall(SYS_getdents64, fd_, buf_.data(), buf_.size());
+                }
+                if (nread <= 0) {
+                    if (nread < 0) {
+                        LOG("getdents64() failed: %s", strerror(errno));
+                    }
+                    eof_ = true;
+                    break;
+                }
+                names_.clear();
+                for (long pos = 0; pos < nread; ) {
+                    const linux_dirent64 *ent = reinterpret_cast<const linux_dirent64 *>(&buf_[pos]);
+                    pos += ent->d_reclen;
+                    if (want_dirent(ent->d_name, ent->d_type)) {
+                        names_.push_back(ent->d_name);
+                    }
+                }
+                stat_names(entries);
+            }
+            return !entries.empty();
+        }
+
+    private:
+        void stat_names(std::vector<DirEntry> &entries)
+        {
+            IoUring &ring = backend_.ring_;
+            size_t n = names_.size();
+            stx_.resize(n);
+            results_.resize(n);
+            entries.resize(n);
+            for (size_t begin = 0; begin < n; begin += ring.entries()) {
+                unsigned count = std::min<size_t>(ring.entries(), n - begin);
+                OpTimer timer(backend_.stats(), ScanStats::OP_LSTAT, count);
+                if (!ring.statx(fd_, &names_[begin], &stx_[begin], &results_[begin], count)) {
+                    // the ring is unusable, stat the rest, and those of the
+                    // directories to come, one by one
+                    for (size_t i = begin; i < n; i++) {
+                        results_[i] = (fstatat(fd_, names_[i], &entries[i].st_, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+                        entries[i].name_ = names_[i];
+                        entries[i].error_ = -results_[i];
+                    }
+                    return;
+                }
+            }
+            for (size_t i = 0; i < n; i++) {
+                DirEntry &entry = entries[i];
+                entry.name_ = names_[i];
+                entry.error_ = -results_[i];
+                if (entry.error_ == 0) {
+                    statx_to_stat(stx_[i], entry.st_);
+                }
+            }
+        }
+
+        static void statx_to_stat(const struct statx &stx, struct stat &st)
+        {
+            memset(&st, 0, sizeof(st));
+            st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st.st_ino = stx.stx_ino;
+            st.st_mode = stx.stx_mode;
+            st.st_nlink = stx.stx_nlink;
+            st.st_uid = stx.stx_uid;
+            st.st_gid = stx.stx_gid;
+            st.st_size = stx.stx_size;
+            st.st_blocks = stx.stx_blocks;
+            st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+            st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+            st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+        }
+
+        UringScanBackend &backend_;
+        std::vector<char> buf_;
+        bool eof_;
+        std::vector<const char *> names_;
+        std::vector<struct statx> stx_;
+        std::vector<int> results_;
+    };
+
+    IoUring ring_;
+};
+#endif // DMON_HAVE_IO_URING
+
+ScanBackend *ScanBackend::create(const char *name, ScanStats *stats)
+{
+    ScanBackend *backend = NULL;
+    if (0 == strcmp("uring", name)) {
+#ifdef DMON_HAVE_IO_URING
+        UringScanBackend *uring = new UringScanBackend();
+        if (uring->init()) {
+            backend = uring;
+        }
+        else {
+            delete uring;
+        }
+#endif
+        if (!backend) {
+            LOG("WARN: io_uring statx is not available, using %s", "posix");
+            backend = new PosixScanBackend();
+        }
+    }
+    else if (0 == strcmp("posix", name)) {
+        backend = new PosixScanBackend();
+    }
+    if (backend) {
+        backend->stats_ = stats;
+    }
+    return backend;
+}
+
+const char *ScanBackend::choose(const char *name, const char *path)
+{
+    if (0 != strcmp("auto", name)) {
+        return name;
+    }
+    struct statfs sfs;
+    if (statfs(path, &sfs) != 0) {
+        return "posix";
+    }
+    switch (static_cast<unsigned long>(sfs.f_type)) {
+    case 0x6969:        // NFS
+    case 0x517b:        // SMB
+    case 0xff534d42:    // CIFS
+    case 0xfe534d42:    // SMB2
+    case 0x00c36400:    // Ceph
+    case 0x0bd00bd0:    // Lustre
+    case 0x47504653:    // GPFS
+    case 0x65735546:    // FUSE
+        return "uring";
+    default:
+        return "posix";
+    }
+}
+
+Allocator &Allocator::standard()
+{
+    class Standard : public Allocator
+    {
+    public:
+        virtual void *allocate(size_t size) { return ::operator new(size); }
+        virtual void deallocate(void *p, size_t) { ::operator delete(p); }
+    };
+    static Standard standard;
+    return standard;
+}
+
+DirStamp make_stamp(const struct stat &st)
+{
+    const int64_t NS = 1000000000;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t limit = int64_t(now.tv_sec - 1) * NS + now.tv_nsec;
+    DirStamp stamp;
+    int64_t mtime = int64_t(st.st_mtim.tv_sec) * NS + st.st_mtim.tv_nsec;
+    int64_t ctime = int64_t(st.st_ctim.tv_sec) * NS + st.st_ctim.tv_nsec;
+    if (S_ISDIR(st.st_mode) && mtime < limit && ctime < limit) {
+        stamp.mtime_ = mtime;
+        stamp.ctime_ = ctime;
+        stamp.ino_ = st.st_ino;
+    }
+    return stamp;
+}
+
+size_t push_path(std::string &path, const char *name, size_t len)
+{
+    size_t old_len = path.size();
+    if (!path.empty() && path[path.size() - 1] != SEP) {
+        path += SEP;
+    }
+    path.append(name, len);
+    return old_len;
+}
+
+struct ListingLess
+{
+    const DirListing &listing_;
+
+    explicit ListingLess(const DirListing &listing)
+    : listing_(listing)
+    {}
+
+    bool operator()(const DirListing::Entry &lhs, const DirListing::Entry &rhs) const
+    {
+        return FileTree::compare_names(listing_.name(lhs), lhs.name_len_, listing_.name(rhs), rhs.name_len_) < 0;
+    }
+};
+
+bool DirListing::sorted() const
+{
+    return std::is_sorted(entries_.begin(), entries_.end(), ListingLess(*this));
+}
+
+void DirListing::sort()
+{
+    if (!sorted()) {
+        std::sort(entries_.begin(), entries_.end(), ListingLess(*this));
+    }
+}
+
+bool DirListing::spill()
+{
+    if (!spilled_) {
+        spilled_.reset(SpilledFiles::create(spill_.dir_));
+        if (!spilled_) {
+            return false;
+        }
+    }
+    return spilled_->spill(*this);
+}
+
+// A record as spilled: its size, apparent size, name length and type,
+// then the name.
+const size_t SPILL_HEADER = 8 + 8 + 4 + 1;
+
+SpilledFiles::SpilledFiles(int fd)
+: fd_(fd)
+, end_(0)
+, count_(0)
+, size_(0)
+, apparent_(0)
+, largest_size_(0)
+{}
+
+SpilledFiles::~SpilledFiles()
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+SpilledFiles *SpilledFiles::create(const std::string &dir)
+{
+    std::string file_path = join_path(dir, "dmon-spill-XXXXXX");
+    int fd = mkostemp(&file_path[0], O_CLOEXEC);
+    if (fd < 0) {
+        LOG("cannot create a spill file in %s: %s", dir.c_str(), strerror(errno));
+        return NULL;
+    }
+    // gone with the fd, however the walk ends
+    unlink(file_path.c_str());
+    return new SpilledFiles(fd);
+}
+
+const SpilledFiles &SpilledFiles::none()
+{
+    static const SpilledFiles files(-1);
+    return files;
+}
+
+bool SpilledFiles::spill(DirListing &listing)
+{
+    std::vector<size_t> files;
+    for (size_t i = 0; i < listing.entries_.size(); i++) {
+        if (listing.entries_[i].type_ != FILE_TYPE_DIRECTORY) {
+            files.push_back(i);
+        }
+    }
+    if (files.empty()) {
+        return true;
+    }
+    std::sort(files.begin(), files.end(), [&listing](size_t lhs, size_t rhs) {
+        const DirListing::Entry &l = listing.entries_[lhs];
+        const DirListing::Entry &r = listing.entries_[rhs];
+        return FileTree::compare_names(listing.name(l), l.name_len_, listing.name(r), r.name_len_) < 0;
+    });
+    std::vector<char> buf;
+    uint64_t size = 0;
+    uint64_t apparent = 0;
+    std::string largest = largest_;
+    uint64_t largest_size = largest_size_;
+    for (size_t i = 0; i < files.size(); i++) {
+        const DirListing::Entry &entry = listing.entries_[files[i]];
+        uint64_t entry_size = entry.size_;
+        uint32_t name_len = entry.name_len_;
+        size_t pos = buf.size();
+        buf.resize(pos + SPILL_HEADER + name_len);
+        memcpy(&buf[pos], &entry_size, 8);
+        memcpy(&buf[pos + 8], &entry.apparent_, 8);
+        memcpy(&buf[pos + 16], &name_len, 4);
+        buf[pos + 20] = entry.type_;
+        memcpy(&buf[pos + SPILL_HEADER], listing.name(entry), name_len);
+        size += entry_size;
+        apparent += entry.apparent_;
+        // files are in name order, so only a larger one wins
+        if ((count_ == 0 && i == 0) || entry_size > largest_size
+                || (entry_size == largest_size && FileTree::compare_names(listing.name(entry), name_len,
+                        largest.data(), largest.size()) < 0)) {
+            largest.assign(listing.name(entry), name_len);
+            largest_size = entry_size;
+        }
+    }
+    for (size_t done = 0; done < buf.size(); ) {
+        ssize_t n = pwrite(fd_, &buf[done], buf.size() - done, end_ + done);
+        if (n < 0) {
+            LOG("failed to spill %zu entries: %s", files.size(), strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    runs_.push_back(std::make_pair(end_, uint64_t(buf.size())));
+    end_ += buf.size();
+    count_ += files.size();
+    size_ += size;
+    apparent_ += apparent;
+    largest_.swap(largest);
+    largest_size_ = largest_size;
+
+    // keeps the sub directories, with their names packed again
+    DirListing dirs;
+    dirs.spill_ = listing.spill_;
+    for (size_t i = 0; i < listing.entries_.size(); i++) {
+        const DirListing::Entry &entry = listing.entries_[i];
+        if (entry.type_ == FILE_TYPE_DIRECTORY) {
+            dirs.add(listing.name(entry), entry.type_, entry.size_, entry.stamp_, entry.apparent_);
+        }
+    }
+    listing.entries_.swap(dirs.entries_);
+    listing.names_.swap(dirs.names_);
+    listing.nfiles_ = 0;
+    return true;
+}
+
+SpilledFiles::Reader::Reader(const SpilledFiles &files)
+: files_(files)
+, runs_(files.runs_.size())
+, last_(size_t(-1))
+{
+    for (size_t i = 0; i < runs_.size(); i++) {
+        Run &run = runs_[i];
+        run.offset_ = files.runs_[i].first;
+        run.end_ = run.offset_ + files.runs_[i].second;
+        run.pos_ = 0;
+        run.len_ = 0;
+        if (advance(run)) {
+            heap_.push_back(i);
+        }
+    }
+    After after = {&runs_};
+    std::make_heap(heap_.begin(), heap_.end(), after);
+}
+
+bool SpilledFiles::Reader::After::operator()(size_t lhs, size_t rhs) const
+{
+    const Record &l = (*runs_)[lhs].record_;
+    const Record &r = (*runs_)[rhs].record_;
+    return FileTree::compare_names(l.name_, l.name_len_, r.name_, r.name_len_) > 0;
+}
+
+bool SpilledFiles::Reader::fill(Run &run, size_t need)
+{
+    size_t have = run.len_ - run.pos_;
+    if (have >= need) {
+        return true;
+    }
+    uint64_t remaining = run.end_ - run.offset_;
+    if (need > remaining) {
+        LOG("%s", "spilled entries are cut short");
+        return false;
+    }
+    if (have > 0) {
+        memmove(&run.buf_[0], &run.buf_[run.pos_], have);
+    }
+    run.pos_ = 0;
+    size_t want = std::min<uint64_t>(std::max<size_t>(need, 64 * 1024), remaining) - have;
+    run.buf_.resize(have + want);
+    for (size_t got = 0; got < want; ) {
+        ssize_t n = pread(files_.fd_, &run.buf_[have + got], want - got, run.offset_ + have + got);
+        if (n <= 0) {
+            LOG("failed to read spilled entries: %s", n < 0 ? strerror(errno) : "short read");
+            return false;
+        }
+        got += n;
+    }
+    run.len_ = have + want;
+    return true;
+}
+
+bool SpilledFiles::Reader::advance(Run &run)
+{
+    if (run.offset_ >= run.end_ || !fill(run, SPILL_HEADER)) {
+        return false;
+    }
+    uint32_t name_len;
+    memcpy(&name_len, &run.buf_[run.pos_ + 16], 4);
+    size_t need = SPILL_HEADER + name_len;
+    if (!fill(run, need)) {
+        return false;
+    }
+    const char *p = &run.buf_[run.pos_];
+    Record &record = run.record_;
+    memcpy(&record.size_, p, 8);
+    memcpy(&record.apparent_, p + 8, 8);
+    record.name_len_ = name_len;
+    record.type_ = static_cast<unsigned char>(p[20]);
+    record.name_ = p + SPILL_HEADER;
+    run.pos_ += need;
+    run.offset_ += need;
+    return true;
+}
+
+bool SpilledFiles::Reader::next(Record &record)
+{
+    After after = {&runs_};
+    if (last_ != size_t(-1)) {
+        if (advance(runs_[last_])) {
+            heap_.push_back(last_);
+            std::push_heap(heap_.begin(), heap_.end(), after);
+        }
+        last_ = size_t(-1);
+    }
+    if (heap_.empty()) {
+        return false;
+    }
+    std::pop_heap(heap_.begin(), heap_.end(), after);
+    last_ = heap_.back();
+    heap_.pop_back();
+    record = runs_[last_].record_;
+    return true;
+}
+
+int stat_to_type(const struct stat &st, size_t *size)
+{
+    if (S_ISDIR(st.st_mode)) {
+        *size = st.st_blocks * BLOCK_SIZE;
+        return FILE_TYPE_DIRECTORY;
+    }
+    else if (S_ISREG(st.st_mode)) {
+        *size = st.st_blocks * BLOCK_SIZE;
+        return FILE_TYPE_REGULAR;
+    }
+    else if (S_ISLNK(st.st_mode)) {
+        *size = st.st_blocks * BLOCK_SIZE;
+        return FILE_TYPE_LINK;
+    }
+    *size = 0;
+    return FILE_TYPE_UNKNOWN;
+}
+
+void NameFilter::add(const std::string &pattern, unsigned kind)
+{
+    Pattern compiled;
+    size_t end = pattern.size();
+    compiled.accept_ = kind;
+    if (end > 0 && pattern[end - 1] == '/') {
+        end--;
+        compiled.accept_ = kind * DIR_ONLY;
+    }
+    for (size_t i = 0; i < end; i++) {
+        Token token;
+        memset(token.bits_, 0, sizeof(token.bits_));
+        token.star_ = false;
+        unsigned char c = pattern[i];
+        if (c == '*' || c == '?') {
+            if (c == '*' && !compiled.tokens_.empty() && compiled.tokens_.back().star_) {
+                continue;
+            }
+            memset(token.bits_, 0xff, sizeof(token.bits_));
+            token.star_ = (c == '*');
+            compiled.tokens_.push_back(token);
+            continue;
+        }
+        if (c == '\\' && i + 1 < end) {
+            c = pattern[++i];
+        }
+        else if (c == '[') {
+            size_t j = i + 1;
+            bool negate = (j < end && (pattern[j] == '!' || pattern[j] == '^'));
+            if (negate) {
+                j++;
+            }
+            // a ']' first is a member, not the end
+            size_t last = pattern.find(']', (j < end) ? j + 1 : end);
+            if (last < end) {
+                for (size_t k = j; k < last; k++) {
+                    unsigned char lo = pattern[k];
+                    unsigned char hi = lo;
+                    if (k + 2 < last && pattern[k + 1] == '-') {
+                        hi = pattern[k + 2];
+                        k += 2;
+                    }
+                    for (unsigned b = lo; b <= hi; b++) {
+                        token.bits_[b >> 6] |= uint64_t(1) << (b & 63);
+                    }
+                }
+                if (negate) {
+                    for (size_t w = 0; w < 4; w++) {
+                        token.bits_[w] = ~token.bits_[w];
+                    }
+                }
+                compiled.tokens_.push_back(token);
+                i = last;
+                continue;
+            }
+        }
+        token.bits_[c >> 6] |= uint64_t(1) << (c & 63);
+        compiled.tokens_.push_back(token);
+    }
+    patterns_.push_back(compiled);
+}
+
+void NameFilter::close(uint32_t pattern, size_t pos, std::vector<uint64_t> &states) const
+{
+    const std::vector<Token> &tokens = patterns_[pattern].tokens_;
+    for (;;) {
+        states.push_back((uint64_t(pattern) << 32) | pos);
+        if (pos == tokens.size() || !tokens[pos].star_) {
+            break;
+        }
+        pos++;
+    }
+}
+
+void NameFilter::compile()
+{
+    next_.clear();
+    accept_.clear();
+    if (patterns_.empty()) {
+        return;
+    }
+    // subset construction, each DFA state being the sorted set of the
+    // (pattern << 32 | token) positions the bytes so far may have reached
+    std::vector<std::vector<uint64_t> > sets(2);
+    for (uint32_t p = 0; p < patterns_.size(); p++) {
+        close(p, 0, sets[START]);
+    }
+    std::map<std::vector<uint64_t>, uint32_t> ids;
+    ids[sets[DEAD]] = DEAD;
+    ids[sets[START]] = START;
+    std::vector<uint64_t> to;
+    for (uint32_t state = 0; state < sets.size(); state++) {
+        unsigned accept = 0;
+        for (size_t i = 0; i < sets[state].size(); i++) {
+            uint64_t pos = sets[state][i];
+            const Pattern &pattern = patterns_[pos >> 32];
+            if ((pos & 0xffffffff) == pattern.tokens_.size()) {
+                accept |= pattern.accept_;
+            }
+        }
+        accept_.push_back(accept);
+        next_.resize(sets.size() * 256);
+        for (unsigned c = 0; c < 256; c++) {
+            to.clear();
+            for (size_t i = 0; i < sets[state].size(); i++) {
+                uint64_t pos = sets[state][i];
+                uint32_t p = pos >> 32;
+                size_t t = pos & 0xffffffff;
+                const std::vector<Token> &tokens = patterns_[p].tokens_;
+                if (t < tokens.size() && tokens[t].has(c)) {
+                    close(p, tokens[t].star_ ? t : t + 1, to);
+                }
+            }
+            std::sort(to.begin(), to.end());
+            to.erase(std::unique(to.begin(), to.end()), to.end());
+            std::map<std::vector<uint64_t>, uint32_t>::iterator it = ids.find(to);
+            if (it == ids.end()) {
+                it = ids.insert(std::make_pair(to, uint32_t(sets.size()))).first;
+                sets.push_back(to);
+            }
+            next_[state * 256 + c] = it->second;
+        }
+    }
+}
+
+int open_dir(int parent_fd, const char *name, ScanStats *stats)
+{
+    OpTimer timer(stats, ScanStats::OP_OPENDIR);
+    return openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+template <unsigned Features>
+DirStream *list_dir_with(ScanBackend &backend, int fd, const std::string &path, DirListing &listing,
+        EntryFilter *filter, Breakdown::Tally *tally, ScanThrottle *throttle)
+{
+    listing.clear();
+    ScanStats *stats = backend.stats();
+    uint64_t start = stats ? now_ns() : 0;
+    DirStream *stream = (fd >= 0) ? backend.open(fd, path) : NULL;
+    if (!stream) {
+        LOG("could not open dir %s: %s", path.c_str(), strerror(errno));
+        return NULL;
+    }
+    std::vector<DirEntry> entries;
+    bool admitting = (Features & (WALK_FILTER | WALK_DEDUP)) && filter;
+    bool sharded = (Features & WALK_FILTER) && filter && filter->sharded(path);
+    bool throttled = (Features & WALK_THROTTLE) && throttle && throttle->enabled();
+    if (throttled) {
+        throttle->limit(1);
+    }
+    uint64_t batch_start = throttled ? now_ns() : 0;
+    while (stream->next(entries)) {
+        if (throttled) {
+            throttle->sample(entries.size(), now_ns() - batch_start);
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            const DirEntry &entry = entries[i];
+            if (sharded && !filter->in_shard(entry.name_)) {
+                continue;
+            }
+            if (entry.error_ != 0) {
+                LOG("lstat(%s) failed: %s", join_path(path, entry.name_).c_str(), strerror(entry.error_));
+                continue;
+            }
+            size_t size;
+            uint64_t apparent = entry.st_.st_size;
+            int type = stat_to_type(entry.st_, &size);
+            if (type == FILE_TYPE_UNKNOWN
+                    || (admitting && !filter->admit_with<Features>(entry.name_, entry.st_, &size, &apparent))) {
+                continue;
+            }
+            if ((Features & WALK_TALLY) && tally) {
+                tally->add(entry.name_, entry.st_, size);
+            }
+            if (type == FILE_TYPE_DIRECTORY) {
+                listing.add(entry.name_, type, size, make_stamp(entry.st_), apparent);
+            }
+            else {
+                listing.add(entry.name_, type, size, DirStamp(), apparent);
+            }
+            if ((Features & WALK_SPILL) && listing.spill_.after_ > 0 && listing.nfiles_ > listing.spill_.after_
+                    && !listing.spill()) {
+                LOG("WARN: keeping the rest of %s in memory", path.c_str());
+                listing.spill_.after_ = 0;
+            }
+        }
+        if (throttled) {
+            batch_start = now_ns();
+        }
+    }
+    if ((Features & WALK_SPILL) && listing.spilled_ && listing.nfiles_ > 0 && !listing.spill()) {
+        LOG("WARN: keeping the rest of %s in memory", path.c_str());
+        listing.spill_.after_ = 0;
+    }
+    // in name order, so that the tree is sorted() as it is built and no
+    // diff or load has to sort it again
+    listing.sort();
+    if (start) {
+        stats->add_dir(path, listing.entries_.size(), now_ns() - start);
+    }
+    return stream;
+}
+
+DirStream *list_dir(ScanBackend &backend, int fd, const std::string &path, DirListing &listing,
+        EntryFilter *filter, Breakdown::Tally *tally, ScanThrottle *throttle)
+{
+    return list_dir_with<WALK_ALL>(backend, fd, path, listing, filter, tally, throttle);
+}
+
+// Fills table with the list_dir_with() of Features and of every set below.
+template <unsigned Features>
+struct ListDirFill
+{
+    static void fill(ListDir *table)
+    {
+        table[Features] = list_dir_with<Features>;
+        ListDirFill<Features - 1>::fill(table);
+    }
+};
+
+template <>
+struct ListDirFill<0>
+{
+    static void fill(ListDir *table)
+    {
+        table[0] = list_dir_with<0>;
+    }
+};
+
+struct ListDirTable
+{
+    ListDir table_[WALK_ALL + 1];
+
+    ListDirTable()
+    {
+        ListDirFill<WALK_ALL>::fill(table_);
+    }
+};
+
+ListDir list_dir_for(unsigned features)
+{
+    static const ListDirTable table;
+    return table.table_[features & WALK_ALL];
+}
+
+void DirSummary::offer(const char *name, size_t len, uint64_t size)
+{
+    if (!largest_ || size > largest_size_
+            || (size == largest_size_ && FileTree::compare_names(name, len, largest_, largest_len_) < 0)) {
+        largest_ = name;
+        largest_len_ = len;
+        largest_size_ = size;
+    }
+}
+
+struct FileTree::JsonSub
+{
+    FileInfo file_;
+    DirStamp stamp_;
+    DirSummary summary_;
+    bool summarized_;   // "entries" was seen
+    NodeCounts counts_;
+    bool counted_;      // "apparent" was seen
+    bool pending_;
+
+    JsonSub()
+    : summarized_(false)
+    , counted_(false)
+    , pending_(false)
+    {
+        memset(&file_, 0, sizeof(file_));
+    }
+};
+
+struct FileTree::NameLess
+{
+    const FileTree &tree_;
+
+    explicit NameLess(const FileTree &tree)
+    : tree_(tree)
+    {}
+
+    bool operator()(const JsonSub &lhs, const JsonSub &rhs) const
+    {
+        return compare_names(tree_.name(lhs.file_), lhs.file_.name_len_,
+                tree_.name(rhs.file_), rhs.file_.name_len_) < 0;
+    }
+};
+
+// SAX handler for from_json().
+//
+// The siblings of a "subs" array are staged in a Level until the array
+// ends, then sorted by name as diff_cursors() expects, unless the root
+// says they are "sorted" already, and appended as one block, so sub
+// files are still stored next to each other.  A block is only
+// appended after the blocks of its own sub files, whose parent_ is then
+// fixed up to the now known ids.  Only the levels on the current path
+// are held besides the tree.
+//
+// The full "path" of a version 1 snapshot is cut to its last component,
+// except for the root, whose "breakdown" goes to breakdown().  Values of
+// unknown members are skipped.
+struct FileTree::JsonHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonHandler>
+{
+    enum Key {
+        KEY_OTHER,
+        KEY_NAME,
+        KEY_SIZE,
+        KEY_TYPE,
+        KEY_SUBS,
+        KEY_VERSION,
+        KEY_MTIME,
+        KEY_CTIME,
+        KEY_INO,
+        KEY_GENERATION,
+        KEY_ENTRIES,
+        KEY_LARGEST,
+        KEY_LARGEST_SIZE,
+        KEY_APPARENT,
+        KEY_FILES,
+        KEY_DIRS,
+        KEY_PENDING,
+        KEY_SORTED,
+        KEY_BREAKDOWN,
+        KEY_BY,             // the members of a breakdown record
+        KEY_KEY,
+        KEY_COUNT,
+    };
+
+    typedef std::vector<JsonSub> Level;
+
+    FileTree &tree_;
+    const std::string &file_path_;
+    std::vector<Level> levels_;
+    Key key_;
+    int skip_;          // depth in a skipped value
+    bool in_array_;     // directly in a "subs" array
+    bool started_;      // the root object was seen
+    bool failed_;       // an error was logged
+    JsonSub root_;      // only for the summary of the root
+    bool in_breakdown_; // directly in the "breakdown" array of the root
+    bool in_record_;    // in one of its elements
+    bool sorted_;       // the root is "sorted"
+    std::string record_by_;
+    std::string record_key_;
+    Breakdown::Usage record_;
+
+    JsonHandler(FileTree &tree, const std::string &file_path)
+    : tree_(tree)
+    , file_path_(file_path)
+    , key_(KEY_OTHER)
+    , skip_(0)
+    , in_array_(false)
+    , started_(false)
+    , failed_(false)
+    , in_breakdown_(false)
+    , in_record_(false)
+    , sorted_(false)
+    {}
+
+    bool is_root() const { return levels_.empty(); }
+
+    FileInfo &current() { return is_root() ? tree_.root() : levels_.back().back().file_; }
+
+    // the root's stamp is the first
+    DirStamp &current_stamp() { return is_root() ? tree_.stamps_[0] : levels_.back().back().stamp_; }
+
+    JsonSub &current_sub() { return is_root() ? root_ : levels_.back().back(); }
+
+    void commit_summary(NodeId id, const JsonSub &sub)
+    {
+        if (sub.summarized_) {
+            tree_.summaries_[id] = sub.summary_;
+        }
+        if (sub.counted_) {
+            if (!tree_.counted()) {
+                tree_.set_counted(true);
+            }
+            tree_.set_counts(id, sub.counts_);
+        }
+        if (sub.pending_) {
+            tree_.pending_.insert(id);
+        }
+    }
+
+    bool fail(const char *what)
+    {
+        LOG("%s in %s", what, file_path_.c_str());
+        failed_ = true;
+        return false;
+    }
+
+    // Returns true if a scalar value should be ignored.
+    bool skip_scalar()
+    {
+        if (skip_ > 0 || (in_breakdown_ && !in_record_))
+            return true;
+        if (in_array_) {
+            LOG("WARN: element of 'subs' is not an object in %s", file_path_.c_str());
+            return true;
+        }
+        if (key_ == KEY_SUBS) {
+            LOG("WARN: json value for 'subs' is not an array in %s", file_path_.c_str());
+            return true;
+        }
+        return false;
+    }
+
+    bool Default()
+    {
+        if (!started_)
+            return fail("json value is not an object");
+        skip_scalar();
+        return true;
+    }
+
+    bool Bool(bool value)
+    {
+        if (!started_)
+            return fail("json value is not an object");
+        if (skip_scalar())
+            return true;
+        if (key_ == KEY_PENDING && !in_record_)
+            current_sub().pending_ = value;
+        else if (key_ == KEY_SORTED && is_root())
+            sorted_ = value;
+        return true;
+    }
+
+    bool Uint64(uint64_t value)
+    {
+        if (!started_)
+            return fail("json value is not an object");
+        if (skip_scalar())
+            return true;
+        if (in_record_) {
+            if (key_ == KEY_SIZE)
+                record_.size_ = value;
+            else if (key_ == KEY_COUNT)
+                record_.count_ = value;
+            return true;
+        }
+        switch (key_) {
+        case KEY_SIZE:
+            current().size_ = value;
+            break;
+        case KEY_TYPE:
+            current().type_ = value;
+            break;
+        case KEY_MTIME:
+            current_stamp().mtime_ = value;
+            break;
+        case KEY_CTIME:
+            current_stamp().ctime_ = value;
+            break;
+        case KEY_INO:
+            current_stamp().ino_ = value;
+            break;
+        case KEY_GENERATION:
+            if (is_root())
+                tree_.set_generation(value);
+            break;
+        case KEY_ENTRIES:
+            current_sub().summary_.entries_ = value;
+            current_sub().summarized_ = true;
+            break;
+        case KEY_LARGEST_SIZE:
+            current_sub().summary_.largest_size_ = value;
+            break;
+        case KEY_APPARENT:
+            current_sub().counts_.apparent_ = value;
+            current_sub().counted_ = true;
+            break;
+        case KEY_FILES:
+            current_sub().counts_.files_ = value;
+            break;
+        case KEY_DIRS:
+            current_sub().counts_.dirs_ = value;
+            break;
+        case KEY_VERSION:
+            if (!is_root())
+                break;
+            if (value < 1 || value > SNAPSHOT_VERSION) {
+                LOG("unsupported snapshot version %d in %s", int(value), file_path_.c_str());
+                failed_ = true;
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    bool Null() { return Default(); }
+    bool Double(double) { return Default(); }
+    bool Uint(unsigned value) { return Uint64(value); }
+    bool Int64(int64_t value) { return (value < 0) ? Default() : Uint64(value); }
+
+    bool Int(int value)
+    {
+        if (value < 0 && key_ == KEY_VERSION && skip_ == 0 && !in_array_ && is_root()) {
+            LOG("unsupported snapshot version %d in %s", value, file_path_.c_str());
+            failed_ = true;
+            return false;
+        }
+        return (value < 0) ? Default() : Uint64(value);
+    }
+
+    bool String(const char *s, rapidjson::SizeType len, bool)
+    {
+        if (!started_)
+            return fail("json value is not an object");
+        if (skip_scalar())
+            return true;
+        if (in_record_) {
+            if (key_ == KEY_BY)
+                record_by_.assign(s, len);
+            else if (key_ == KEY_KEY)
+                record_key_.assign(s, len);
+            return true;
+        }
+        if (key_ == KEY_NAME) {
+            if (!is_root()) {
+                const char *sep = static_cast<const char *>(memrchr(s, SEP, len));
+                if (sep) {
+                    len -= sep + 1 - s;
+                    s = sep + 1;
+                }
+            }
+            tree_.set_name(current(), s, len);
+        }
+        else if (key_ == KEY_LARGEST) {
+            DirSummary &summary = current_sub().summary_;
+            summary.largest_ = tree_.copy_name(s, len);
+            summary.largest_len_ = len;
+        }
+        return true;
+    }
+
+    bool Key(const char *name, rapidjson::SizeType, bool)
+    {
+        if (skip_ > 0)
+            return true;
+        if (in_record_) {
+            if (0 == strcmp("by", name))
+                key_ = KEY_BY;
+            else if (0 == strcmp("key", name))
+                key_ = KEY_KEY;
+            else if (0 == strcmp("size", name))
+                key_ = KEY_SIZE;
+            else if (0 == strcmp("count", name))
+                key_ = KEY_COUNT;
+            else
+                key_ = KEY_OTHER;
+            return true;
+        }
+        if (0 == strcmp("path", name) || 0 == strcmp("name", name))
+            key_ = KEY_NAME;
+        else if (0 == strcmp("size", name))
+            key_ = KEY_SIZE;
+        else if (0 == strcmp("type", name))
+            key_ = KEY_TYPE;
+        else if (0 == strcmp("subs", name))
+            key_ = KEY_SUBS;
+        else if (0 == strcmp("version", name))
+            key_ = KEY_VERSION;
+        else if (0 == strcmp("mtime", name))
+            key_ = KEY_MTIME;
+        else if (0 == strcmp("ctime", name))
+            key_ = KEY_CTIME;
+        else if (0 == strcmp("ino", name))
+            key_ = KEY_INO;
+        else if (0 == strcmp("generation", name))
+            key_ = KEY_GENERATION;
+        else if (0 == strcmp("entries", name))
+            key_ = KEY_ENTRIES;
+        else if (0 == strcmp("largest", name))
+            key_ = KEY_LARGEST;
+        else if (0 == strcmp("largest_size", name))
+            key_ = KEY_LARGEST_SIZE;
+        else if (0 == strcmp("apparent", name))
+            key_ = KEY_APPARENT;
+        else if (0 == strcmp("files", name))
+            key_ = KEY_FILES;
+        else if (0 == strcmp("dirs", name))
+            key_ = KEY_DIRS;
+        else if (0 == strcmp("pending", name))
+            key_ = KEY_PENDING;
+        else if (0 == strcmp("sorted", name))
+            key_ = KEY_SORTED;
+        else if (0 == strcmp("breakdown", name))
+            key_ = KEY_BREAKDOWN;
+        else
+            key_ = KEY_OTHER;
+        return true;
+    }
+
+    bool StartObject()
+    {
+        if (skip_ > 0) {
+            skip_++;
+        }
+        else if (!started_) {
+            started_ = true;
+        }
+        else if (in_breakdown_ && !in_record_) {
+            in_record_ = true;
+            record_by_.clear();
+            record_key_.clear();
+            record_ = Breakdown::Usage();
+            key_ = KEY_OTHER;
+        }
+        else if (in_array_) {
+            levels_.back().push_back(JsonSub());
+            in_array_ = false;
+            key_ = KEY_OTHER;
+        }
+        else {
+            skip_ = 1;
+        }
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType)
+    {
+        if (skip_ > 0) {
+            skip_--;
+        }
+        else if (in_record_) {
+            int dimension = Breakdown::find_dimension(record_by_.data(), record_by_.size());
+            if (dimension >= 0) {
+                tree_.breakdown().add(dimension, record_key_, record_);
+            }
+            in_record_ = false;
+        }
+        else if (!is_root()) {
+            in_array_ = true;
+        }
+        else {
+            commit_summary(0, root_);
+        }
+        return true;
+    }
+
+    bool StartArray()
+    {
+        if (!started_)
+            return fail("json value is not an object");
+        if (skip_ == 0 && !in_array_ && !in_breakdown_ && key_ == KEY_BREAKDOWN && is_root()) {
+            in_breakdown_ = true;
+            key_ = KEY_OTHER;
+            return true;
+        }
+        if (skip_ > 0 || in_array_ || key_ != KEY_SUBS) {
+            if (skip_ == 0 && in_array_) {
+                LOG("WARN: element of 'subs' is not an object in %s", file_path_.c_str());
+            }
+            skip_++;
+            return true;
+        }
+        levels_.push_back(Level());
+        in_array_ = true;
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType)
+    {
+        if (skip_ > 0) {
+            skip_--;
+            return true;
+        }
+        if (in_breakdown_) {
+            in_breakdown_ = false;
+            key_ = KEY_OTHER;
+            return true;
+        }
+        Level &level = levels_.back();
+        if (!sorted_ && !std::is_sorted(level.begin(), level.end(), NameLess(tree_))) {
+            std::sort(level.begin(), level.end(), NameLess(tree_));
+        }
+        NodeId first = tree_.append_nodes(level.size());
+        for (size_t i = 0; i < level.size(); i++) {
+            NodeId id = first + i;
+            FileInfo &file = tree_.node(id);
+            file = level[i].file_;
+            tree_.set_stamp(id, level[i].stamp_);
+            commit_summary(id, level[i]);
+            for (uint32_t j = 0; j < file.nsubs_; j++) {
+                tree_.node(file.first_sub_ + j).parent_ = id;
+            }
+        }
+        size_t nsubs = level.size();
+        levels_.pop_back();
+        in_array_ = false;
+        key_ = KEY_OTHER;
+        FileInfo &owner = current();
+        owner.first_sub_ = first;
+        owner.nsubs_ = nsubs;
+        if (is_root()) {
+            for (size_t i = 0; i < nsubs; i++) {
+                tree_.node(first + i).parent_ = 0;
+            }
+        }
+        return true;
+    }
+};
+
+FileTree::FileTree(Allocator &allocator)
+: allocator_(allocator)
+, nodes_(allocator)
+, stamp_ids_(allocator)
+, stamps_(allocator)
+, names_(allocator)
+, summarize_(false)
+, filter_(new EntryFilter)
+, breakdown_by_(0)
+, counted_(false)
+, apparent_(allocator)
+, files_(allocator)
+, dirs_(allocator)
+, checkpoint_(NULL)
+, sorted_(true)
+, stats_(NULL)
+, throttle_(new ScanThrottle)
+, lister_(list_dir)
+{
+    clear();
+}
+
+FileTree::~FileTree()
+{
+}
+
+void FileTree::set_spilled(NodeId id, SpilledFiles *files)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (files) {
+        spilled_[id].reset(files);
+    }
+    else {
+        spilled_.erase(id);
+    }
+}
+
+void FileTree::add_breakdown(Breakdown::Tally &tally)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    tally.flush(breakdown_);
+}
+
+bool FileTree::set_root(const std::string &path)
+{
+    clear();
+    FileInfo &file = root();
+    set_name(file, path.data(), path.size());
+    struct stat st;
+    errno = 0;
+    int ret = lstat(path.c_str(), &st);
+    if (ret != 0) {
+        LOG("lstat(%s) failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    size_t size;
+    file.type_ = stat_to_type(st, &size);
+    file.size_ = size;
+    set_stamp(0, make_stamp(st));
+    NodeCounts counts;
+    counts.apparent_ = st.st_size;
+    set_counts(0, counts);
+    filter_->reset(st);
+    return true;
+}
+
+NodeId FileTree::add_subs(NodeId id, const DirListing &listing)
+{
+    size_t nsubs = listing.entries_.size();
+    OpTimer timer(stats_, ScanStats::OP_ALLOC, nsubs);
+    bool sorted = listing.sorted();
+    std::lock_guard<std::mutex> lock(mutex_);
+    sorted_ = sorted_ && sorted;
+    if (!spilled_.empty()) {
+        spilled_.erase(id);
+    }
+    NodeId first = append_nodes(nsubs);
+    FileInfo &file = nodes_[id];
+    file.first_sub_ = first;
+    file.nsubs_ = nsubs;
+    for (size_t i = 0; i < nsubs; i++) {
+        const DirListing::Entry &entry = listing.entries_[i];
+        FileInfo &sub = nodes_[first + i];
+        sub.size_ = entry.size_;
+        sub.type_ = entry.type_;
+        sub.parent_ = id;
+        set_name(sub, listing.name(entry), entry.name_len_);
+        put_stamp(first + i, entry.stamp_);
+        if (counted_) {
+            apparent_[first + i] = entry.apparent_;
+        }
+    }
+    return first;
+}
+
+unsigned FileTree::walk_features() const
+{
+    return filter_->features() | (breakdown_by_ ? WALK_TALLY : 0) | (spill_.after_ > 0 ? WALK_SPILL : 0)
+        | (throttle_->enabled() ? WALK_THROTTLE : 0);
+}
+
+void FileTree::specialize()
+{
+    lister_ = list_dir_for(walk_features());
+}
+
+void FileTree::walk(ScanBackend &backend, int depth)
+{
+    const FileInfo &file = root();
+    if (file.type_ != FILE_TYPE_DIRECTORY)
+        return;
+    specialize();
+    std::string path = name_str(file);
+    Breakdown::Tally tally(breakdown_by_);
+    NodeCounts below = counts(0);
+    if (checkpoint_) {
+        pending_.insert(0);
+    }
+    walk_at(backend, open_dir(AT_FDCWD, path.c_str(), backend.stats()), path, 0, depth, &below, &tally);
+    set_counts(0, below);
+    tally.flush(breakdown_);
+}
+
+void FileTree::resume(ScanBackend &backend, int depth)
+{
+    const FileInfo &file = root();
+    if (file.type_ != FILE_TYPE_DIRECTORY || !pending(0))
+        return;
+    specialize();
+    std::string path = name_str(file);
+    Breakdown::Tally tally(breakdown_by_);
+    NodeCounts below = counts(0);
+    resume_at(backend, open_dir(AT_FDCWD, path.c_str(), backend.stats()), path, 0, depth, &below, &tally);
+    set_counts(0, below);
+    tally.flush(breakdown_);
+}
+
+size_t FileTree::walk_at(ScanBackend &backend, int fd, const std::string &path, NodeId id, int depth,
+        NodeCounts *below, Breakdown::Tally *tally)
+{
+    DirListing listing;
+    listing.spill_ = spill_;
+    DirStream *stream = lister_(backend, fd, path, listing, filter_.get(), tally, throttle_.get());
+    if (id != NO_NODE && (!stream || depth <= 0)) {
+        set_stamp(id, DirStamp());
+    }
+    if (!stream) {
+        if (checkpoint_ && id != NO_NODE) {
+            pending_.erase(id);
+        }
+        return 0;
+    }
+    NodeId first = NO_NODE;
+    if (id != NO_NODE && depth > 0) {
+        first = add_subs(id, listing);
+    }
+    bool checkpointed = checkpoint_ && first != NO_NODE;
+    if (checkpointed) {
+        for (size_t i = 0; i < listing.entries_.size(); i++) {
+            if (listing.entries_[i].type_ == FILE_TYPE_DIRECTORY) {
+                pending_.insert(first + i);
+            }
+        }
+    }
+    bool summarize = summarize_ && id != NO_NODE && depth <= 0;
+    DirSummary summary;
+    NodeCounts counts;
+    size_t sub_size = 0;
+    for (size_t i = 0; i < listing.entries_.size(); i++) {
+        const DirListing::Entry &entry = listing.entries_[i];
+        const char *name = listing.name(entry);
+        size_t size = entry.size_;
+        NodeCounts sub;
+        sub.apparent_ = entry.apparent_;
+        if (entry.type_ == FILE_TYPE_DIRECTORY) {
+            NodeId sub_id = (first != NO_NODE) ? first + i : NO_NODE;
+            size += walk_at(backend, open_dir(stream->fd(), name, backend.stats()), join_path(path, name), sub_id,
+                    depth - 1,
+                    &sub, tally);
+            if (sub_id != NO_NODE) {
+                set_counts(sub_id, sub);
+            }
+            if (checkpointed && checkpoint_->due()) {
+                checkpoint_->save(*this, tally);
+            }
+            counts.dirs_++;
+        }
+        else {
+            counts.files_++;
+        }
+        counts.add(sub);
+        if (summarize) {
+            summary.offer(name, entry.name_len_, size);
+        }
+        sub_size += size;
+    }
+    const SpilledFiles *spilled = listing.spilled_.get();
+    if (spilled) {
+        counts.files_ += spilled->count();
+        counts.apparent_ += spilled->apparent();
+        if (summarize) {
+            summary.offer(spilled->largest().data(), spilled->largest().size(), spilled->largest_size());
+        }
+        sub_size += spilled->size();
+        if (first != NO_NODE) {
+            set_spilled(id, listing.spilled_.release());
+        }
+    }
+    if (summarize) {
+        summary.entries_ = counts.files_ + counts.dirs_;
+        set_summary(id, summary);
+    }
+    delete stream;
+    if (below) {
+        below->add(counts);
+    }
+    if (id != NO_NODE) {
+        node(id).size_ += sub_size;
+        if (checkpoint_) {
+            pending_.erase(id);
+        }
+    }
+    return sub_size;
+}
+
+size_t FileTree::resume_at(ScanBackend &backend, int fd, const std::string &path, NodeId id, int depth,
+        NodeCounts *below, Breakdown::Tally *tally)
+{
+    if (node(id).nsubs_ == 0) {
+        return walk_at(backend, fd, path, id, depth, below, tally);
+    }
+    NodeCounts counts;
+    size_t sub_size = 0;
+    for (uint32_t i = 0; i < node(id).nsubs_; i++) {
+        NodeId sub_id = node(id).first_sub_ + i;
+        NodeCounts sub = this->counts(sub_id);
+        if (node(sub_id).type_ == FILE_TYPE_DIRECTORY) {
+            if (pending(sub_id)) {
+                std::string name = name_str(node(sub_id));
+                resume_at(backend, open_dir(fd, name.c_str(), backend.stats()), join_path(path, name), sub_id,
+                        depth - 1,
+                        &sub, tally);
+                set_counts(sub_id, sub);
+                if (checkpoint_ && checkpoint_->due()) {
+                    checkpoint_->save(*this, tally);
+                }
+            }
+            counts.dirs_++;
+        }
+        else {
+            counts.files_++;
+        }
+        counts.add(sub);
+        sub_size += node(sub_id).size_;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (below) {
+        below->add(counts);
+    }
+    node(id).size_ += sub_size;
+    pending_.erase(id);
+    return sub_size;
+}
+
+bool FileTree::from_json(const std::string &file_path)
+{
+    FILE *fp = open_json(file_path);
+    if (!fp) {
+        LOG("cannot open file %s", file_path.c_str());
+        return false;
+    }
+    const size_t BUF_SIZE = 1024 * 256;
+    std::vector<char> buf(BUF_SIZE);
+    rapidjson::FileReadStream fs(fp, buf.data(), BUF_SIZE);
+    clear();
+    JsonHandler handler(*this, file_path);
+    rapidjson::Reader reader;
+    rapidjson::ParseResult result = reader.Parse(fs, handler);
+    fclose(fp);
+    if (result.IsError()) {
+        if (!handler.failed_) {
+            LOG("failed to parse json from %s, error at %zu: %s",
+                    file_path.c_str(),
+                    result.Offset(),
+                    rapidjson::GetParseError_En(result.Code())
+                    );
+        }
+        clear();
+        return false;
+    }
+    return true;
+}
+
+// Work-stealing directory walker used by `stat -j N`.
+//
+// Every directory is a task.  A worker takes tasks from the back of its own
+// deque and steals from the front of the others, so a thread keeps digging
+// into its own subtree while idle threads pick up the big, shallow ones.
+//
+// Reading a directory spawns one task per sub directory.  A task's pending_
+// counts itself plus its unfinished children; whoever drops it to zero adds
+// the accumulated child sizes and passes the total on to the parent.  The
+// sub files of a directory are added to the tree by the single thread
+// reading it, in readdir order, so the resulting tree is the same as the
+// serial walk's.
+class ParallelWalker
+{
+public:
+    ParallelWalker(FileTree &tree, const char *backend_name, size_t njobs)
+    : tree_(tree)
+    , backend_name_(backend_name)
+    , workers_(njobs)
+    , done_(false)
+    {}
+
+    void walk(int depth)
+    {
+        const FileInfo &root = tree_.root();
+        if (root.type_ != FILE_TYPE_DIRECTORY)
+            return;
+        done_ = false;
+        tree_.throttle().start(workers_.size());
+        workers_.push(0, new Task(0, tree_.name_str(root), root.size_, tree_.counts(0).apparent_, NULL, depth));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers_.size(); i++) {
+            threads.push_back(std::thread(&ParallelWalker::run, this, i));
+        }
+        run(0);
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        ScanThrottle &throttle = tree_.throttle();
+        if (throttle.adaptive()) {
+            LOG("adaptive: ended with %zu of %zu workers, p99 %.3f ms per entry",
+                    std::min(throttle.workers(), workers_.size()), workers_.size(), throttle.latency_ns() / 1e6);
+        }
+    }
+
+private:
+    struct Task
+    {
+        NodeId id_;             // NO_NODE if the directory is below the kept depth
+        std::string path_;
+        size_t size_;           // the directory's own blocks
+        uint64_t apparent_;     // and st_size
+        Task *parent_;
+        int depth_;
+        std::atomic<size_t> pending_;
+        std::atomic<size_t> sub_size_;
+        std::atomic<uint64_t> sub_apparent_;
+        std::atomic<uint64_t> entries_;     // below the directory
+        std::atomic<uint64_t> dirs_;        // among them
+        std::mutex mutex_;                  // for the rest, only used with --summary
+        DirSummary summary_;
+        std::string largest_;
+
+        Task(NodeId id, const std::string &path, size_t size, uint64_t apparent, Task *parent, int depth)
+        : id_(id)
+        , path_(path)
+        , size_(size)
+        , apparent_(apparent)
+        , parent_(parent)
+        , depth_(depth)
+        , pending_(1)
+        , sub_size_(0)
+        , sub_apparent_(0)
+        , entries_(0)
+        , dirs_(0)
+        {}
+
+        void offer(const char *name, size_t len, uint64_t size)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            DirSummary summary = summary_;
+            summary.offer(name, len, size);
+            if (summary.largest_ == name) {
+                largest_.assign(name, len);
+                summary_.largest_ = largest_.data();
+                summary_.largest_len_ = len;
+                summary_.largest_size_ = size;
+            }
+        }
+    };
+
+    bool summarized(const Task *task) const
+    {
+        return tree_.summarize() && task->id_ != NO_NODE && task->depth_ <= 0;
+    }
+
+    void run(size_t self)
+    {
+        ScanBackend *backend = ScanBackend::create(backend_name_, tree_.stats());
+        DirListing listing;
+        listing.spill_ = tree_.spill();
+        Breakdown::Tally tally(tree_.breakdown_by());
+        IdleBackoff backoff;
+        while (!done_) {
+            if (!tree_.throttle().active(self)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            Task *task = workers_.pop(self);
+            if (!task) {
+                backoff.wait();
+                continue;
+            }
+            backoff.reset();
+            read_dir(self, *backend, task, listing, tally);
+            finish(task);
+        }
+        tree_.add_breakdown(tally);
+        delete backend;
+    }
+
+    void read_dir(size_t self, ScanBackend &backend, Task *task, DirListing &listing, Breakdown::Tally &tally)
+    {
+        int fd = open_dir(AT_FDCWD, task->path_.c_str(), backend.stats());
+        DirStream *stream = tree_.lister()(backend, fd, task->path_, listing, &tree_.filter(), &tally,
+                &tree_.throttle());
+        if (task->id_ != NO_NODE && (!stream || task->depth_ <= 0)) {
+            tree_.set_stamp(task->id_, DirStamp());
+        }
+        if (!stream) {
+            return;
+        }
+        delete stream;
+        NodeId first = NO_NODE;
+        if (task->id_ != NO_NODE && task->depth_ > 0) {
+            first = tree_.add_subs(task->id_, listing);
+        }
+        bool summarize = summarized(task);
+        size_t sub_size = 0;
+        uint64_t sub_apparent = 0;
+        uint64_t ndirs = 0;
+        for (size_t i = 0; i < listing.entries_.size(); i++) {
+            const DirListing::Entry &entry = listing.entries_[i];
+            if (entry.type_ == FILE_TYPE_DIRECTORY) {
+                NodeId sub_id = (first != NO_NODE) ? first + i : NO_NODE;
+                task->pending_++;
+                ndirs++;
+                workers_.push(self, new Task(sub_id, join_path(task->path_, listing.name(entry)),
+                            entry.size_, entry.apparent_, task, task->depth_ - 1));
+            }
+            else {
+                sub_size += entry.size_;
+                sub_apparent += entry.apparent_;
+                if (summarize) {
+                    task->offer(listing.name(entry), entry.name_len_, entry.size_);
+                }
+            }
+        }
+        uint64_t nentries = listing.entries_.size();
+        const SpilledFiles *spilled = listing.spilled_.get();
+        if (spilled) {
+            sub_size += spilled->size();
+            sub_apparent += spilled->apparent();
+            nentries += spilled->count();
+            if (summarize) {
+                task->offer(spilled->largest().data(), spilled->largest().size(), spilled->largest_size());
+            }
+            if (first != NO_NODE) {
+                tree_.set_spilled(task->id_, listing.spilled_.release());
+            }
+        }
+        task->sub_size_ += sub_size;
+        task->sub_apparent_ += sub_apparent;
+        task->entries_ += nentries;
+        task->dirs_ += ndirs;
+    }
+
+    void finish(Task *task)
+    {
+        while (task) {
+            if (--task->pending_ != 0)
+                return;
+            size_t size = task->size_ + task->sub_size_;
+            NodeCounts counts;
+            counts.apparent_ = task->apparent_ + task->sub_apparent_;
+            counts.dirs_ = task->dirs_;
+            counts.files_ = task->entries_ - counts.dirs_;
+            if (task->id_ != NO_NODE) {
+                tree_.node(task->id_).size_ = size;
+                tree_.set_counts(task->id_, counts);
+            }
+            if (summarized(task)) {
+                task->summary_.entries_ = task->entries_;
+                tree_.set_summary(task->id_, task->summary_);
+            }
+            Task *parent = task->parent_;
+            if (parent) {
+                parent->sub_size_ += size;
+                parent->sub_apparent_ += counts.apparent_;
+                parent->entries_ += task->entries_;
+                parent->dirs_ += task->dirs_;
+                if (summarized(parent)) {
+                    const std::string &path = task->path_;
+                    size_t name = path.rfind(SEP) + 1;
+                    parent->offer(path.data() + name, path.size() - name, size);
+                }
+            }
+            else {
+                done_ = true;
+            }
+            delete task;
+            task = parent;
+        }
+    }
+
+    FileTree &tree_;
+    const char *backend_name_;
+    WorkQueues<Task> workers_;
+    std::atomic<bool> done_;
+};
+
+void FileTree::walk_parallel(const char *backend_name, int depth, size_t njobs)
+{
+    if (njobs <= 1) {
+        ScanBackend *backend = ScanBackend::create(backend_name, stats_);
+        walk(*backend, depth);
+        delete backend;
+        return;
+    }
+    specialize();
+    ParallelWalker walker(*this, backend_name, njobs);
+    walker.walk(depth);
+}
+
+size_t varint_size(uint64_t value)
+{
+    size_t n = 1;
+    for (; value >= 0x80; value >>= 7) {
+        n++;
+    }
+    return n;
+}
+
+void put_varint(FILE *fp, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7) {
+        putc((value & 0x7f) | 0x80, fp);
+    }
+    putc(value, fp);
+}
+
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        result |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+bool is_binary_snapshot(const std::string &file_path)
+{
+    FILE *fp = fopen(file_path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    char magic[sizeof(BINARY_MAGIC)];
+    bool ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+        && 0 == memcmp(magic, BINARY_MAGIC, sizeof(magic));
+    fclose(fp);
+    return ret;
+}
+
+BinarySnapshot::~BinarySnapshot()
+{
+    if (data_) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
+
+bool BinarySnapshot::open(const std::string &file_path)
+{
+    int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG("cannot open file %s", file_path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)offsetof(BinaryHeader, generation_)) {
+        LOG("%s is not a binary snapshot", file_path.c_str());
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG("cannot mmap %s: %s", file_path.c_str(), strerror(errno));
+        return false;
+    }
+    data_ = static_cast<const uint8_t *>(data);
+    size_ = st.st_size;
+    madvise(data, size_, MADV_SEQUENTIAL);
+
+    memset(&header_, 0, sizeof(header_));
+    memcpy(&header_, data_, offsetof(BinaryHeader, generation_));
+    const BinaryHeader &h = header_;
+    if (h.version_ >= 2 && h.strings_ >= sizeof(h) && size_ >= sizeof(h)) {
+        memcpy(&header_, data_, sizeof(header_));
+    }
+    if (0 != memcmp(h.magic_, BINARY_MAGIC, sizeof(BINARY_MAGIC))
+            || h.version_ < 1 || h.version_ > BINARY_VERSION
+            || h.file_size_ != size_
+            || h.strings_ > size_ || h.offsets_ > size_ || h.nodes_ >= size_
+            || h.offsets_ % sizeof(uint64_t) != 0
+            || (size_ - h.offsets_) / sizeof(uint64_t) < h.nstrings_) {
+        LOG("%s is not a binary snapshot of version %u", file_path.c_str(), BINARY_VERSION);
+        return false;
+    }
+    offsets_ = reinterpret_cast<const uint64_t *>(data_ + h.offsets_);
+    if (!check_nodes()) {
+        LOG("%s: corrupt nodes in binary snapshot", file_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool BinarySnapshot::breakdown(Breakdown *breakdown) const
+{
+    breakdown->clear();
+    if (!(header_.flags_ & BINARY_BREAKDOWN)) {
+        return false;
+    }
+    Node node = root();
+    const uint8_t *end = data_ + size_;
+    const uint8_t *p = node.subs_ + std::min(node.subs_size_, uint64_t(end - node.subs_));
+    if (!breakdown->decode(p, end)) {
+        LOG("WARN: %s", "truncated breakdown in binary snapshot");
+    }
+    return !breakdown->empty();
+}
+
+bool BinarySnapshot::check_nodes() const
+{
+    struct Range
+    {
+        const uint8_t *next_;
+        const uint8_t *end_;
+        uint64_t left_;     // sub files still to come
+    };
+    Node node;
+    if (!decode(data_ + header_.nodes_, data_ + size_, &node)) {
+        return false;
+    }
+    uint64_t nnodes = 1;
+    std::vector<Range> ranges;
+    Range root = {node.subs_, node.subs_ + node.subs_size_, node.nsubs_};
+    ranges.push_back(root);
+    while (!ranges.empty()) {
+        Range &range = ranges.back();
+        if (range.left_ == 0) {
+            if (range.next_ != range.end_) {
+                return false;
+            }
+            ranges.pop_back();
+            continue;
+        }
+        if (!decode(range.next_, range.end_, &node)) {
+            return false;
+        }
+        range.left_--;
+        range.next_ = node.subs_ + node.subs_size_;
+        nnodes++;
+        Range subs = {node.subs_, node.subs_ + node.subs_size_, node.nsubs_};
+        ranges.push_back(subs);
+    }
+    return nnodes == header_.nnodes_;
+}
+
+bool Snapshot::load(const std::string &file_path, bool stream)
+{
+    file_path_ = file_path;
+    is_binary_ = is_binary_snapshot(file_path);
+    if (is_binary_) {
+        return binary_.open(file_path);
+    }
+    stream_ = stream;
+    if (stream_) {
+        return true;
+    }
+    double start = now_sec();
+    if (!tree_.from_json(file_path)) {
+        return false;
+    }
+    LOG("loaded %zu nodes in %.3f s, max rss %s", tree_.size(), now_sec() - start, r_sz(max_rss()));
+    return true;
+}
+
+bool Snapshot::breakdown(Breakdown *breakdown) const
+{
+    if (is_binary_) {
+        return binary_.breakdown(breakdown);
+    }
+    if (!stream_) {
+        return FileTreeView(tree_).breakdown(breakdown);
+    }
+    JsonCursor cursor;
+    DiffEntry root;
+    if (!cursor.open(file_path_) || !cursor.next(root)) {
+        return false;
+    }
+    *breakdown = cursor.breakdown();
+    return !breakdown->empty();
+}
+
+void report_diff(const DiffCallback &callback, DiffRecord::Kind kind, const std::string &path,
+        uint64_t old_size, uint64_t new_size)
+{
+    DiffRecord record;
+    record.kind_ = kind;
+    record.path_ = path.c_str();
+    record.path_len_ = path.size();
+    record.old_size_ = old_size;
+    record.new_size_ = new_size;
+    callback(record);
+}
+
+void diff_summaries(const DirSummary &summary, const std::string &largest,
+        const DirSummary &older, const std::string &older_largest, std::string &path,
+        const DiffCallback &callback)
+{
+    size_t len = path.size();
+    if (summary.largest_) {
+        push_path(path, largest.data(), largest.size());
+        if (older.largest_ && largest == older_largest && summary.largest_size_ > older.largest_size_) {
+            report_diff(callback, DiffRecord::LARGEST_GREW, path, older.largest_size_, summary.largest_size_);
+        }
+        else if (!older.largest_ || largest != older_largest) {
+            report_diff(callback, DiffRecord::LARGEST_NEW, path, 0, summary.largest_size_);
+        }
+        path.resize(len);
+    }
+    if (summary.entries_ != older.entries_) {
+        report_diff(callback, DiffRecord::ENTRIES, path, older.entries_, summary.entries_);
+    }
+}
+
+template <typename NewView>
+bool diff_parallel(const NewView &new_view, const Snapshot &older, const DiffCallback &callback, size_t njobs)
+{
+    if (older.is_binary_) {
+        ParallelDiff<NewView, BinarySnapshot> diff(new_view, older.binary_, njobs);
+        return diff.diff(callback);
+    }
+    FileTreeView old_view(older.tree_);
+    ParallelDiff<NewView, FileTreeView> diff(new_view, old_view, njobs);
+    return diff.diff(callback);
+}
+
+// diff_snapshots() but for the breakdowns
+bool diff_snapshot_nodes(const Snapshot &newer, const Snapshot &older, const DiffCallback &callback,
+        size_t njobs)
+{
+    if (njobs > 1 && !newer.stream_ && !older.stream_) {
+        if (newer.is_binary_) {
+            return diff_parallel(newer.binary_, older, callback, njobs);
+        }
+        return diff_parallel(FileTreeView(newer.tree_), older, callback, njobs);
+    }
+    if (newer.is_binary_) {
+        ViewCursor<BinarySnapshot> new_cursor(newer.binary_);
+        return diff_to_older(new_cursor, older, callback);
+    }
+    if (newer.stream_) {
+        JsonCursor new_cursor;
+        return new_cursor.open(newer.file_path_) && diff_to_older(new_cursor, older, callback);
+    }
+    FileTreeView new_view(newer.tree_);
+    ViewCursor<FileTreeView> new_cursor(new_view);
+    return diff_to_older(new_cursor, older, callback);
+}
+
+bool diff_snapshots(const Snapshot &newer, const Snapshot &older, const DiffCallback &callback,
+        size_t njobs)
+{
+    if (!diff_snapshot_nodes(newer, older, callback, njobs)) {
+        return false;
+    }
+    Breakdown new_breakdown, old_breakdown;
+    newer.breakdown(&new_breakdown);
+    older.breakdown(&old_breakdown);
+    diff_breakdowns(new_breakdown, old_breakdown, callback);
+    return true;
+}
+
+template <typename View>
+bool diff_tree_views(const View &new_view, const View &old_view, const DiffCallback &callback, size_t njobs)
+{
+    if (njobs > 1) {
+        ParallelDiff<View, View> diff(new_view, old_view, njobs);
+        return diff.diff(callback);
+    }
+    ViewCursor<View> new_cursor(new_view), old_cursor(old_view);
+    return diff_cursors(new_cursor, old_cursor, callback);
+}
+
+bool diff_trees(const FileTree &newer, const FileTree &older, const DiffCallback &callback,
+        size_t njobs)
+{
+    bool ok;
+    if (newer.sorted() && older.sorted()) {
+        ok = diff_tree_views(FileTreeView(newer), FileTreeView(older), callback, njobs);
+    }
+    else {
+        ok = diff_tree_views(SortedTreeView(newer), SortedTreeView(older), callback, njobs);
+    }
+    if (ok) {
+        diff_breakdowns(newer.breakdown(), older.breakdown(), callback);
+    }
+    return ok;
+}
+
+bool SnapshotCache::version(const std::string &file_path, std::string *version)
+{
+    struct stat st;
+    if (stat(file_path.c_str(), &st) != 0) {
+        LOG("cannot stat %s: %s", file_path.c_str(), strerror(errno));
+        return false;
+    }
+    char buf[96];
+    snprintf(buf, sizeof(buf), "@%llu.%09ld:%llu:%llu", (unsigned long long)st.st_mtim.tv_sec,
+            st.st_mtim.tv_nsec, (unsigned long long)st.st_size, (unsigned long long)st.st_ino);
+    *version = file_path + buf;
+    return true;
+}
+
+std::shared_ptr<const Snapshot> SnapshotCache::get(const std::string &file_path, std::string *version)
+{
+    if (!SnapshotCache::version(file_path, version)) {
+        return std::shared_ptr<const Snapshot>();
+    }
+    Entry *entry = snapshots_.find(file_path);
+    if (entry && entry->version_ == *version) {
+        return entry->snapshot_;
+    }
+    std::shared_ptr<Snapshot> snapshot(new Snapshot);
+    if (!snapshot->load(file_path)) {
+        LOG("failed to load %s", file_path.c_str());
+        snapshots_.erase(file_path);
+        return std::shared_ptr<const Snapshot>();
+    }
+    Entry loaded;
+    loaded.version_ = *version;
+    loaded.snapshot_ = snapshot;
+    return snapshots_.insert(file_path, loaded).snapshot_;
+}
+
+// A shard being merged, read as a stream whatever its format; see
+// merge_shards().
+class ShardReader
+{
+public:
+    virtual ~ShardReader() {}
+    virtual bool open(const std::string &file_path) = 0;
+    virtual bool next(DiffEntry &entry) = 0;
+    virtual void enter() = 0;
+    virtual bool failed() const = 0;
+    // That of the root, once read.
+    virtual bool breakdown(Breakdown *breakdown) const = 0;
+};
+
+class BinaryShardReader : public ShardReader
+{
+public:
+    virtual bool open(const std::string &file_path)
+    {
+        if (!snapshot_.open(file_path)) {
+            return false;
+        }
+        cursor_.reset(new ViewCursor<BinarySnapshot>(snapshot_));
+        return true;
+    }
+
+    virtual bool next(DiffEntry &entry) { return cursor_->next(entry); }
+    virtual void enter() { cursor_->enter(); }
+    virtual bool failed() const { return false; }
+    virtual bool breakdown(Breakdown *breakdown) const { return snapshot_.breakdown(breakdown); }
+
+private:
+    BinarySnapshot snapshot_;
+    std::unique_ptr<ViewCursor<BinarySnapshot> > cursor_;
+};
+
+class JsonShardReader : public ShardReader
+{
+public:
+    virtual bool open(const std::string &file_path) { return cursor_.open(file_path); }
+    virtual bool next(DiffEntry &entry) { return cursor_.next(entry); }
+    virtual void enter() { cursor_.enter(); }
+    virtual bool failed() const { return cursor_.failed(); }
+
+    virtual bool breakdown(Breakdown *breakdown) const
+    {
+        *breakdown = cursor_.breakdown();
+        return !breakdown->empty();
+    }
+
+private:
+    JsonCursor cursor_;
+};
+
+// Copies entry, just read from reader, and its sub files.
+template <typename Writer>
+void copy_shard_node(ShardReader &reader, const DiffEntry &entry, Writer &writer)
+{
+    writer.StartObject();
+    write_json_members(writer, entry, false, 0, false, 0, NULL, false);
+    if (entry.type_ == FILE_TYPE_DIRECTORY) {
+        reader.enter();
+        DiffEntry sub;
+        if (reader.next(sub)) {
+            writer.Key("subs");
+            writer.StartArray();
+            do {
+                copy_shard_node(reader, sub, writer);
+            } while (reader.next(sub));
+            writer.EndArray();
+        }
+    }
+    writer.EndObject();
+}
+
+template <typename Writer>
+bool merge_shard_readers(const std::vector<std::string> &shards, std::vector<ShardReader *> &readers,
+        Writer &writer)
+{
+    size_t n = readers.size();
+    std::vector<DiffEntry> heads(n);
+    DiffEntry root;
+    std::string root_name;
+    Breakdown breakdown;
+    for (size_t i = 0; i < n; i++) {
+        DiffEntry &head = heads[i];
+        if (!readers[i]->next(head)) {
+            LOG("cannot read the root of %s", shards[i].c_str());
+            return false;
+        }
+        if (head.type_ != FILE_TYPE_DIRECTORY) {
+            LOG("%s is not of a directory", shards[i].c_str());
+            return false;
+        }
+        if (i == 0) {
+            root = head;
+            root_name.assign(head.name_, head.name_len_);
+            root.summarized_ = false;
+        }
+        else if (FileTree::compare_names(head.name_, head.name_len_, root_name.data(), root_name.size()) != 0) {
+            LOG("%s is of %.*s, not %s", shards[i].c_str(), int(head.name_len_), head.name_, root_name.c_str());
+            return false;
+        }
+        else {
+            root.size_ += head.size_;
+            root.counted_ = root.counted_ && head.counted_;
+            root.counts_.add(head.counts_);
+            if (!root.stamp_.valid()) {
+                root.stamp_ = head.stamp_;
+            }
+        }
+        Breakdown shard;
+        if (readers[i]->breakdown(&shard)) {
+            for (int d = 0; d < Breakdown::NDIMENSIONS; d++) {
+                const Breakdown::Table &table = shard.table(d);
+                for (Breakdown::Table::const_iterator it = table.begin(); it != table.end(); ++it) {
+                    breakdown.add(d, it->first, it->second);
+                }
+            }
+        }
+    }
+    root.name_ = root_name.data();
+    root.name_len_ = root_name.size();
+    writer.StartObject();
+    write_json_members(writer, root, true, SNAPSHOT_VERSION, true, 0, breakdown.empty() ? NULL : &breakdown, false);
+
+    // the number of shards is small, so the least head is looked for in
+    // turn rather than kept in a heap
+    std::vector<bool> has(n);
+    for (size_t i = 0; i < n; i++) {
+        readers[i]->enter();
+        has[i] = readers[i]->next(heads[i]);
+    }
+    bool started = false;
+    for (;;) {
+        size_t least = n;
+        for (size_t i = 0; i < n; i++) {
+            if (!has[i]) {
+                continue;
+            }
+            int cmp = (least == n) ? -1 : FileTree::compare_names(heads[i].name_, heads[i].name_len_,
+                    heads[least].name_, heads[least].name_len_);
+            if (cmp == 0) {
+                LOG("%s and %s both have %.*s", shards[least].c_str(), shards[i].c_str(),
+                        int(heads[i].name_len_), heads[i].name_);
+                return false;
+            }
+            if (cmp < 0) {
+                least = i;
+            }
+        }
+        if (least == n) {
+            break;
+        }
+        if (!started) {
+            writer.Key("subs");
+            writer.StartArray();
+            started = true;
+        }
+        copy_shard_node(*readers[least], heads[least], writer);
+        has[least] = readers[least]->next(heads[least]);
+    }
+    if (started) {
+        writer.EndArray();
+    }
+    writer.EndObject();
+    for (size_t i = 0; i < n; i++) {
+        if (readers[i]->failed()) {
+            LOG("failed to read %s", shards[i].c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool merge_shards(const std::vector<std::string> &shards, const std::string &file_path, const JsonOptions &json)
+{
+    std::vector<ShardReader *> readers;
+    bool ok = true;
+    for (size_t i = 0; ok && i < shards.size(); i++) {
+        if (is_binary_snapshot(shards[i])) {
+            readers.push_back(new BinaryShardReader());
+        }
+        else {
+            readers.push_back(new JsonShardReader());
+        }
+        ok = readers.back()->open(shards[i]);
+    }
+    FILE *fp = ok ? open_compressed(file_path, json.compression_) : NULL;
+    if (ok && !fp) {
+        LOG("cannot open file %s", file_path.c_str());
+        ok = false;
+    }
+    if (ok) {
+        const size_t BUF_SIZE = 1024 * 256;
+        std::vector<char> buf(BUF_SIZE);
+        FileWriteStream fs(fp, buf.data(), BUF_SIZE);
+        if (json.compact_) {
+            Writer<FileWriteStream> writer(fs);
+            ok = merge_shard_readers(shards, readers, writer);
+        }
+        else {
+            PrettyWriter<FileWriteStream> writer(fs);
+            writer.SetIndent(' ', 1);
+            ok = merge_shard_readers(shards, readers, writer);
+        }
+        if (fclose(fp) != 0) {
+            LOG("cannot write %s: %s", file_path.c_str(), strerror(errno));
+            ok = false;
+        }
+        if (!ok) {
+            unlink(file_path.c_str());
+        }
+    }
+    for (size_t i = 0; i < readers.size(); i++) {
+        delete readers[i];
+    }
+    return ok;
+}
+
+void diff_breakdowns(const Breakdown &newer, const Breakdown &older, const DiffCallback &callback)
+{
+    std::string path;
+    for (int d = 0; d < Breakdown::NDIMENSIONS; d++) {
+        const Breakdown::Table &new_table = newer.table(d);
+        const Breakdown::Table &old_table = older.table(d);
+        if (new_table.empty() || old_table.empty()) {
+            continue;
+        }
+        Breakdown::Table::const_iterator n = new_table.begin(), o = old_table.begin();
+        while (n != new_table.end() || o != old_table.end()) {
+            // a key missing on one side has size 0 there
+            bool in_new = (n != new_table.end() && (o == old_table.end() || n->first <= o->first));
+            bool in_old = (o != old_table.end() && (n == new_table.end() || o->first <= n->first));
+            const std::string &key = in_new ? n->first : o->first;
+            uint64_t new_size = in_new ? n->second.size_ : 0;
+            uint64_t old_size = in_old ? o->second.size_ : 0;
+            if (new_size != old_size) {
+                path.assign(Breakdown::dimension_name(d));
+                path += ':';
+                path += key;
+                report_diff(callback, DiffRecord::BREAKDOWN, path, old_size, new_size);
+            }
+            if (in_new) {
+                ++n;
+            }
+            if (in_old) {
+                ++o;
+            }
+        }
+    }
+}
+
+bool TopDiffs::parse_rank(const char *name, Rank *rank)
+{
+    if (0 == strcmp(name, "bytes")) {
+        *rank = RANK_BYTES;
+    }
+    else if (0 == strcmp(name, "files")) {
+        *rank = RANK_FILES;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+void TopDiffs::offer(const DiffRecord &record)
+{
+    if (rank_ == RANK_FILES) {
+        if (record.kind_ != DiffRecord::FILES) {
+            return;
+        }
+    }
+    else if (record.kind_ != DiffRecord::GREW && record.kind_ != DiffRecord::ADDED
+            && record.kind_ != DiffRecord::LARGEST_GREW) {
+        return;
+    }
+    uint64_t delta = record.new_size_ - record.old_size_;
+    if (heap_.size() == n_) {
+        if (delta <= heap_.front().delta_) {
+            return;
+        }
+        // the entry of the least growth is reused, with its path buffer
+        std::pop_heap(heap_.begin(), heap_.end(), after);
+    }
+    else {
+        heap_.push_back(Entry());
+    }
+    Entry &entry = heap_.back();
+    entry.delta_ = delta;
+    entry.kind_ = record.kind_;
+    entry.old_size_ = record.old_size_;
+    entry.new_size_ = record.new_size_;
+    entry.path_.assign(record.path_, record.path_len_);
+    std::push_heap(heap_.begin(), heap_.end(), after);
+}
+
+void TopDiffs::report(const DiffCallback &callback) const
+{
+    std::vector<const Entry *> sorted(heap_.size());
+    for (size_t i = 0; i < heap_.size(); i++) {
+        sorted[i] = &heap_[i];
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Entry *a, const Entry *b) {
+        return after(*a, *b);
+    });
+    for (size_t i = 0; i < sorted.size(); i++) {
+        report_diff(callback, sorted[i]->kind_, sorted[i]->path_, sorted[i]->old_size_, sorted[i]->new_size_);
+    }
+}
+
+bool DiffWriter::parse_format(const char *name, Format *format)
+{
+    if (0 == strcmp(name, "tsv")) {
+        *format = FORMAT_TSV;
+    }
+    else if (0 == strcmp(name, "json")) {
+        *format = FORMAT_JSON;
+    }
+    else if (0 == strcmp(name, "ndjson")) {
+        *format = FORMAT_NDJSON;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+const char *DiffWriter::kind_name(DiffRecord::Kind kind)
+{
+    switch (kind) {
+    case DiffRecord::GREW:
+        return "grew";
+    case DiffRecord::ADDED:
+        return "added";
+    case DiffRecord::REMOVED:
+        return "removed";
+    case DiffRecord::LARGEST_GREW:
+        return "largest_grew";
+    case DiffRecord::LARGEST_NEW:
+        return "largest_new";
+    case DiffRecord::ENTRIES:
+        return "entries";
+    case DiffRecord::FILES:
+        return "files";
+    case DiffRecord::BREAKDOWN:
+        return "breakdown";
+    }
+    return "unknown";
+}
+
+DiffWriter::DiffWriter(FILE *fp, Format format)
+: fp_(fp)
+, format_(format)
+, buf_(1024 * 256)
+, used_(0)
+, count_(0)
+, finished_(false)
+, failed_(false)
+{}
+
+void DiffWriter::write(const DiffRecord &record)
+{
+    const char *kind = kind_name(record.kind_);
+    size_t kind_len = strlen(kind);
+    int64_t delta = (int64_t)(record.new_size_ - record.old_size_);
+    // an escaped byte takes at most 6, a number at most 20
+    const size_t NUMBERS = 3 * 21;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (format_ == FORMAT_TSV) {
+        reserve(kind_len + record.path_len_ * 2 + NUMBERS + 5);
+        put(kind, kind_len);
+        put('\t');
+        put_path(record.path_, record.path_len_);
+        put('\t');
+        put_uint(record.old_size_);
+        put('\t');
+        put_uint(record.new_size_);
+        put('\t');
+        put_int(delta);
+        put('\n');
+    }
+    else {
+        const char KIND[] = "{\"kind\": \"";
+        const char PATH[] = "\", \"path\": \"";
+        const char OLD[] = "\", \"old\": ";
+        const char NEW[] = ", \"new\": ";
+        const char DELTA[] = ", \"delta\": ";
+        reserve(2 + sizeof(KIND) + kind_len + sizeof(PATH) + record.path_len_ * 6 + sizeof(OLD)
+                + sizeof(NEW) + sizeof(DELTA) + NUMBERS + 2);
+        if (format_ == FORMAT_JSON) {
+            put(count_ == 0 ? "[\n" : ",\n", 2);
+        }
+        put(KIND, sizeof(KIND) - 1);
+        put(kind, kind_len);
+        put(PATH, sizeof(PATH) - 1);
+        put_path(record.path_, record.path_len_);
+        put(OLD, sizeof(OLD) - 1);
+        put_uint(record.old_size_);
+        put(NEW, sizeof(NEW) - 1);
+        put_uint(record.new_size_);
+        put(DELTA, sizeof(DELTA) - 1);
+        put_int(delta);
+        put('}');
+        if (format_ == FORMAT_NDJSON) {
+            put('\n');
+        }
+    }
+    count_++;
+}
+
+bool DiffWriter::finish()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!finished_) {
+        finished_ = true;
+        if (format_ == FORMAT_JSON) {
+            reserve(4);
+            put(count_ == 0 ? "[\n]\n" : "\n]\n", count_ == 0 ? 4 : 3);
+        }
+        flush();
+        if (fflush(fp_) != 0) {
+            failed_ = true;
+        }
+    }
+    return !failed_;
+}
+
+void DiffWriter::reserve(size_t len)
+{
+    if (used_ + len > buf_.size()) {
+        flush();
+        if (len > buf_.size()) {
+            buf_.resize(len);
+        }
+    }
+}
+
+void DiffWriter::flush()
+{
+    if (used_ > 0 && fwrite(buf_.data(), 1, used_, fp_) != used_) {
+        failed_ = true;
+    }
+    used_ = 0;
+}
+
+void DiffWriter::put_uint(uint64_t value)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n) {
+        put(digits[--n]);
+    }
+}
+
+void DiffWriter::put_int(int64_t value)
+{
+    if (value < 0) {
+        put('-');
+        put_uint(0 - (uint64_t)value);
+    }
+    else {
+        put_uint(value);
+    }
+}
+
+void DiffWriter::put_path(const char *path, size_t len)
+{
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = path[i];
+        if (format_ == FORMAT_TSV) {
+            if (c == '\t' || c == '\n' || c == '\\') {
+                put('\\');
+                put(c == '\t' ? 't' : c == '\n' ? 'n' : '\\');
+            }
+            else {
+                put(c);
+            }
+        }
+        else if (c == '"' || c == '\\') {
+            put('\\');
+            put(c);
+        }
+        else if (c < 0x20) {
+            put("\\u00", 4);
+            put(HEX[c >> 4]);
+            put(HEX[c & 0xf]);
+        }
+        else {
+            put(c);
+        }
+    }
+}
+
+std::string write_snapshot(const FileTree &tree, const std::string &root, bool binary, int version,
+        const JsonOptions &json)
+{
+    std::string file_path = make_snapshot_file_name(root, binary ? ".bin" : json_extension(json.compression_));
+    bool ok;
+    if (binary) {
+        BinaryWriter writer(tree);
+        ok = writer.write(file_path);
+    }
+    else {
+        ok = write_json_file(FileTreeView(tree), file_path, version, json);
+    }
+    return ok ? file_path : std::string();
+}
+
+void prepare_scan(FileTree &tree, const std::string &root, const ScanOptions &options)
+{
+    tree.filter().set_one_filesystem(options.one_filesystem_);
+    tree.filter().set_count_links(options.count_links_);
+    NameFilter names;
+    for (size_t i = 0; i < options.excludes_.size(); i++) {
+        names.exclude(options.excludes_[i]);
+    }
+    for (size_t i = 0; i < options.includes_.size(); i++) {
+        names.include(options.includes_[i]);
+    }
+    names.compile();
+    tree.filter().set_names(names);
+    tree.set_breakdown_by(options.breakdown_by_);
+    tree.set_counted(options.counted_);
+    tree.set_root(root);
+    tree.set_summarize(options.summarize_);
+    tree.filter().set_shard(options.shard_, options.nshards_, root);
+    tree.throttle().configure(options.max_ops_, uint64_t(options.target_latency_ * 1e9));
+    tree.set_stats(options.stats_);
+    tree.set_spill(options.spill_);
+    if (options.shard_ > 0) {
+        // so that the sizes of the shards add up, the root's own once
+        tree.root().size_ = 0;
+        tree.set_counts(0, NodeCounts());
+    }
+}
+
+bool scan(const std::string &root, const ScanOptions &options, FileTree &tree)
+{
+    const char *backend_name = ScanBackend::choose(options.backend_, root.c_str());
+    ScanBackend *backend = ScanBackend::create(backend_name, options.stats_);
+    if (!backend) {
+        LOG("unknown backend %s, expect posix, uring or auto", backend_name);
+        return false;
+    }
+    if (options.nshards_ > 1 && !options.count_links_) {
+        // no shard knows which inodes the others counted
+        LOG("%s", "WARN: files with hard links in more than one shard are counted once in each");
+    }
+    prepare_scan(tree, root, options);
+    if (options.checkpoint_.empty()) {
+        delete backend;
+        tree.walk_parallel(backend_name, options.depth_, options.jobs_);
+        return true;
+    }
+    Checkpoint checkpoint(options.checkpoint_, options.checkpoint_every_);
+    bool resumed = false;
+    const char *file_path = options.checkpoint_.c_str();
+    if (options.resume_) {
+        if (access(file_path, F_OK) != 0) {
+            LOG("no checkpoint at %s, walking it all", file_path);
+        }
+        else if (!tree.from_json(file_path)) {
+            LOG("WARN: failed to load checkpoint %s, walking it all", file_path);
+        }
+        else if (tree.name_str(tree.root()) != root) {
+            LOG("WARN: checkpoint %s is of %s, walking it all", file_path, tree.name_str(tree.root()).c_str());
+        }
+        else {
+            LOG("resuming from %s, %zu nodes kept, %zu directories pending", file_path, tree.size(), tree.npending());
+            if (!options.count_links_) {
+                // the checkpoint does not keep which inodes were counted
+                LOG("%s", "WARN: files with hard links on both sides of the checkpoint may be counted twice");
+            }
+            resumed = true;
+        }
+        if (!resumed) {
+            prepare_scan(tree, root, options);
+        }
+    }
+    tree.set_checkpoint(&checkpoint);
+    if (resumed) {
+        tree.resume(*backend, options.depth_);
+    }
+    else {
+        tree.walk(*backend, options.depth_);
+    }
+    tree.set_checkpoint(NULL);
+    delete backend;
+    return true;
+}
+
+void Checkpoint::save(FileTree &tree, Breakdown::Tally *tally)
+{
+    double start = now_sec();
+    if (tally) {
+        tally->flush(tree.breakdown());
+    }
+    std::string tmp_path = file_path_ + ".tmp";
+    JsonOptions json;
+    json.compact_ = true;
+    if (!write_json_file(FileTreeView(tree), tmp_path, SNAPSHOT_VERSION, json)
+            || rename(tmp_path.c_str(), file_path_.c_str()) != 0) {
+        LOG("WARN: failed to save checkpoint %s: %s", file_path_.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+    }
+    else {
+        LOG("checkpoint of %zu nodes, %zu directories pending, saved in %.3f s",
+                tree.size(), tree.npending(), now_sec() - start);
+    }
+    last_ = now_sec();
+}
+
+// to a buffer, as put_varint() does to a file
+void append_varint(std::vector<char> &buf, uint64_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+const char *const BREAKDOWN_DIMENSIONS[Breakdown::NDIMENSIONS] = {"uid", "gid", "ext"};
+
+void Breakdown::Tally::flush(Breakdown &breakdown)
+{
+    char key[16];
+    for (int d = BY_UID; d <= BY_GID; d++) {
+        for (std::unordered_map<uint32_t, Usage>::const_iterator it = ids_[d].begin(); it != ids_[d].end(); ++it) {
+            snprintf(key, sizeof(key), "%u", it->first);
+            breakdown.add(d, key, it->second);
+        }
+        ids_[d].clear();
+    }
+    for (std::unordered_map<std::string, Usage>::const_iterator it = exts_.begin(); it != exts_.end(); ++it) {
+        breakdown.add(BY_EXT, it->first, it->second);
+    }
+    exts_.clear();
+}
+
+bool Breakdown::parse_dimensions(const char *list, unsigned *dimensions)
+{
+    *dimensions = 0;
+    for (const char *p = list; ; p++) {
+        const char *comma = strchr(p, ',');
+        size_t len = comma ? size_t(comma - p) : strlen(p);
+        int dimension = find_dimension(p, len);
+        if (dimension < 0) {
+            return false;
+        }
+        *dimensions |= 1 << dimension;
+        if (!comma) {
+            return true;
+        }
+        p = comma;
+    }
+}
+
+const char *Breakdown::dimension_name(int dimension)
+{
+    return BREAKDOWN_DIMENSIONS[dimension];
+}
+
+int Breakdown::find_dimension(const char *name, size_t len)
+{
+    for (int d = 0; d < NDIMENSIONS; d++) {
+        if (strlen(BREAKDOWN_DIMENSIONS[d]) == len && 0 == memcmp(BREAKDOWN_DIMENSIONS[d], name, len)) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+bool Breakdown::empty() const
+{
+    for (int d = 0; d < NDIMENSIONS; d++) {
+        if (!tables_[d].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Breakdown::clear()
+{
+    for (int d = 0; d < NDIMENSIONS; d++) {
+        tables_[d].clear();
+    }
+}
+
+void Breakdown::encode(std::vector<char> &buf) const
+{
+    size_t count = 0;
+    for (int d = 0; d < NDIMENSIONS; d++) {
+        count += tables_[d].size();
+    }
+    append_varint(buf, count);
+    for (int d = 0; d < NDIMENSIONS; d++) {
+        for (Table::const_iterator it = tables_[d].begin(); it != tables_[d].end(); ++it) {
+            append_varint(buf, d);
+            append_varint(buf, it->first.size());
+            buf.insert(buf.end(), it->first.begin(), it->first.end());
+            append_varint(buf, it->second.size_);
+            append_varint(buf, it->second.count_);
+        }
+    }
+}
+
+bool Breakdown::decode(const uint8_t *p, const uint8_t *end)
+{
+    uint64_t count;
+    if ((p = get_varint(p, end, &count)) == NULL) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t dimension, len;
+        Usage usage;
+        if ((p = get_varint(p, end, &dimension)) == NULL
+                || (p = get_varint(p, end, &len)) == NULL
+                || len > uint64_t(end - p)) {
+            return false;
+        }
+        std::string key(reinterpret_cast<const char *>(p), len);
+        p += len;
+        if ((p = get_varint(p, end, &usage.size_)) == NULL
+                || (p = get_varint(p, end, &usage.count_)) == NULL) {
+            return false;
+        }
+        if (dimension < NDIMENSIONS) {
+            add(dimension, key, usage);
+        }
+    }
+    return true;
+}
+
+void append_block(std::vector<char> &buf, uint32_t type, const std::vector<char> &payload)
+{
+    HistoryBlock block;
+    block.type_ = type;
+    block.reserved_ = 0;
+    block.length_ = (payload.size() + 7) & ~(size_t)7;
+    const char *p = reinterpret_cast<const char *>(&block);
+    buf.insert(buf.end(), p, p + sizeof(block));
+    buf.insert(buf.end(), payload.begin(), payload.end());
+    buf.resize(buf.size() + block.length_ - payload.size(), 0);
+}
+
+HistoryStore::HistoryStore()
+: data_(NULL)
+, size_(0)
+, end_(0)
+, paths_loaded_(false)
+{}
+
+bool HistoryStore::open(const std::string &file_path)
+{
+    file_path_ = file_path;
+    paths_loaded_ = false;
+    paths_.clear();
+    ids_.clear();
+    return map();
+}
+
+bool HistoryStore::map()
+{
+    unmap();
+    int fd = ::open(file_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOG("cannot open file %s: %s", file_path_.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG("cannot mmap %s: %s", file_path_.c_str(), strerror(errno));
+        return false;
+    }
+    data_ = static_cast<const uint8_t *>(data);
+    size_ = st.st_size;
+
+    HistoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, data_, std::min(size_, sizeof(header)));
+    if (0 != memcmp(header.magic_, HISTORY_MAGIC, sizeof(HISTORY_MAGIC)) || header.version_ != HISTORY_VERSION) {
+        LOG("%s is not a history store of version %u", file_path_.c_str(), HISTORY_VERSION);
+        unmap();
+        return false;
+    }
+    // only the block headers and the column times are read here
+    size_t offset = sizeof(header);
+    while (size_ - offset >= sizeof(HistoryBlock)) {
+        HistoryBlock block;
+        memcpy(&block, data_ + offset, sizeof(block));
+        size_t payload = offset + sizeof(block);
+        if (block.length_ > size_ - payload || block.length_ % 8 != 0) {
+            break;
+        }
+        if (block.type_ == HISTORY_PATHS) {
+            path_blocks_.push_back(std::make_pair(payload, (size_t)block.length_));
+        }
+        else if (block.type_ == HISTORY_COLUMN && block.length_ >= 16) {
+            Column column;
+            memcpy(&column.time_, data_ + payload, 8);
+            memcpy(&column.count_, data_ + payload + 8, 8);
+            column.sizes_ = reinterpret_cast<const uint64_t *>(data_ + payload + 16);
+            if (column.count_ <= (block.length_ - 16) / 8) {
+                columns_.push_back(column);
+            }
+        }
+        offset = payload + block.length_;
+    }
+    end_ = offset;
+    if (end_ < size_) {
+        LOG("%s: ignored %zu bytes of a block cut short", file_path_.c_str(), size_ - end_);
+    }
+    std::stable_sort(columns_.begin(), columns_.end(), [](const Column &a, const Column &b) {
+        return a.time_ < b.time_;
+    });
+    return true;
+}
+
+void HistoryStore::unmap()
+{
+    if (data_) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+    data_ = NULL;
+    size_ = 0;
+    end_ = 0;
+    path_blocks_.clear();
+    columns_.clear();
+}
+
+bool HistoryStore::load_paths()
+{
+    if (paths_loaded_) {
+        return true;
+    }
+    for (size_t i = 0; i < path_blocks_.size(); i++) {
+        const uint8_t *p = data_ + path_blocks_[i].first;
+        const uint8_t *end = p + path_blocks_[i].second;
+        uint64_t count;
+        p = get_varint(p, end, &count);
+        for (uint64_t j = 0; p && j < count; j++) {
+            uint64_t len;
+            p = get_varint(p, end, &len);
+            if (p && len > (uint64_t)(end - p)) {
+                p = NULL;
+            }
+            if (p) {
+                intern(std::string(reinterpret_cast<const char *>(p), len));
+                p += len;
+            }
+        }
+        if (!p) {
+            LOG("%s: corrupt paths at offset %zu", file_path_.c_str(), path_blocks_[i].first);
+            return false;
+        }
+    }
+    paths_loaded_ = true;
+    return true;
+}
+
+uint32_t HistoryStore::intern(const std::string &path)
+{
+    std::unordered_map<std::string, uint32_t>::const_iterator it = ids_.find(path);
+    if (it != ids_.end()) {
+        return it->second;
+    }
+    uint32_t id = paths_.size();
+    paths_.push_back(path);
+    ids_.insert(std::make_pair(path, id));
+    return id;
+}
+
+bool HistoryStore::find(const std::string &path, uint32_t *id)
+{
+    if (!load_paths()) {
+        return false;
+    }
+    std::unordered_map<std::string, uint32_t>::const_iterator it = ids_.find(path);
+    if (it == ids_.end()) {
+        return false;
+    }
+    *id = it->second;
+    return true;
+}
+
+size_t HistoryStore::paths()
+{
+    return load_paths() ? paths_.size() : 0;
+}
+
+int HistoryStore::lock()
+{
+    int fd = ::open(file_path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG("cannot open file %s: %s", file_path_.c_str(), strerror(errno));
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            LOG("cannot lock %s: %s", file_path_.c_str(), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    // only appends change the store, so one of the same size is the same
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != size_ && !open(file_path_))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool HistoryStore::write(int fd, size_t npaths, int64_t time, const std::vector<uint64_t> &sizes)
+{
+    std::vector<char> buf;
+    if (end_ == 0) {
+        HistoryHeader header;
+        memcpy(header.magic_, HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+        header.version_ = HISTORY_VERSION;
+        header.reserved_ = 0;
+        const char *p = reinterpret_cast<const char *>(&header);
+        buf.insert(buf.end(), p, p + sizeof(header));
+    }
+    std::vector<char> payload;
+    if (paths_.size() > npaths) {
+        append_varint(payload, paths_.size() - npaths);
+        for (size_t i = npaths; i < paths_.size(); i++) {
+            append_varint(payload, paths_[i].size());
+            payload.insert(payload.end(), paths_[i].begin(), paths_[i].end());
+        }
+        append_block(buf, HISTORY_PATHS, payload);
+    }
+    uint64_t count = sizes.size();
+    payload.resize(16 + count * 8);
+    memcpy(&payload[0], &time, 8);
+    memcpy(&payload[8], &count, 8);
+    memcpy(payload.data() + 16, sizes.data(), count * 8);
+    append_block(buf, HISTORY_COLUMN, payload);
+
+    size_t done = 0;
+    bool ok = ftruncate(fd, end_) == 0;
+    while (ok && done < buf.size()) {
+        ssize_t n = pwrite(fd, buf.data() + done, buf.size() - done, end_ + done);
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    if (!ok) {
+        LOG("cannot write %s: %s", file_path_.c_str(), strerror(errno));
+    }
+    return ok;
+}
+
+} // namespace dmon